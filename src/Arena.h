@@ -0,0 +1,78 @@
+#ifndef Arena_h
+#define Arena_h
+
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <rct/List.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A bump allocator for data that lives exactly as long as its owner, e.g.
+   the names ClangIndexer collects for a translation unit. Nothing is freed
+   until the Arena is. Allocations bigger than a quarter of a block get a
+   block of their own so they don't waste the rest of the current one.
+*/
+
+class Arena
+{
+public:
+    Arena(size_t blockSize = 64 * 1024)
+        : mBlockSize(blockSize), mCurrent(0), mUsed(0), mSize(0)
+    {}
+    ~Arena()
+    {
+        for (char *block : mBlocks)
+            free(block);
+    }
+
+    void *allocate(size_t size, size_t align = sizeof(void*))
+    {
+        if (size > mBlockSize / 4) {
+            char *block = static_cast<char*>(malloc(size));
+            mBlocks.append(block);
+            mSize += size;
+            return block;
+        }
+        size_t offset = (mUsed + align - 1) & ~(align - 1);
+        if (!mCurrent || offset + size > mBlockSize) {
+            mCurrent = static_cast<char*>(malloc(mBlockSize));
+            mBlocks.append(mCurrent);
+            mSize += mBlockSize;
+            offset = 0;
+        }
+        mUsed = offset + size;
+        return mCurrent + offset;
+    }
+
+    // a nul-terminated copy
+    const char *strdup(const char *data, size_t size)
+    {
+        char *ret = static_cast<char*>(allocate(size + 1, 1));
+        memcpy(ret, data, size);
+        ret[size] = '\0';
+        return ret;
+    }
+
+    // bytes allocated from the system
+    size_t size() const { return mSize; }
+private:
+    const size_t mBlockSize;
+    List<char*> mBlocks;
+    char *mCurrent;
+    size_t mUsed, mSize;
+};
+
+#endif
@@ -21,6 +21,8 @@
 #include "VisitFileMessage.h"
 #include "VisitFileResponseMessage.h"
 #include "FileMap.h"
+#include "Pack.h"
+#include "Project.h"
 #include <rct/Connection.h>
 #include <rct/EventLoop.h>
 #include "RTags.h"
@@ -44,24 +46,42 @@ struct VerboseVisitorUserData {
 
 Flags<Server::Option> ClangIndexer::sServerOpts;
 ClangIndexer::ClangIndexer()
-    : mClangUnit(0), mIndex(0), mLastCursor(nullCursor), mVisitFileResponseMessageFileId(0),
-      mVisitFileResponseMessageVisit(0), mParseDuration(0), mVisitDuration(0),
+    : mClangUnit(0), mIndex(0), mLastCursor(nullCursor), mParseDuration(0), mVisitDuration(0),
       mBlocked(0), mAllowed(0), mIndexed(1), mVisitFileTimeout(0),
       mIndexDataMessageTimeout(0), mFileIdsQueried(0), mLogFile(0),
-      mConnection(Connection::create(RClient::NumOptions))
+      mConnection(Connection::create(RClient::NumOptions)), mWorker(false), mEngine(VisitorEngine),
+      mDeclarationsOnly(false)
 {
     mConnection->newMessage().connect(std::bind(&ClangIndexer::onMessage, this,
                                                 std::placeholders::_1, std::placeholders::_2));
 }
 
+ClangIndexer::ClangIndexer(const std::shared_ptr<Connection> &connection, CXIndex index,
+                           const std::function<bool()> &lastJob)
+    : mClangUnit(0), mIndex(index), mLastCursor(nullCursor), mParseDuration(0), mVisitDuration(0),
+      mBlocked(0), mAllowed(0), mIndexed(1), mVisitFileTimeout(0),
+      mIndexDataMessageTimeout(0), mFileIdsQueried(0), mLogFile(0),
+      mConnection(connection), mWorker(true), mLastJob(lastJob), mEngine(VisitorEngine),
+      mDeclarationsOnly(false)
+{
+    assert(mConnection);
+    assert(mIndex);
+    mConnection->newMessage().connect(std::bind(&ClangIndexer::onMessage, this,
+                                                std::placeholders::_1, std::placeholders::_2));
+}
+
 ClangIndexer::~ClangIndexer()
 {
     if (mLogFile)
         fclose(mLogFile);
     if (mClangUnit)
         clang_disposeTranslationUnit(mClangUnit);
-    if (mIndex)
+    if (mWorker) {
+        // the next job's indexer will connect to it
+        mConnection->newMessage().disconnect();
+    } else if (mIndex) {
         clang_disposeIndex(mIndex);
+    }
 }
 
 bool ClangIndexer::exec(const String &data)
@@ -78,8 +98,10 @@ bool ClangIndexer::exec(const String &data)
     Flags<IndexerJob::Flag> indexerJobFlags;
     uint32_t connectTimeout, connectAttempts;
     int32_t niceValue;
-    Hash<uint32_t, Path> blockedFiles;
+    Hash<uint32_t, Path> blockedFiles, claimedFiles;
     String dataDir;
+    uint32_t packGeneration, visitedGeneration;
+    Path visitedPath;
 
     deserializer >> id;
     deserializer >> socketFile;
@@ -95,7 +117,14 @@ bool ClangIndexer::exec(const String &data)
     deserializer >> sServerOpts;
     deserializer >> mUnsavedFiles;
     deserializer >> dataDir;
+    deserializer >> packGeneration;
+    deserializer >> visitedPath;
+    deserializer >> visitedGeneration;
     deserializer >> blockedFiles;
+    deserializer >> mReleasedFiles;
+    deserializer >> claimedFiles;
+    deserializer >> mPch >> mPchHeader;
+    deserializer >> mRemappedUsrs;
 
 #if 0
     while (true) {
@@ -113,7 +142,9 @@ bool ClangIndexer::exec(const String &data)
 
     const uint64_t parseTime = Rct::currentTimeMs();
 
-    if (niceValue != INT_MIN) {
+    static bool niced = false; // nice() is relative, a worker only does it once
+    if (niceValue != INT_MIN && !niced) {
+        niced = true;
         errno = 0;
         if (nice(niceValue) == -1) {
             error() << "Failed to nice rp" << Rct::strerror();
@@ -134,9 +165,32 @@ bool ClangIndexer::exec(const String &data)
         return false;
     }
 
+    const String engine = RTags::rtagsConfig(mSourceFile).value("indexer");
+    if (engine == "callbacks") {
+        mEngine = CallbackEngine;
+    } else if (engine == "compare") {
+        mEngine = CompareEngines;
+    } else if (!engine.isEmpty() && engine != "visitor") {
+        error() << "Unknown indexer" << engine << "in .rtags-config for" << mSourceFile;
+    }
+
+    if (visitedGeneration) {
+        String err;
+        if (!mVisitedSnapshot.load(visitedPath, visitedGeneration, &err)) {
+            error() << "Failed to load" << FileIdSnapshot::path(visitedPath, visitedGeneration) << err;
+            return false;
+        }
+    }
+
     Location::init(blockedFiles);
     Location::set(mSourceFile, mSource.fileId);
-    while (true) {
+    for (const auto &blocked : blockedFiles)
+        mBlockedFiles.insert(blocked.first);
+    for (const auto &claimed : claimedFiles) {
+        Location::set(claimed.second, claimed.first);
+        mClaimedFiles.insert(claimed.first);
+    }
+    while (!mConnection->isConnected()) {
         if (mConnection->connectUnix(socketFile, connectTimeout))
             break;
         if (!--connectAttempts) {
@@ -148,9 +202,12 @@ bool ClangIndexer::exec(const String &data)
     // mLogFile = fopen(String::format("/tmp/%s", mSourceFile.fileName()).constData(), "w");
     mIndexDataMessage.setProject(mProject);
     mIndexDataMessage.setIndexerJobFlags(indexerJobFlags);
+    mDeclarationsOnly = indexerJobFlags & IndexerJob::DeclarationsOnly;
     mIndexDataMessage.setParseTime(parseTime);
     mIndexDataMessage.setKey(mSource.key());
     mIndexDataMessage.setId(id);
+    if (mWorker)
+        mIndexDataMessage.setFlag(IndexDataMessage::Worker);
 
     assert(mConnection->isConnected());
     mIndexDataMessage.files()[mSource.fileId] |= IndexDataMessage::Visited;
@@ -159,7 +216,7 @@ bool ClangIndexer::exec(const String &data)
     String err;
     StopWatch sw;
     int writeDuration = -1;
-    if (!mClangUnit || !writeFiles(RTags::encodeSourceFilePath(dataDir, mProject, 0), err)) {
+    if (!mClangUnit || !writeFiles(RTags::encodeSourceFilePath(dataDir, mProject) + "pack", packGeneration, err)) {
         message += " error";
         if (!err.isEmpty())
             message += (' ' + err);
@@ -183,15 +240,22 @@ bool ClangIndexer::exec(const String &data)
     }
     if (mIndexDataMessage.indexerJobFlags() & IndexerJob::Dirty)
         message += " (dirty)";
+    if (mDeclarationsOnly)
+        message += " (declarations)";
     ++mFileIdsQueried;
 
     mIndexDataMessage.setMessage(message);
+    if (mLastJob && mLastJob())
+        mIndexDataMessage.setFlag(IndexDataMessage::LastJob);
     sw.restart();
     if (!mConnection->send(mIndexDataMessage)) {
         error() << "Couldn't send IndexDataMessage" << mSourceFile;
         return false;
     }
-    mConnection->finished().connect(std::bind(&EventLoop::quit, EventLoop::eventLoop()));
+    // rdm finishes the connection when it has the message, or acknowledges it
+    // if we're a worker and want to keep the connection for the next job
+    if (!mWorker)
+        mConnection->finished().connect(std::bind(&EventLoop::quit, EventLoop::eventLoop()));
     if (EventLoop::eventLoop()->exec(mIndexDataMessageTimeout) == EventLoop::Timeout) {
         error() << "Timed out sending IndexDataMessage" << mSourceFile;
         return false;
@@ -204,17 +268,110 @@ bool ClangIndexer::exec(const String &data)
 
 void ClangIndexer::onMessage(const std::shared_ptr<Message> &msg, const std::shared_ptr<Connection> &/*conn*/)
 {
+    if (msg->messageId() == ResponseMessage::MessageId) {
+        // rdm got our IndexDataMessage
+        assert(mWorker);
+        EventLoop::eventLoop()->quit();
+        return;
+    }
     assert(msg->messageId() == VisitFileResponseMessage::MessageId);
-    const std::shared_ptr<VisitFileResponseMessage> vm = std::static_pointer_cast<VisitFileResponseMessage>(msg);
-    mVisitFileResponseMessageVisit = vm->visit();
-    mVisitFileResponseMessageFileId = vm->fileId();
+    mVisitFileResponse = std::static_pointer_cast<VisitFileResponseMessage>(msg);
     assert(EventLoop::eventLoop());
     EventLoop::eventLoop()->quit();
 }
 
+void ClangIndexer::visitFiles(const List<Path> &resolved)
+{
+    ++mFileIdsQueried;
+    VisitFileMessage msg(resolved, mProject, mIndexDataMessage.key());
+
+    mVisitFileResponse.reset();
+    mConnection->send(msg);
+    StopWatch sw;
+    EventLoop::eventLoop()->exec(mVisitFileTimeout);
+    if (!mVisitFileResponse || mVisitFileResponse->fileIds().size() != resolved.size()) {
+        // timed out.
+        error() << "Error getting fileId for" << resolved << mLastCursor
+                << sw.elapsed() << mVisitFileTimeout;
+        exit(1);
+    }
+
+    for (int i=0; i<resolved.size(); ++i) {
+        const uint32_t id = mVisitFileResponse->fileIds().at(i);
+        if (!id)
+            continue;
+        Flags<IndexDataMessage::FileFlag> &flags = mIndexDataMessage.files()[id];
+        if (mVisitFileResponse->visit(id)) {
+            flags |= IndexDataMessage::Visited;
+            ++mIndexed;
+        }
+        Location::set(resolved.at(i), id);
+    }
+}
+
+static void inclusionVisitor(CXFile includedFile, CXSourceLocation *, unsigned int, CXClientData userData)
+{
+    CXString fn = clang_getFileName(includedFile);
+    if (const char *cstr = clang_getCString(fn))
+        reinterpret_cast<List<Path>*>(userData)->append(Path::resolved(cstr));
+    clang_disposeString(fn);
+}
+
+void ClangIndexer::visitInclusions()
+{
+    List<Path> inclusions;
+    clang_getInclusions(mClangUnit, inclusionVisitor, &inclusions);
+
+    List<Path> files;
+    Set<Path> seen;
+    for (const Path &path : inclusions) {
+        if (path.isEmpty() || !seen.insert(path))
+            continue;
+        const uint32_t id = fileId(path);
+        if (id && (mIndexDataMessage.files().contains(id) || isBlocked(id) || mClaimedFiles.contains(id)))
+            continue;
+        files.append(path);
+    }
+    if (!files.isEmpty())
+        visitFiles(files);
+}
+
+static void includeVisitor(CXFile includedFile, CXSourceLocation *stack, unsigned int depth, CXClientData userData)
+{
+    // depth 0 is the source file
+    if (depth)
+        reinterpret_cast<List<std::pair<CXSourceLocation, CXFile> >*>(userData)->append(std::make_pair(stack[0], includedFile));
+}
+
+void ClangIndexer::addInclusions()
+{
+    List<std::pair<CXSourceLocation, CXFile> > inclusions;
+    clang_getInclusions(mClangUnit, includeVisitor, &inclusions);
+    for (const auto &inclusion : inclusions) {
+        bool blocked = false;
+        const Location location = createLocation(inclusion.first, &blocked);
+        if (blocked || location.isNull())
+            continue;
+        const Location refLoc = createLocation(inclusion.second, 1, 1);
+        if (!refLoc.isNull())
+            mIndexDataMessage.includes().push_back(std::make_pair(location.fileId(), refLoc.fileId()));
+    }
+}
+
+uint32_t ClangIndexer::fileId(const Path &path)
+{
+    if (const uint32_t id = Location::fileId(path))
+        return id;
+    const uint32_t id = mVisitedSnapshot.fileId(path);
+    if (!id || mReleasedFiles.contains(id))
+        return 0;
+    Location::set(path, id);
+    return id;
+}
+
 Location ClangIndexer::createLocation(const Path &sourceFile, unsigned int line, unsigned int col, bool *blockedPtr)
 {
-    uint32_t id = Location::fileId(sourceFile);
+    uint32_t id = fileId(sourceFile);
     Path resolved;
     if (!id) {
         bool ok;
@@ -228,12 +385,26 @@ Location ClangIndexer::createLocation(const Path &sourceFile, unsigned int line,
         }
         if (!ok)
             return Location();
-        id = Location::fileId(resolved);
+        id = fileId(resolved);
         if (id)
             Location::set(sourceFile, id);
     }
     assert(!resolved.contains("/../"));
 
+    if (id && !mIndexDataMessage.files().contains(id)) {
+        if (mClaimedFiles.contains(id)) {
+            // rdm gave it to us with the job
+            mIndexDataMessage.files()[id] |= IndexDataMessage::Visited;
+            ++mIndexed;
+        } else if (blockedPtr && mWorker && !isBlocked(id)) {
+            // a worker knows the ids of every file its earlier jobs saw, that
+            // doesn't mean this job isn't supposed to index it
+            id = 0;
+            if (resolved.isEmpty())
+                resolved = sourceFile.resolved();
+        }
+    }
+
     if (id) {
         if (blockedPtr) {
             Hash<uint32_t, Flags<IndexDataMessage::FileFlag> >::iterator it = mIndexDataMessage.files().find(id);
@@ -261,40 +432,20 @@ Location ClangIndexer::createLocation(const Path &sourceFile, unsigned int line,
         return Location(id, line, col);
     }
 
-    ++mFileIdsQueried;
-    VisitFileMessage msg(resolved, mProject, mIndexDataMessage.key());
-
-    mVisitFileResponseMessageFileId = UINT_MAX;
-    mVisitFileResponseMessageVisit = false;
-    mConnection->send(msg);
-    StopWatch sw;
-    EventLoop::eventLoop()->exec(mVisitFileTimeout);
-    switch (mVisitFileResponseMessageFileId) {
-    case 0:
+    // not one of the inclusions visitFiles() asked about up front
+    List<Path> files;
+    files << resolved;
+    visitFiles(files);
+    id = mVisitFileResponse->fileIds().first();
+    if (!id)
         return Location();
-    case UINT_MAX:
-        // timed out.
-        if (mVisitFileResponseMessageFileId == UINT_MAX) {
-            error() << "Error getting fileId for" << resolved << mLastCursor
-                    << sw.elapsed() << mVisitFileTimeout;
-        }
-        exit(1);
-    default:
-        id = mVisitFileResponseMessageFileId;
-        break;
-    }
-    Flags<IndexDataMessage::FileFlag> &flags = mIndexDataMessage.files()[id];
-    if (mVisitFileResponseMessageVisit) {
-        flags |= IndexDataMessage::Visited;
-        ++mIndexed;
-    }
-    // fprintf(mLogFile, "%s %s\n", file.second ? "WON" : "LOST", resolved.constData());
+    const bool visit = mVisitFileResponse->visit(id);
+    // fprintf(mLogFile, "%s %s\n", visit ? "WON" : "LOST", resolved.constData());
 
-    Location::set(resolved, id);
     if (resolved != sourceFile)
         Location::set(sourceFile, id);
 
-    if (blockedPtr && !mVisitFileResponseMessageVisit) {
+    if (blockedPtr && !visit) {
         *blockedPtr = true;
         return Location();
     }
@@ -355,54 +506,97 @@ static inline void tokenize(const char *buf, int start,
     }
 }
 
+// Whether the symbol name of something in a scope of this kind starts with
+// the name of the scope
+static inline bool symbolNameIncludesScope(CXCursorKind scope, bool isNamespace)
+{
+    switch (scope) {
+    case CXCursor_ClassDecl:
+    case CXCursor_ClassTemplate:
+    case CXCursor_StructDecl:
+        return true;
+    case CXCursor_Namespace:
+        // namespaces can include all namespaces in their symbolname
+        return isNamespace;
+    default:
+        break;
+    }
+    return false;
+}
+
+// Stops at the first semantic parent that is unnamed or doesn't need
+// qualifiers, like the walk addNamePermutations() used to do per symbol.
+const ClangIndexer::QualifiedName &ClangIndexer::qualifiedName(const CXCursor &scope)
+{
+    auto it = mQualifiedNames.find(scope);
+    if (it != mQualifiedNames.end())
+        return it->second;
+
+    QualifiedName ret;
+    ret.symbolStart[0] = ret.symbolStart[1] = 0;
+    CXStringScope displayName(clang_getCursorDisplayName(scope));
+    const char *name = displayName.data();
+    if (name && *name) {
+        const CXCursor parent = clang_getCursorSemanticParent(scope);
+        const CXCursorKind kind = clang_getCursorKind(parent);
+        if (RTags::needsQualifiers(kind)) {
+            const QualifiedName &prefix = qualifiedName(parent);
+            if (!prefix.name.isEmpty()) {
+                ret.name.reserve(prefix.name.size() + 2 + strlen(name));
+                ret.name = prefix.name;
+                ret.name.append("::");
+                for (int i=0; i<2; ++i)
+                    ret.symbolStart[i] = symbolNameIncludesScope(kind, i) ? prefix.symbolStart[i] : ret.name.size();
+            }
+        }
+        ret.name.append(name);
+    }
+    return (mQualifiedNames[scope] = std::move(ret));
+}
+
 String ClangIndexer::addNamePermutations(const CXCursor &cursor, const Location &location,
                                          String type, RTags::CursorType cursorType)
 {
-    CXCursorKind kind = clang_getCursorKind(cursor);
-    const CXCursorKind originalKind = kind;
+    const CXCursorKind originalKind = clang_getCursorKind(cursor);
     char buf[32768];
     int pos = sizeof(buf) - 1;
     buf[pos] = '\0';
     int cutoff = -1;
 
-    CXCursor c = cursor;
-    do {
-        CXStringScope displayName(clang_getCursorDisplayName(c));
+    // the cursor's own name goes at the end of buf and the qualified name of
+    // its scope, built once per scope, in front of it
+    {
+        CXStringScope displayName(clang_getCursorDisplayName(cursor));
         const char *name = displayName.data();
-        if (!name)
-            break;
-        const int len = strlen(name);
-        if (!len)
-            break;
-
-        if (pos != sizeof(buf) - 1 && (pos -= 2) >= 0) {
-            memset(buf + pos, ':', 2);
-        }
-        pos -= len;
-        if (pos < 0) {
-            error("SymbolName too long. Giving up");
-            return String();
-        }
-        memcpy(buf + pos, name, len);
-
-        c = clang_getCursorSemanticParent(c);
-        kind = clang_getCursorKind(c);
-        if (cutoff == -1) {
-            switch (kind) {
-            case CXCursor_ClassDecl:
-            case CXCursor_ClassTemplate:
-            case CXCursor_StructDecl:
-                break;
-            case CXCursor_Namespace:
-                // namespaces can include all namespaces in their symbolname
-                if (originalKind == CXCursor_Namespace)
-                    break;
-            default:
+        const int len = name ? strlen(name) : 0;
+        if (len) {
+            pos -= len;
+            if (pos < 0) {
+                error("SymbolName too long. Giving up");
+                return String();
+            }
+            memcpy(buf + pos, name, len);
+            const CXCursor parent = clang_getCursorSemanticParent(cursor);
+            const CXCursorKind kind = clang_getCursorKind(parent);
+            const bool isNamespace = originalKind == CXCursor_Namespace;
+            if (!symbolNameIncludesScope(kind, isNamespace))
                 cutoff = pos;
-                break;
+            if (RTags::needsQualifiers(kind)) {
+                const QualifiedName &prefix = qualifiedName(parent);
+                if (!prefix.name.isEmpty()) {
+                    pos -= prefix.name.size() + 2;
+                    if (pos < 0) {
+                        error("SymbolName too long. Giving up");
+                        return String();
+                    }
+                    memcpy(buf + pos, prefix.name.constData(), prefix.name.size());
+                    memset(buf + pos + prefix.name.size(), ':', 2);
+                    if (cutoff == -1)
+                        cutoff = pos + prefix.symbolStart[isNamespace];
+                }
             }
         }
-    } while (RTags::needsQualifiers(kind));
+    }
 
     if (type.isEmpty()) {
         switch (originalKind) {
@@ -449,8 +643,8 @@ String ClangIndexer::addNamePermutations(const CXCursor &cursor, const Location
     for (int i=0; i<2; ++i) {
         for (int j=0; j<colonColonCount; ++j) {
             const char *ch = buf + colonColons[j];
-            const String name(ch, sizeof(buf) - (ch - buf) - 1);
-            unit(location.fileId())->symbolNames[name].insert(location);
+            const size_t size = sizeof(buf) - (ch - buf) - 1;
+            addSymbolName(location, ch, size);
             if (!type.isEmpty() && (originalKind != CXCursor_ParmDecl || !strchr(ch, '('))) {
                 // We only want to add the type to the final declaration for ParmDecls
                 // e.g.
@@ -463,7 +657,7 @@ String ClangIndexer::addNamePermutations(const CXCursor &cursor, const Location
                 // or
                 // void foo(int)::int bar
 
-                unit(location.fileId())->symbolNames[type + name].insert(location);
+                addSymbolName(location, ch, size, type);
             }
         }
 
@@ -593,7 +787,8 @@ CXChildVisitResult ClangIndexer::indexVisitor(CXCursor cursor, CXCursor parent,
 
     const CXCursorKind kind = clang_getCursorKind(cursor);
     const RTags::CursorType type = RTags::cursorType(kind);
-    if (type == RTags::Type_Other) {
+    if (type == RTags::Type_Other
+        || (type == RTags::Type_Reference && indexer->mDeclarationsOnly && kind != CXCursor_CXXBaseSpecifier)) {
         indexer->mLastLocation.clear();
         return CXChildVisit_Recurse;
     }
@@ -680,6 +875,167 @@ CXChildVisitResult ClangIndexer::indexVisitor(CXCursor cursor, CXCursor parent,
     return CXChildVisit_Recurse;
 }
 
+CXChildVisitResult ClangIndexer::preprocessingVisitor(CXCursor cursor, CXCursor parent, CXClientData data)
+{
+    // The indexing API doesn't report the inclusion directives, macro
+    // definitions and expansions. They're all children of the translation
+    // unit so there's no need to recurse.
+    if (clang_isPreprocessing(clang_getCursorKind(cursor)))
+        indexVisitor(cursor, parent, data);
+    return CXChildVisit_Continue;
+}
+
+bool ClangIndexer::locateCursor(const CXCursor &cursor, Location &location)
+{
+    bool blocked = false;
+    location = createLocation(cursor, &blocked);
+    if (blocked) {
+        ++mBlocked;
+        return false;
+    } else if (location.isNull()) {
+        return false;
+    }
+    ++mAllowed;
+    return true;
+}
+
+void ClangIndexer::indexDeclaration(CXClientData data, const CXIdxDeclInfo *info)
+{
+    ClangIndexer *indexer = static_cast<ClangIndexer*>(data);
+    // the visitor never sees implicit declarations
+    if (info->isImplicit)
+        return;
+    const CXCursor cursor = info->cursor;
+    const CXCursorKind kind = clang_getCursorKind(cursor);
+    if (RTags::cursorType(kind) != RTags::Type_Cursor)
+        return;
+
+    const Updater<CXCursor> lastCursorUpdater(indexer->mLastCursor, cursor);
+    Location loc;
+    if (!indexer->locateCursor(cursor, loc)) {
+        indexer->mLastLocation.clear();
+        return;
+    }
+    const Updater<Location> lastLocationUpdater(indexer->mLastLocation, loc);
+    if (Symbol::isClass(kind))
+        indexer->mLastClass = loc;
+    indexer->handleCursor(cursor, kind, loc);
+    if (Symbol::isClass(kind)) {
+        // the visitor gets to these as children of the class
+        if (const CXIdxCXXClassDeclInfo *classInfo = clang_index_getCXXClassDeclInfo(info)) {
+            for (unsigned int i=0; i<classInfo->numBases; ++i)
+                indexer->handleBaseClassSpecifier(classInfo->bases[i]->cursor);
+        }
+    }
+}
+
+void ClangIndexer::indexEntityReference(CXClientData data, const CXIdxEntityRefInfo *info)
+{
+    ClangIndexer *indexer = static_cast<ClangIndexer*>(data);
+    if (info->kind == CXIdxEntityRef_Implicit || !info->referencedEntity || indexer->mDeclarationsOnly)
+        return;
+    const CXCursor cursor = info->cursor;
+    const CXCursorKind kind = clang_getCursorKind(cursor);
+    if (RTags::cursorType(kind) != RTags::Type_Reference)
+        return;
+
+    const Updater<CXCursor> lastCursorUpdater(indexer->mLastCursor, cursor);
+    Location loc;
+    if (!indexer->locateCursor(cursor, loc)) {
+        indexer->mLastLocation.clear();
+        return;
+    }
+    const Updater<Location> lastLocationUpdater(indexer->mLastLocation, loc);
+    // there's no AST parent here, the container (function, class etc) is
+    // the closest thing
+    const CXCursor parent = info->container ? info->container->cursor : nullCursor;
+    indexer->handleReference(cursor, kind, loc, info->referencedEntity->cursor, parent);
+}
+
+void ClangIndexer::indexCallbacks()
+{
+    clang_visitChildren(clang_getTranslationUnitCursor(mClangUnit),
+                        ClangIndexer::preprocessingVisitor, this);
+
+    IndexerCallbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.indexDeclaration = ClangIndexer::indexDeclaration;
+    callbacks.indexEntityReference = ClangIndexer::indexEntityReference;
+    CXIndexAction action = clang_IndexAction_create(mIndex);
+    // the visitor indexes locals and parameters too
+    const int ret = clang_indexTranslationUnit(action, this, &callbacks, sizeof(callbacks),
+                                               CXIndexOpt_IndexFunctionLocalSymbols, mClangUnit);
+    clang_IndexAction_dispose(action);
+    if (ret)
+        error() << "clang_indexTranslationUnit failed for" << mSourceFile << ret;
+    mLastCursor = nullCursor;
+    mLastLocation.clear();
+}
+
+void ClangIndexer::compareEngines()
+{
+    // the callbacks go first, everything they did but their units is undone
+    // so the visitor starts from the same place and the message only has
+    // what the visitor found
+    const Includes includes = mIndexDataMessage.includes();
+    const Declarations declarations = mIndexDataMessage.declarations();
+    const Hash<uint64_t, String> usrs = mIndexDataMessage.usrs();
+    const Hash<uint32_t, ClassHierarchy> baseClasses = mIndexDataMessage.baseClasses();
+    const List<IncludeDirective> includeDirectives = mIncludeDirectives;
+    const int blocked = mBlocked, allowed = mAllowed;
+    indexCallbacks();
+    Hash<uint32_t, std::shared_ptr<Unit> > callbackUnits;
+    std::swap(callbackUnits, mUnits);
+    mIndexDataMessage.includes() = includes;
+    mIndexDataMessage.declarations() = declarations;
+    mIndexDataMessage.usrs() = usrs;
+    mIndexDataMessage.baseClasses() = baseClasses;
+    mIncludeDirectives = includeDirectives;
+    mBlocked = blocked;
+    mAllowed = allowed;
+    mLastClass.clear();
+
+    clang_visitChildren(clang_getTranslationUnitCursor(mClangUnit),
+                        ClangIndexer::indexVisitor, this);
+
+    Set<uint32_t> fileIds;
+    for (const auto &u : mUnits)
+        fileIds.insert(u.first);
+    for (const auto &u : callbackUnits)
+        fileIds.insert(u.first);
+
+    int differences = 0;
+    for (uint32_t fileId : fileIds) {
+        if (!(mIndexDataMessage.files().value(fileId) & IndexDataMessage::Visited))
+            continue;
+        Pack::SegmentMaps maps[2];
+        std::shared_ptr<Unit> &callbackUnit = callbackUnits[fileId];
+        if (!callbackUnit)
+            callbackUnit.reset(new Unit);
+        String err;
+        if (!encodeUnit(*unit(fileId), maps[0], &err) || !encodeUnit(*callbackUnit, maps[1], &err)) {
+            error() << "Can't compare indexers for" << Location::path(fileId) << err;
+            ++differences;
+            continue;
+        }
+        for (int type=0; type<Project::FileMapTypeCount; ++type) {
+            String encoded[2];
+            for (int i=0; i<2; ++i) {
+                for (const String &piece : maps[i].at(type))
+                    encoded[i] += piece;
+            }
+            if (encoded[0] != encoded[1]) {
+                error() << "Indexers disagree on" << Project::fileMapName(static_cast<Project::FileMapType>(type))
+                        << "for" << Location::path(fileId) << "visitor:" << encoded[0].size()
+                        << "bytes, callbacks:" << encoded[1].size() << "bytes";
+                ++differences;
+            }
+        }
+    }
+    if (!differences)
+        warning() << "Indexers agree on" << mSourceFile;
+}
+
 static inline bool isImplicit(const CXCursor &cursor)
 {
     return clang_equalLocations(clang_getCursorLocation(cursor),
@@ -829,14 +1185,14 @@ bool ClangIndexer::handleReference(const CXCursor &cursor, CXCursorKind kind,
         break;
     }
 
-    const String refUsr = usr(ref);
-    if (refUsr.isEmpty()) {
+    const uint64_t refUsr = usrId(usr(ref));
+    if (!refUsr) {
         return false;
     }
 
     bool reffedCursorFound;
     auto reffedCursor = findSymbol(refLoc, &reffedCursorFound);
-    Map<String, uint16_t> &targets = unit(location.fileId())->targets[location];
+    const std::shared_ptr<Unit> u = unit(location);
     uint16_t refTargetValue;
     if (reffedCursorFound) {
         refTargetValue = reffedCursor.targetsValue();
@@ -844,9 +1200,8 @@ bool ClangIndexer::handleReference(const CXCursor &cursor, CXCursorKind kind,
         refTargetValue = RTags::createTargetsValue(refKind, clang_isCursorDefinition(ref));
     }
 
-    assert(!refUsr.isEmpty());
-    targets[refUsr] = refTargetValue;
-    Symbol &c = unit(location)->symbols[location];
+    u->addTarget(location, refUsr, refTargetValue);
+    Symbol &c = u->symbols[location];
     if (cursorPtr)
         *cursorPtr = &c;
 
@@ -868,6 +1223,20 @@ bool ClangIndexer::handleReference(const CXCursor &cursor, CXCursorKind kind,
     if (!c.isNull()) {
         if (RTags::isCursor(c.kind))
             return true;
+        // The latest value of each usr at location, in usr id order. Targets
+        // used to be keyed by usr string so ties in rank are now settled by
+        // id instead: the lowest id wins among declarations and the highest
+        // among definitions.
+        List<std::pair<uint64_t, uint16_t> > targets;
+        for (uint32_t idx = u->lastTargets.value(location.value); idx; idx = u->targets.at(idx - 1).previous) {
+            const Unit::Target &target = u->targets.at(idx - 1);
+            auto it = targets.begin();
+            while (it != targets.end() && it->first != target.usr)
+                ++it;
+            if (it == targets.end())
+                targets.append(std::make_pair(target.usr, target.value));
+        }
+        std::sort(targets.begin(), targets.end());
         auto best = targets.end();
         int bestRank = -1;
         for (auto it = targets.begin(); it != targets.end(); ++it) {
@@ -933,7 +1302,7 @@ void ClangIndexer::addOverriddenCursors(const CXCursor &cursor, const Location &
         // assert(!locCursor.usr.isEmpty());
 
         // error() << location << "targets" << overridden[i];
-        unit(location)->targets[location][usr] = 0;
+        unit(location)->addTarget(location, usrId(usr), 0);
         addOverriddenCursors(overridden[i], location);
     }
     clang_disposeOverriddenCursors(overridden);
@@ -954,14 +1323,16 @@ void ClangIndexer::handleInclude(const CXCursor &cursor, CXCursorKind kind, cons
             String include = "#include ";
             const Path path = refLoc.path();
             assert(mSource.fileId);
-            unit(location.fileId())->symbolNames[(include + path)].insert(location);
-            unit(location.fileId())->symbolNames[(include + path.fileName())].insert(location);
+            addSymbolName(location, path.constData(), path.size(), include);
+            addSymbolName(location, path.fileName(), strlen(path.fileName()), include);
             mIndexDataMessage.includes().push_back(std::make_pair(location.fileId(), refLoc.fileId()));
+            if (location.fileId() == mSource.fileId)
+                mIncludeDirectives.append({ location.line(), includedFile, refLoc.fileId() });
             c.symbolName = "#include " + RTags::eatString(clang_getCursorDisplayName(cursor));
             c.kind = cursor.kind;
             c.symbolLength = c.symbolName.size() + 2;
             c.location = location;
-            unit(location)->targets[location][refLoc.path()] = 0; // ### what targets value to create for this?
+            unit(location)->addTarget(location, RTags::fileUsrId(refLoc.fileId()), 0); // ### what targets value to create for this?
             // this fails for things like:
             // # include    <foobar.h>
             return;
@@ -991,6 +1362,7 @@ void ClangIndexer::handleBaseClassSpecifier(const CXCursor &cursor)
     }
     assert(!usr.isEmpty());
     lastClass.baseClasses << usr;
+    mIndexDataMessage.baseClasses()[mLastClass.fileId()][usrId(lastClass.usr)].insert(usrId(usr));
 }
 
 bool ClangIndexer::handleCursor(const CXCursor &cursor, CXCursorKind kind, const Location &location, Symbol **cursorPtr)
@@ -1101,10 +1473,18 @@ bool ClangIndexer::handleCursor(const CXCursor &cursor, CXCursorKind kind, const
     // their definition and their declaration.  Using the canonical
     // cursor's usr allows us to join them. Check JSClassRelease in
     // JavaScriptCore for an example.
-    unit(location)->usrs[c.usr].insert(location);
+    const uint64_t id = usrId(c.usr);
+    unit(location)->usrs.append(std::make_pair(id, location.value));
+    String &dictionaryUsr = mIndexDataMessage.usrs()[id];
+    if (dictionaryUsr.isEmpty()) {
+        dictionaryUsr = c.usr;
+    } else if (dictionaryUsr != c.usr) {
+        // rdm only hears about the first one so it can't remap the other
+        error() << "Usr collision in" << mSourceFile << dictionaryUsr << "and" << c.usr;
+    }
     if (c.linkage == CXLinkage_External && !c.isDefinition()) {
-        mIndexDataMessage.declarations()[c.usr].insert(location.fileId());
-        unit(location.fileId())->targets[location][usr] = RTags::createTargetsValue(kind, true);
+        mIndexDataMessage.declarations()[id].insert(location.fileId());
+        unit(location)->addTarget(location, id, RTags::createTargetsValue(kind, true));
     }
 
     if (!(ClangIndexer::serverOpts() & Server::NoComments)) {
@@ -1141,7 +1521,7 @@ bool ClangIndexer::handleCursor(const CXCursor &cursor, CXCursorKind kind, const
     case CXCursor_Constructor:
     case CXCursor_Destructor:
         assert(!::usr(clang_getCursorSemanticParent(cursor)).isEmpty());
-        unit(location.fileId())->targets[location][::usr(clang_getCursorSemanticParent(cursor))] = 0;
+        unit(location)->addTarget(location, usrId(::usr(clang_getCursorSemanticParent(cursor))), 0);
         break;
     default:
         break;
@@ -1150,15 +1530,31 @@ bool ClangIndexer::handleCursor(const CXCursor &cursor, CXCursorKind kind, const
     return true;
 }
 
+static bool hasFatalError(CXTranslationUnit unit)
+{
+    const unsigned int count = clang_getNumDiagnostics(unit);
+    for (unsigned int i=0; i<count; ++i) {
+        CXDiagnostic diagnostic = clang_getDiagnostic(unit, i);
+        const bool fatal = clang_getDiagnosticSeverity(diagnostic) == CXDiagnostic_Fatal;
+        clang_disposeDiagnostic(diagnostic);
+        if (fatal)
+            return true;
+    }
+    return false;
+}
+
 bool ClangIndexer::parse()
 {
     StopWatch sw;
     assert(!mClangUnit);
-    assert(!mIndex);
-    mIndex = clang_createIndex(0, 1);
+    if (!mIndex)
+        mIndex = clang_createIndex(0, 1);
     assert(mIndex);
     const Flags<Source::CommandLineFlag> commandLineFlags = Source::Default;
-    const Flags<CXTranslationUnit_Flags> flags = CXTranslationUnit_DetailedPreprocessingRecord;
+    // the declarations only pass doesn't want the macros and the bodies
+    const Flags<CXTranslationUnit_Flags> flags = (mDeclarationsOnly
+                                                  ? CXTranslationUnit_SkipFunctionBodies
+                                                  : CXTranslationUnit_DetailedPreprocessingRecord);
     List<CXUnsavedFile> unsavedFiles(mUnsavedFiles.size() + 1);
     int unsavedIndex = 0;
     for (const auto &it : mUnsavedFiles) {
@@ -1175,8 +1571,39 @@ bool ClangIndexer::parse()
     // for (const auto it : mSource.toCommandLine(commandLineFlags)) {
     //     error("[%s]", it.constData());
     // }
-    RTags::parseTranslationUnit(mSourceFile, mSource.toCommandLine(commandLineFlags), mClangUnit,
-                                mIndex, &unsavedFiles[0], unsavedIndex, flags, &mClangLine);
+    const List<String> arguments = mSource.toCommandLine(commandLineFlags);
+    if (!mPchHeader.isEmpty() && !buildPch(arguments)) {
+        mIndexDataMessage.setFlag(IndexDataMessage::PchFailure);
+        mPch.clear();
+    }
+    if (!mPch.isEmpty()) {
+        List<String> withPch = arguments;
+        withPch << "-include-pch" << mPch;
+        RTags::parseTranslationUnit(mSourceFile, withPch, mClangUnit,
+                                    mIndex, &unsavedFiles[0], unsavedIndex, flags, &mClangLine);
+        // A header in it changed or it doesn't go with our arguments after
+        // all, unless the source is just as broken without it. Then it's the
+        // source's fault and the pch is fine.
+        if (!mClangUnit || hasFatalError(mClangUnit)) {
+            CXTranslationUnit unit = 0;
+            RTags::parseTranslationUnit(mSourceFile, arguments, unit,
+                                        mIndex, &unsavedFiles[0], unsavedIndex, flags, &mClangLine);
+            if (!unit || (mClangUnit && hasFatalError(unit))) {
+                warning() << mSourceFile << "has errors with or without" << mPch;
+            } else {
+                warning() << "Couldn't use" << mPch << "for" << mSourceFile;
+                mIndexDataMessage.setFlag(IndexDataMessage::PchFailure);
+            }
+            if (mClangUnit)
+                clang_disposeTranslationUnit(mClangUnit);
+            mClangUnit = unit;
+            mPch.clear();
+        }
+    }
+    if (!mClangUnit) {
+        RTags::parseTranslationUnit(mSourceFile, arguments, mClangUnit,
+                                    mIndex, &unsavedFiles[0], unsavedIndex, flags, &mClangLine);
+    }
 
     warning() << "CI::parse loading unit:" << mClangLine << " " << (mClangUnit != 0);
     if (mClangUnit) {
@@ -1188,19 +1615,283 @@ bool ClangIndexer::parse()
     return false;
 }
 
-static inline Map<String, Set<Location> > convertTargets(const Map<Location, Map<String, uint16_t> > &in)
+bool ClangIndexer::buildPch(List<String> arguments)
 {
-    Map<String, Set<Location> > ret;
-    for (const auto &v : in) {
-        for (const auto &u : v.second) {
-            ret[u.first].insert(v.first);
+    StopWatch sw;
+    const char *language = 0;
+    switch (mSource.language) {
+    case Source::C: language = "c-header"; break;
+    case Source::ObjectiveC: language = "objective-c-header"; break;
+    case Source::ObjectiveCPlusPlus: language = "objective-c++-header"; break;
+    default: language = "c++-header"; break;
+    }
+    // the header has to be parsed as one, an -x the source was compiled
+    // with is turned into its -header form
+    auto header = [language](const String &lang) -> String {
+        if (lang.endsWith("-header"))
+            return lang;
+        if (lang == "c" || lang == "c++" || lang == "objective-c" || lang == "objective-c++")
+            return lang + "-header";
+        return language;
+    };
+    bool hasLanguage = false;
+    for (int i=0; i<arguments.size(); ++i) {
+        String &arg = arguments[i];
+        if (arg == "-x" && i + 1 < arguments.size()) {
+            ++i;
+            arguments[i] = header(arguments.at(i));
+            hasLanguage = true;
+        } else if (arg.startsWith("-x") && arg.size() > 2) {
+            arg = "-x" + header(arg.mid(2));
+            hasLanguage = true;
+        }
+    }
+    if (!hasLanguage)
+        arguments << "-x" << language;
+    Flags<CXTranslationUnit_Flags> flags = CXTranslationUnit_DetailedPreprocessingRecord;
+    flags |= CXTranslationUnit_Incomplete;
+    flags |= CXTranslationUnit_ForSerialization;
+    // without our unsaved files, the pch is for everyone
+    CXTranslationUnit unit = 0;
+    RTags::parseTranslationUnit(mPchHeader, arguments, unit, mIndex, 0, 0, flags);
+    if (!unit) {
+        error() << "Failed to parse" << mPchHeader;
+        return false;
+    }
+    const Path tmp = mPch + ".tmp";
+    const int ret = clang_saveTranslationUnit(unit, tmp.constData(), clang_defaultSaveOptions(unit));
+    clang_disposeTranslationUnit(unit);
+    if (ret != CXSaveError_None || rename(tmp.constData(), mPch.constData())) {
+        error() << "Failed to save" << mPch << ret;
+        unlink(tmp.constData());
+        return false;
+    }
+    warning() << "Built" << mPch << "in" << sw.elapsed() << "ms";
+    return true;
+}
+
+// The lines of the #include directives a file starts with, before anything
+// but whitespace and comments.
+static List<unsigned int> leadingIncludes(const char *ch, int size)
+{
+    List<unsigned int> ret;
+    const char *end = ch + size;
+    unsigned int line = 1;
+    while (ch < end) {
+        switch (*ch) {
+        case '\n':
+            ++line;
+            // fall through
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\f':
+        case '\v':
+            ++ch;
+            break;
+        case '/':
+            if (ch + 1 < end && ch[1] == '/') {
+                ch = static_cast<const char*>(memchr(ch, '\n', end - ch));
+                if (!ch)
+                    return ret;
+            } else if (ch + 1 < end && ch[1] == '*') {
+                ch += 2;
+                while (ch + 1 < end && (ch[0] != '*' || ch[1] != '/')) {
+                    if (*ch == '\n')
+                        ++line;
+                    ++ch;
+                }
+                if (ch + 1 >= end)
+                    return ret;
+                ch += 2;
+            } else {
+                return ret;
+            }
+            break;
+        case '#': {
+            const char *directive = ch + 1;
+            while (directive < end && (*directive == ' ' || *directive == '\t'))
+                ++directive;
+            if (end - directive < 7 || strncmp(directive, "include", 7)
+                || (directive + 7 < end && (isalnum(directive[7]) || directive[7] == '_'))) {
+                return ret; // #include_next and everything else
+            }
+            ret.append(line);
+            ch = static_cast<const char*>(memchr(directive, '\n', end - directive));
+            if (!ch)
+                return ret;
+            break; }
+        default:
+            return ret;
         }
     }
     return ret;
 }
 
-bool ClangIndexer::writeFiles(const Path &root, String &error)
+void ClangIndexer::addIncludePrefix()
 {
+    if (mIncludeDirectives.isEmpty())
+        return;
+    const auto unsaved = mUnsavedFiles.find(mSourceFile);
+    const String contents = unsaved != mUnsavedFiles.end() ? unsaved->second : mSourceFile.readAll();
+    const List<unsigned int> lines = leadingIncludes(contents.constData(), contents.size());
+    std::sort(mIncludeDirectives.begin(), mIncludeDirectives.end(),
+              [](const IncludeDirective &l, const IncludeDirective &r) { return l.line < r.line; });
+    List<uint32_t> &prefix = mIndexDataMessage.includePrefix();
+    // headers without guards would be included twice with the pch
+    for (int i=0; i<lines.size() && i<mIncludeDirectives.size(); ++i) {
+        const IncludeDirective &directive = mIncludeDirectives.at(i);
+        if (directive.line != lines.at(i) || !clang_isFileMultipleIncludeGuarded(mClangUnit, directive.file))
+            break;
+        prefix.append(directive.fileId);
+    }
+}
+
+// The values of one key in the sorted pairs a Unit map is built from. It's
+// serialized the way the Set<Location> or List<uint64_t> the readers decode.
+struct ValueRun
+{
+    const uint64_t *data;
+    uint32_t size;
+};
+
+template <> inline Serializer &operator<<(Serializer &s, const ValueRun &run)
+{
+    s << run.size;
+    s.write(reinterpret_cast<const char*>(run.data), run.size * sizeof(uint64_t));
+    return s;
+}
+
+// Location orders by file, line and column, not by value
+static inline uint64_t locationOrder(uint64_t value)
+{
+    Location location;
+    location.value = value;
+    return ((static_cast<uint64_t>(location.fileId()) << (Location::LineBits + Location::ColumnBits))
+            | (static_cast<uint64_t>(location.line()) << Location::ColumnBits)
+            | location.column());
+}
+
+static inline int compareNames(const KeyView &l, const KeyView &r)
+{
+    const int cmp = memcmp(l.data, r.data, std::min(l.size, r.size));
+    return cmp ? cmp : intCompare(l.size, r.size);
+}
+
+// Sorts pairs by key and then location and drops the duplicates. Returns one
+// run of values per key, pointing into values.
+template <typename Key, typename Less, typename Equal>
+static List<std::pair<Key, ValueRun> > group(List<std::pair<Key, uint64_t> > &pairs, List<uint64_t> &values,
+                                             Less less, Equal equal)
+{
+    std::sort(pairs.begin(), pairs.end(), less);
+    pairs.erase(std::unique(pairs.begin(), pairs.end(),
+                            [&equal](const std::pair<Key, uint64_t> &l, const std::pair<Key, uint64_t> &r) {
+                                return l.second == r.second && equal(l.first, r.first);
+                            }), pairs.end());
+    values.reserve(pairs.size());
+    for (const auto &pair : pairs)
+        values.append(pair.second);
+
+    List<std::pair<Key, ValueRun> > ret;
+    size_t i = 0;
+    while (i < static_cast<size_t>(pairs.size())) {
+        size_t j = i + 1;
+        while (j < static_cast<size_t>(pairs.size()) && equal(pairs.at(j).first, pairs.at(i).first))
+            ++j;
+        ret.append(std::make_pair(pairs.at(i).first, ValueRun { values.data() + i, static_cast<uint32_t>(j - i) }));
+        i = j;
+    }
+    return ret;
+}
+
+template <typename Key>
+static List<std::pair<Key, ValueRun> > groupByKey(List<std::pair<Key, uint64_t> > &pairs, List<uint64_t> &values)
+{
+    return group(pairs, values,
+                 [](const std::pair<Key, uint64_t> &l, const std::pair<Key, uint64_t> &r) {
+                     return l.first < r.first || (l.first == r.first && locationOrder(l.second) < locationOrder(r.second));
+                 },
+                 [](const Key &l, const Key &r) { return l == r; });
+}
+
+void ClangIndexer::addSymbolName(const Location &location, const char *name, size_t size, const String &prefix)
+{
+    const size_t total = prefix.size() + size;
+    char *data = static_cast<char*>(mArena.allocate(total + 1, 1));
+    memcpy(data, prefix.constData(), prefix.size());
+    memcpy(data + prefix.size(), name, size);
+    data[total] = '\0';
+    unit(location)->symbolNames.append(std::make_pair(KeyView(data, total), location.value));
+}
+
+// Sorts and merges what the unit collected, in place, and encodes the maps in
+// the order of Project::FileMapType, each in the pieces Pack::append() writes
+// as is.
+bool ClangIndexer::encodeUnit(Unit &unit, Pack::SegmentMaps &maps, String *error)
+{
+    maps.resize(Project::FileMapTypeCount);
+    if (!SymbolMap::encode(unit.symbols, maps[Project::Symbols], error))
+        return false;
+
+    {
+        List<uint64_t> values;
+        const auto runs = group(unit.symbolNames, values,
+                                [](const std::pair<KeyView, uint64_t> &l, const std::pair<KeyView, uint64_t> &r) {
+                                    const int cmp = compareNames(l.first, r.first);
+                                    return cmp < 0 || (!cmp && locationOrder(l.second) < locationOrder(r.second));
+                                },
+                                [](const KeyView &l, const KeyView &r) { return !compareNames(l, r); });
+        if (!FileMap<String, Set<Location> >::encode(runs, maps[Project::SymbolNames], error))
+            return false;
+    }
+
+    {
+        // refs are the usrs at each location, targets the locations of each usr
+        List<std::pair<uint64_t, uint64_t> > refs, targets;
+        refs.reserve(unit.targets.size());
+        for (const auto &target : unit.targets)
+            refs.append(std::make_pair(target.location, target.usr));
+        std::sort(refs.begin(), refs.end(),
+                  [](const std::pair<uint64_t, uint64_t> &l, const std::pair<uint64_t, uint64_t> &r) {
+                      const uint64_t lo = locationOrder(l.first), ro = locationOrder(r.first);
+                      return lo < ro || (lo == ro && l.second < r.second);
+                  });
+        refs.erase(std::unique(refs.begin(), refs.end()), refs.end());
+
+        targets.reserve(refs.size());
+        for (const auto &ref : refs)
+            targets.append(std::make_pair(ref.second, ref.first));
+        List<uint64_t> targetValues;
+        if (!FileMap<uint64_t, Set<Location> >::encode(groupByKey(targets, targetValues), maps[Project::Targets], error))
+            return false;
+
+        List<uint64_t> usrs;
+        usrs.reserve(refs.size());
+        List<std::pair<Location, ValueRun> > refRuns;
+        size_t i = 0;
+        while (i < static_cast<size_t>(refs.size())) {
+            size_t j = i;
+            while (j < static_cast<size_t>(refs.size()) && refs.at(j).first == refs.at(i).first)
+                usrs.append(refs.at(j++).second);
+            Location location;
+            location.value = refs.at(i).first;
+            refRuns.append(std::make_pair(location, ValueRun { usrs.data() + i, static_cast<uint32_t>(j - i) }));
+            i = j;
+        }
+        if (!FileMap<Location, List<uint64_t> >::encode(refRuns, maps[Project::Refs], error))
+            return false;
+    }
+
+    {
+        List<uint64_t> values;
+        return FileMap<uint64_t, Set<Location> >::encode(groupByKey(unit.usrs, values), maps[Project::Usrs], error);
+    }
+}
+
+bool ClangIndexer::writeFiles(const Path &pack, uint32_t generation, String &error)
+{
+    Hash<uint32_t, Pack::SegmentMaps> segments;
     for (const auto &unit : mUnits) {
         if (!mIndexDataMessage.files().value(unit.first) & IndexDataMessage::Visited) {
             ::error() << "Wanting to write something for" << Location::path(unit.first) << "but we didn't visit it" << mSource.sourceFile()
@@ -1211,44 +1902,23 @@ bool ClangIndexer::writeFiles(const Path &root, String &error)
             continue;
         }
         assert(mIndexDataMessage.files().value(unit.first) & IndexDataMessage::Visited);
-        String unitRoot = root;
-        unitRoot << unit.first;
-        Path::mkdir(unitRoot, Path::Recursive);
-        // ::error() << "Writing file" << Location::path(unit.first) << unitRoot << unit.second->symbols.size()
+        // ::error() << "Writing file" << Location::path(unit.first) << unit.second->symbols.size()
         //           << unit.second->targets.size()
         //           << unit.second->usrs.size()
         //           << unit.second->symbolNames.size();
-        if (!FileMap<Location, Symbol>::write(unitRoot + "/symbols", unit.second->symbols)) {
-            error = "Failed to write symbols";
-            return false;
-        }
-        if (!FileMap<String, Set<Location> >::write(unitRoot + "/targets", convertTargets(unit.second->targets))) {
-            error = "Failed to write targets";
-            return false;
-        }
-        if (!FileMap<String, Set<Location> >::write(unitRoot + "/usrs", unit.second->usrs)) {
-            error = "Failed to write usrs";
-            return false;
-        }
-        if (!FileMap<String, Set<Location> >::write(unitRoot + "/symnames", unit.second->symbolNames)) {
-            error = "Failed to write symbolNames";
+        String err;
+        if (!encodeUnit(*unit.second, segments[unit.first], &err)) {
+            error = "Failed to encode " + Location::path(unit.first) + ": " + err;
             return false;
         }
     }
-    String sourceRoot = root;
-    sourceRoot << mSource.fileId;
-    Path::mkdir(sourceRoot, Path::Recursive);
-    sourceRoot << "/info";
-    FILE *f = fopen(sourceRoot.constData(), "w");
-    if (!f) {
+
+    String err;
+    if (!Pack::append(pack, generation, segments, mIndexDataMessage.segments(), &err)) {
+        error = "Failed to write pack: ";
+        error += err;
         return false;
     }
-
-    fprintf(f, "%s\n%s\n",
-            mSourceFile.constData(),
-            String::join(mSource.toCommandLine(Source::Default|Source::IncludeCompiler|Source::IncludeSourceFile), " ").constData());
-    fclose(f);
-
     return true;
 }
 
@@ -1441,8 +2111,26 @@ bool ClangIndexer::visit()
 
     StopWatch watch;
 
-    clang_visitChildren(clang_getTranslationUnitCursor(mClangUnit),
-                        ClangIndexer::indexVisitor, this);
+    // one round trip for all the headers instead of one for each the first
+    // time the visitor runs into it
+    visitInclusions();
+    switch (mEngine) {
+    case VisitorEngine:
+        clang_visitChildren(clang_getTranslationUnitCursor(mClangUnit),
+                            ClangIndexer::indexVisitor, this);
+        break;
+    case CallbackEngine:
+        indexCallbacks();
+        break;
+    case CompareEngines:
+        compareEngines();
+        break;
+    }
+    if (mDeclarationsOnly) {
+        addInclusions();
+    } else {
+        addIncludePrefix();
+    }
 
     for (const auto &it : mIndexDataMessage.files()) {
         if (it.second & IndexDataMessage::Visited)
@@ -1511,11 +2199,10 @@ void ClangIndexer::addFileSymbol(uint32_t file)
 {
     const Location loc(file, 1, 1);
     const Path path = Location::path(file);
-    auto ref = unit(loc.fileId());
-    ref->symbolNames[path].insert(loc);
+    addSymbolName(loc, path.constData(), path.size());
     const char *fn = path.fileName();
-    ref->symbolNames[fn].insert(loc);
-    Symbol &sym = ref->symbols[loc];
+    addSymbolName(loc, fn, strlen(fn));
+    Symbol &sym = unit(loc)->symbols[loc];
     sym.location = loc;
 }
 
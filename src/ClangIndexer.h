@@ -22,68 +22,110 @@
 #include <rct/Path.h>
 #include <rct/Connection.h>
 #include <sys/stat.h>
+#include <functional>
 #include "IndexDataMessage.h"
+#include "Arena.h"
+#include "FileIdSnapshot.h"
+#include "FileMap.h"
 #include "IndexerJob.h"
+#include "Pack.h"
 #include "RTagsClang.h"
 #include "Symbol.h"
 #include "Server.h"
 
 struct Unit;
+class VisitFileResponseMessage;
 class ClangIndexer
 {
 public:
     ClangIndexer();
+    // for rp --worker, the connection and index are reused for every job the
+    // process runs. lastJob is asked right before the IndexDataMessage is sent
+    // whether the worker is going to exit after this job.
+    ClangIndexer(const std::shared_ptr<Connection> &connection, CXIndex index,
+                 const std::function<bool()> &lastJob);
     ~ClangIndexer();
 
     bool exec(const String &data);
+    bool isLastJob() const { return mIndexDataMessage.flags() & IndexDataMessage::LastJob; }
     static uint32_t serverOpts() { return sServerOpts; }
+
+    // picked per project with "indexer: visitor|callbacks|compare" in .rtags-config
+    enum Engine {
+        VisitorEngine, // clang_visitChildren over the whole AST
+        CallbackEngine, // clang_indexTranslationUnit's declarations and references
+        CompareEngines // both, logs where their maps differ and writes the visitor's
+    };
 private:
     bool diagnose();
     bool visit();
+    void indexCallbacks();
+    void compareEngines();
+    bool locateCursor(const CXCursor &cursor, Location &location);
     bool parse();
-    bool writeFiles(const Path &root, String &error);
+    // saves the pch for mPchHeader as mPch, see SharedPch.h
+    bool buildPch(List<String> arguments);
+    // the include guarded headers the source file starts out including
+    void addIncludePrefix();
+    bool writeFiles(const Path &pack, uint32_t generation, String &error);
 
     void addFileSymbol(uint32_t file);
     int symbolLength(CXCursorKind kind, const CXCursor &cursor);
+    // What createLocation() decided about each CXFile of the TU, they're
+    // unique and live as long as it does. fileId is 0 for files that never
+    // get locations, <built-in> and the like. Blocked files are only known to
+    // be blocked, asking for their location without a blocked pointer takes
+    // the long way.
+    struct FileState {
+        uint32_t fileId;
+        bool blocked;
+    };
+    inline bool cachedLocation(CXFile file, unsigned int line, unsigned int col, bool *blocked, Location &location)
+    {
+        const auto it = mFileStates.find(file);
+        if (it == mFileStates.end())
+            return false;
+        const FileState &state = it->second;
+        if (state.blocked) {
+            if (!blocked)
+                return false;
+            *blocked = true;
+            location.clear();
+        } else {
+            if (blocked)
+                *blocked = false;
+            location = state.fileId ? Location(state.fileId, line, col) : Location();
+        }
+        return true;
+    }
     inline Location createLocation(const CXSourceLocation &location, bool *blocked = 0)
     {
-        CXString fileName;
         unsigned int line, col;
         CXFile file;
         clang_getSpellingLocation(location, &file, &line, &col, 0);
-        if (file) {
-            fileName = clang_getFileName(file);
-        } else {
+        if (!file) {
             if (blocked)
                 *blocked = false;
             return Location();
         }
+        Location ret;
+        if (cachedLocation(file, line, col, blocked, ret))
+            return ret;
+
+        CXString fileName = clang_getFileName(file);
         const char *fn = clang_getCString(fileName);
         assert(fn);
         if (!*fn || !strcmp("<built-in>", fn) || !strcmp("<command line>", fn)) {
             if (blocked)
                 *blocked = false;
             clang_disposeString(fileName);
+            mFileStates[file] = { 0, false };
             return Location();
         }
-        if (!strcmp(fn, mLastFile.constData())) {
-            clang_disposeString(fileName);
-            if (mLastBlocked && blocked) {
-                *blocked = true;
-                return Location();
-            } else if (blocked) {
-                *blocked = false;
-            }
-
-            return Location(mLastFileId, line, col);
-        }
         const Path path = RTags::eatString(fileName);
-        const Location ret = createLocation(path, line, col, blocked);
-        if (blocked) {
-            mLastBlocked = *blocked;
-            mLastFileId = ret.fileId();
-            mLastFile = path;
-        }
+        ret = createLocation(path, line, col, blocked);
+        if (blocked)
+            mFileStates[file] = { ret.fileId(), *blocked };
         return ret;
     }
     Location createLocation(CXFile file, unsigned int line, unsigned int col, bool *blocked = 0)
@@ -92,6 +134,9 @@ private:
             *blocked = false;
         if (!file)
             return Location();
+        Location ret;
+        if (cachedLocation(file, line, col, blocked, ret))
+            return ret;
 
         CXString fn = clang_getFileName(file);
         const char *cstr = clang_getCString(fn);
@@ -111,8 +156,33 @@ private:
         return createLocation(clang_getRangeStart(range), blocked);
     }
     Location createLocation(const Path &file, unsigned int line, unsigned int col, bool *blocked = 0);
+    // asks rdm for ids and which of the files are ours to index, exits if
+    // it doesn't answer
+    void visitFiles(const List<Path> &resolved);
+    void visitInclusions();
+    // what handleInclude() records for the includes when there are no
+    // inclusion directive cursors
+    void addInclusions();
+    uint32_t fileId(const Path &path);
+    bool isBlocked(uint32_t fileId) const
+    {
+        return mBlockedFiles.contains(fileId)
+            || (!mReleasedFiles.contains(fileId) && mVisitedSnapshot.contains(fileId));
+    }
+    // the project may have given the usr another id, see UsrDictionary
+    uint64_t usrId(const String &usr) const { return mRemappedUsrs.value(usr, RTags::usrId(usr)); }
     String addNamePermutations(const CXCursor &cursor, const Location &location,
                                String typeOverride, RTags::CursorType cursorType);
+    // The name of a scope qualified with the scopes it's in, e.g. A::B for
+    // class B in namespace A. Every member of B builds its name on this.
+    struct QualifiedName {
+        String name;
+        // where the symbol name (as opposed to the qualified name) of
+        // something in this scope starts in name, [1] is for namespaces which
+        // keep their enclosing namespaces in their symbol names
+        int symbolStart[2];
+    };
+    const QualifiedName &qualifiedName(const CXCursor &scope);
 
     bool handleCursor(const CXCursor &cursor, CXCursorKind kind,
                       const Location &location, Symbol **cursorPtr = 0);
@@ -127,16 +197,35 @@ private:
                                                   const Location &location, const CXCursor &ref,
                                                   const CXCursor &parent, Symbol **cursorPtr = 0);
     static CXChildVisitResult indexVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data);
+    static CXChildVisitResult preprocessingVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data);
+    static void indexDeclaration(CXClientData client_data, const CXIdxDeclInfo *info);
+    static void indexEntityReference(CXClientData client_data, const CXIdxEntityRefInfo *info);
     static CXChildVisitResult verboseVisitor(CXCursor cursor, CXCursor, CXClientData userData);
     static CXChildVisitResult resolveAutoTypeRefVisitor(CXCursor cursor, CXCursor, CXClientData data);
 
     void onMessage(const std::shared_ptr<Message> &msg, const std::shared_ptr<Connection> &conn);
 
+    // The symbols are looked up while visiting so they're kept in a map. The
+    // rest is only appended to and sorted and merged when the unit is
+    // written, see writeFiles().
     struct Unit {
+        struct Target {
+            uint64_t location, usr;
+            uint16_t value;
+            uint32_t previous; // index + 1 of the previous target at location, 0 if none
+        };
         Map<Location, Symbol> symbols;
-        Map<Location, Map<String, uint16_t> > targets;
-        Map<String, Set<Location> > usrs;
-        Map<String, Set<Location> > symbolNames;
+        List<Target> targets; // a later value for the same location and usr wins
+        Hash<uint64_t, uint32_t> lastTargets; // location -> index + 1 of its latest target
+        List<std::pair<uint64_t, uint64_t> > usrs; // usr, location
+        List<std::pair<KeyView, uint64_t> > symbolNames; // name in ClangIndexer::mArena, location
+
+        void addTarget(const Location &location, uint64_t usr, uint16_t value)
+        {
+            uint32_t &last = lastTargets[location.value];
+            targets.append({ location.value, usr, value, last });
+            last = targets.size();
+        }
     };
 
     std::shared_ptr<Unit> unit(uint32_t fileId)
@@ -149,8 +238,13 @@ private:
     std::shared_ptr<Unit> unit(const Location &loc) { return unit(loc.fileId()); }
 
     Symbol findSymbol(const Location &location, bool *ok) const;
+    static bool encodeUnit(Unit &unit, Pack::SegmentMaps &maps, String *error);
+    // prefix + name
+    void addSymbolName(const Location &location, const char *name, size_t size, const String &prefix = String());
 
     Hash<uint32_t, std::shared_ptr<Unit> > mUnits;
+    Arena mArena;
+    Hash<CXCursor, QualifiedName> mQualifiedNames;
 
     Path mProject;
     Source mSource;
@@ -161,8 +255,7 @@ private:
     CXCursor mLastCursor;
     Location mLastLocation, mLastClass;
     String mClangLine;
-    uint32_t mVisitFileResponseMessageFileId;
-    bool mVisitFileResponseMessageVisit;
+    std::shared_ptr<VisitFileResponseMessage> mVisitFileResponse;
     Path mSocketFile;
     StopWatch mTimer;
     int mParseDuration, mVisitDuration, mBlocked, mAllowed,
@@ -170,9 +263,27 @@ private:
     UnsavedFiles mUnsavedFiles;
     FILE *mLogFile;
     std::shared_ptr<Connection> mConnection;
-    uint32_t mLastFileId;
-    bool mLastBlocked;
-    Path mLastFile;
+    const bool mWorker;
+    const std::function<bool()> mLastJob;
+    Engine mEngine;
+    // IndexerJob::DeclarationsOnly, the function bodies are skipped and
+    // references aren't indexed
+    bool mDeclarationsOnly;
+    // the files rdm had handed out when the job was encoded are the ones in
+    // mVisitedSnapshot that aren't in mReleasedFiles plus mBlockedFiles
+    FileIdSnapshot mVisitedSnapshot;
+    Set<uint32_t> mBlockedFiles, mReleasedFiles, mClaimedFiles;
+    // the shared pch rdm gave us and the header to build it from if we're
+    // the one to build it
+    Path mPch, mPchHeader;
+    Hash<String, uint64_t> mRemappedUsrs;
+    struct IncludeDirective {
+        unsigned int line;
+        CXFile file;
+        uint32_t fileId;
+    };
+    List<IncludeDirective> mIncludeDirectives; // the ones in the source file
+    Hash<CXFile, FileState> mFileStates;
 
     static Flags<Server::Option> sServerOpts;
 };
@@ -62,18 +62,7 @@ int ClassHierarchyJob::execute()
         }
     };
 
-    recurse(symbol, "Superclasses:", 0, [this](const Symbol &sym) {
-            Set<Symbol> ret;
-            for (const String &usr : sym.baseClasses) {
-                for (const auto &s : project()->findByUsr(usr, sym.location.fileId(), Project::ArgDependsOn)) {
-                    if (s.isDefinition()) {
-                        ret.insert(s);
-                        break;
-                    }
-                }
-            }
-            return ret;
-        });
+    recurse(symbol, "Superclasses:", 0, [this](const Symbol &sym) { return project()->findSuperclasses(sym); });
     recurse(symbol, "Subclasses:", 0, [this](const Symbol &sym) { return project()->findSubclasses(sym); });
     return 0;
 }
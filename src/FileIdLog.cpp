@@ -0,0 +1,216 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "FileIdLog.h"
+#include "RTags.h"
+#include <rct/Log.h>
+#include <rct/Rct.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static inline void setError(String *error, int line)
+{
+    if (error) {
+        *error = Rct::strerror();
+        *error << " " << line;
+    }
+}
+
+// FNV-1a of the id and the path
+static inline uint32_t checksum(uint32_t fileId, const char *path, uint32_t size)
+{
+    uint32_t hash = 2166136261u;
+    auto add = [&hash](const char *data, uint32_t len) {
+        for (uint32_t i=0; i<len; ++i) {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 16777619u;
+        }
+    };
+    add(reinterpret_cast<const char*>(&fileId), sizeof(fileId));
+    add(path, size);
+    return hash;
+}
+
+static inline void encode(String &out, uint32_t fileId, const Path &path)
+{
+    const uint32_t header[] = {
+        fileId,
+        static_cast<uint32_t>(path.size()),
+        checksum(fileId, path.constData(), path.size())
+    };
+    out.append(reinterpret_cast<const char*>(header), sizeof(header));
+    out.append(path);
+}
+
+static inline bool writeAll(int fd, const char *data, uint64_t size)
+{
+    while (size) {
+        ssize_t w;
+        eintrwrap(w, ::write(fd, data, size));
+        if (w <= 0)
+            return false;
+        data += w;
+        size -= w;
+    }
+    return true;
+}
+
+FileIdLog::FileIdLog()
+    : mFD(-1), mLastId(0), mDamaged(false)
+{
+}
+
+FileIdLog::~FileIdLog()
+{
+    close();
+}
+
+void FileIdLog::close()
+{
+    if (mFD != -1) {
+        int ret;
+        eintrwrap(ret, ::close(mFD));
+        mFD = -1;
+    }
+    mLastId = 0;
+}
+
+bool FileIdLog::load(const Path &path, Hash<uint32_t, Path> &idsToPaths, String *error)
+{
+    close();
+    mDamaged = false;
+    int fd;
+    eintrwrap(fd, ::open(path.constData(), O_RDWR|O_APPEND));
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st)) {
+        if (fd != -1) {
+            setError(error, __LINE__);
+            int ret;
+            eintrwrap(ret, ::close(fd));
+        } else if (errno != ENOENT) {
+            setError(error, __LINE__);
+        }
+        return false;
+    }
+
+    const char *data = 0;
+    if (st.st_size) {
+        data = static_cast<const char*>(mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+        if (data == MAP_FAILED)
+            data = 0;
+    }
+    uint32_t magic = 0;
+    uint16_t version = 0;
+    if (data && st.st_size >= HeaderSize) {
+        memcpy(&magic, data, sizeof(magic));
+        memcpy(&version, data + sizeof(magic), sizeof(version));
+    }
+    if (magic != Magic || version != RTags::DatabaseVersion) {
+        if (data)
+            munmap(const_cast<char*>(data), st.st_size);
+        int ret;
+        eintrwrap(ret, ::close(fd));
+        if (error)
+            *error = path + " has the wrong version";
+        return false;
+    }
+
+    const uint64_t size = st.st_size;
+    uint64_t pos = HeaderSize;
+    idsToPaths.clear();
+    while (pos + RecordHeaderSize <= size) {
+        uint32_t header[3]; // fileId, size, checksum
+        memcpy(header, data + pos, sizeof(header));
+        const char *str = data + pos + RecordHeaderSize;
+        if (header[0] != static_cast<uint32_t>(idsToPaths.size()) + 1
+            || pos + RecordHeaderSize + header[1] > size
+            || header[2] != checksum(header[0], str, header[1])) {
+            break;
+        }
+        idsToPaths[header[0]] = Path(str, header[1]);
+        pos += RecordHeaderSize + header[1];
+    }
+    munmap(const_cast<char*>(data), st.st_size);
+
+    if (pos != size) {
+        // Ids only make it into project data after they've been flushed so
+        // whatever we lost here isn't referenced by anything we kept.
+        ::error() << "Dropping" << (size - pos) << "bytes of damaged file ids from" << path;
+        int ret;
+        eintrwrap(ret, ftruncate(fd, pos));
+        mDamaged = true;
+    }
+    mFD = fd;
+    mLastId = idsToPaths.size();
+    return true;
+}
+
+bool FileIdLog::append(const List<Path> &paths, String *error)
+{
+    if (mFD == -1) {
+        if (error)
+            *error = "File id log is not open";
+        return false;
+    }
+    String data;
+    uint32_t id = mLastId;
+    for (const Path &path : paths)
+        encode(data, ++id, path);
+    if (!writeAll(mFD, data.constData(), data.size())) {
+        setError(error, __LINE__);
+        // start over with a fresh file next time
+        close();
+        return false;
+    }
+    mLastId = id;
+    return true;
+}
+
+bool FileIdLog::write(const Path &path, const List<Path> &paths, String *error)
+{
+    close();
+    String data;
+    {
+        const uint32_t magic = Magic;
+        const uint16_t version = RTags::DatabaseVersion;
+        data.append(reinterpret_cast<const char*>(&magic), sizeof(magic));
+        data.append(reinterpret_cast<const char*>(&version), sizeof(version));
+    }
+    uint32_t id = 0;
+    for (const Path &p : paths)
+        encode(data, ++id, p);
+
+    const Path tmp = path + ".tmp";
+    Path::mkdir(path.parentDir(), Path::Recursive);
+    int fd;
+    eintrwrap(fd, ::open(tmp.constData(), O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0644));
+    if (fd == -1 || !writeAll(fd, data.constData(), data.size()) || rename(tmp.constData(), path.constData())) {
+        setError(error, __LINE__);
+        if (fd != -1) {
+            int ret;
+            eintrwrap(ret, ::close(fd));
+            unlink(tmp.constData());
+        }
+        return false;
+    }
+
+    mFD = fd; // still refers to the renamed file
+    mLastId = id;
+    mDamaged = false;
+    return true;
+}
@@ -0,0 +1,63 @@
+#ifndef FileIdLog_h
+#define FileIdLog_h
+
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <rct/Hash.h>
+#include <rct/List.h>
+#include <rct/Path.h>
+#include <rct/String.h>
+
+/* dataDir/fileids is an append-only log of
+
+   [uint32_t fileId][uint32_t size][uint32_t checksum][char path[size]]
+
+   after a [uint32_t magic][uint16_t version] header. Ids are handed out in
+   order so the records are too, reading stops at the first one that's
+   truncated, out of order or doesn't match its checksum and the log is cut
+   off there. Only rdm writes to it so there's no locking.
+*/
+
+class FileIdLog
+{
+public:
+    FileIdLog();
+    ~FileIdLog();
+
+    // ids 1 to n, false if there's no log of this version. error is left
+    // empty if there's no log at all.
+    bool load(const Path &path, Hash<uint32_t, Path> &idsToPaths, String *error = 0);
+    // paths are the ones of the ids after the last one in the log
+    bool append(const List<Path> &paths, String *error = 0);
+    // rewrites the log with paths as ids 1 to n
+    bool write(const Path &path, const List<Path> &paths, String *error = 0);
+    void close();
+
+    bool isOpen() const { return mFD != -1; }
+    uint32_t lastId() const { return mLastId; }
+    // whether load() had to cut off damaged records
+    bool isDamaged() const { return mDamaged; }
+private:
+    enum { Magic = 0x49465452 }; // "RTFI"
+    enum { HeaderSize = sizeof(uint32_t) + sizeof(uint16_t) };
+    enum { RecordHeaderSize = sizeof(uint32_t) * 3 }; // fileId, size, checksum
+
+    int mFD;
+    uint32_t mLastId;
+    bool mDamaged;
+};
+
+#endif
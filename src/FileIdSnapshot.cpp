@@ -0,0 +1,200 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "FileIdSnapshot.h"
+#include <rct/List.h>
+#include <rct/Rct.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+
+static inline void setError(String *error, int line)
+{
+    if (error) {
+        *error = Rct::strerror();
+        *error << " " << line;
+    }
+}
+
+static inline uint32_t hashPath(const char *path, int size)
+{
+    uint32_t hash = 2166136261u;
+    for (int i=0; i<size; ++i) {
+        hash ^= static_cast<unsigned char>(path[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+FileIdSnapshot::FileIdSnapshot()
+    : mPointer(0), mSize(0), mCount(0), mBucketCount(0), mStringsSize(0),
+      mRecords(0), mBuckets(0), mStrings(0)
+{
+}
+
+FileIdSnapshot::~FileIdSnapshot()
+{
+    if (mPointer)
+        munmap(const_cast<char*>(mPointer), mSize);
+}
+
+bool FileIdSnapshot::write(const Path &base, uint32_t generation, const Hash<uint32_t, Path> &files, String *error)
+{
+    List<Record> records;
+    records.reserve(files.size());
+    uint32_t stringsSize = 0;
+    for (const auto &file : files) {
+        records.append({ file.first, stringsSize, static_cast<uint32_t>(file.second.size()) });
+        stringsSize += file.second.size();
+    }
+    std::sort(records.begin(), records.end(), [](const Record &l, const Record &r) { return l.fileId < r.fileId; });
+
+    uint32_t bucketCount = 16;
+    while (bucketCount < records.size() * 2)
+        bucketCount *= 2;
+
+    String data(HeaderSize + (records.size() * sizeof(Record)) + (bucketCount * sizeof(uint32_t)) + stringsSize, '\0');
+    const uint32_t header[] = { Magic, static_cast<uint32_t>(records.size()), bucketCount, stringsSize };
+    memcpy(data.data(), header, HeaderSize);
+    uint32_t *buckets = reinterpret_cast<uint32_t*>(data.data() + HeaderSize + (records.size() * sizeof(Record)));
+    char *strings = reinterpret_cast<char*>(buckets + bucketCount);
+    for (int i=0; i<records.size(); ++i) {
+        const Path &path = files.value(records.at(i).fileId);
+        memcpy(strings + records.at(i).offset, path.constData(), path.size());
+        uint32_t bucket = hashPath(path.constData(), path.size()) & (bucketCount - 1);
+        while (buckets[bucket])
+            bucket = (bucket + 1) & (bucketCount - 1);
+        buckets[bucket] = i + 1;
+    }
+    if (!records.isEmpty())
+        memcpy(data.data() + HeaderSize, records.data(), records.size() * sizeof(Record));
+
+    const Path path = FileIdSnapshot::path(base, generation);
+    const Path tmp = path + ".tmp";
+    int fd;
+    eintrwrap(fd, open(tmp.constData(), O_WRONLY|O_CREAT|O_TRUNC, 0644));
+    if (fd == -1) {
+        setError(error, __LINE__);
+        return false;
+    }
+    const char *ptr = data.constData();
+    uint64_t remaining = data.size();
+    while (remaining) {
+        ssize_t w;
+        eintrwrap(w, ::write(fd, ptr, remaining));
+        if (w <= 0)
+            break;
+        ptr += w;
+        remaining -= w;
+    }
+    if (remaining)
+        setError(error, __LINE__);
+    int ret;
+    eintrwrap(ret, ::close(fd));
+    if (remaining) {
+        unlink(tmp.constData());
+        return false;
+    }
+    if (rename(tmp.constData(), path.constData())) {
+        setError(error, __LINE__);
+        unlink(tmp.constData());
+        return false;
+    }
+    return true;
+}
+
+bool FileIdSnapshot::remove(const Path &base, uint32_t generation)
+{
+    const Path path = FileIdSnapshot::path(base, generation);
+    return !unlink(path.constData()) || errno == ENOENT;
+}
+
+bool FileIdSnapshot::load(const Path &base, uint32_t generation, String *error)
+{
+    assert(!mPointer);
+    const Path path = FileIdSnapshot::path(base, generation);
+    int fd;
+    eintrwrap(fd, open(path.constData(), O_RDONLY));
+    if (fd == -1) {
+        setError(error, __LINE__);
+        return false;
+    }
+
+    struct stat st;
+    const char *pointer = static_cast<const char*>(MAP_FAILED);
+    if (!fstat(fd, &st) && st.st_size >= HeaderSize)
+        pointer = static_cast<const char*>(mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+    if (pointer == MAP_FAILED)
+        setError(error, __LINE__);
+    int ret;
+    eintrwrap(ret, ::close(fd));
+    if (pointer == MAP_FAILED)
+        return false;
+
+    uint32_t header[4];
+    memcpy(header, pointer, HeaderSize);
+    const uint64_t size = HeaderSize + (static_cast<uint64_t>(header[1]) * sizeof(Record))
+                          + (static_cast<uint64_t>(header[2]) * sizeof(uint32_t)) + header[3];
+    if (header[0] != Magic || !header[2] || (header[2] & (header[2] - 1)) || size != static_cast<uint64_t>(st.st_size)) {
+        if (error)
+            *error = String::format<128>("Invalid file id snapshot %s", path.constData());
+        munmap(const_cast<char*>(pointer), st.st_size);
+        return false;
+    }
+
+    mPointer = pointer;
+    mSize = st.st_size;
+    mCount = header[1];
+    mBucketCount = header[2];
+    mStringsSize = header[3];
+    mRecords = reinterpret_cast<const Record*>(mPointer + HeaderSize);
+    mBuckets = reinterpret_cast<const uint32_t*>(mRecords + mCount);
+    mStrings = reinterpret_cast<const char*>(mBuckets + mBucketCount);
+    return true;
+}
+
+bool FileIdSnapshot::contains(uint32_t fileId) const
+{
+    const Record *end = mRecords + mCount;
+    const Record *it = std::lower_bound(mRecords, end, fileId,
+                                        [](const Record &record, uint32_t id) { return record.fileId < id; });
+    return it != end && it->fileId == fileId;
+}
+
+uint32_t FileIdSnapshot::fileId(const Path &path) const
+{
+    if (!mPointer)
+        return 0;
+    uint32_t bucket = hashPath(path.constData(), path.size()) & (mBucketCount - 1);
+    for (uint32_t i=0; i<mBucketCount; ++i) {
+        const uint32_t index = mBuckets[bucket];
+        if (!index)
+            break;
+        if (index <= mCount) {
+            const Record &record = mRecords[index - 1];
+            if (record.size == static_cast<uint32_t>(path.size())
+                && record.offset + record.size <= mStringsSize
+                && !memcmp(mStrings + record.offset, path.constData(), record.size)) {
+                return record.fileId;
+            }
+        }
+        bucket = (bucket + 1) & (mBucketCount - 1);
+    }
+    return 0;
+}
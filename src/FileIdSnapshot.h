@@ -0,0 +1,73 @@
+#ifndef FileIdSnapshot_h
+#define FileIdSnapshot_h
+
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <rct/Hash.h>
+#include <rct/Path.h>
+#include <rct/String.h>
+
+/* A read-only table of path <-> fileId that rdm writes for rp to map,
+   <base>.<generation>. The project publishes its visited files like this so
+   a job only has to carry what changed since the generation it names instead
+   of the whole table.
+
+   [uint32_t magic][uint32_t count][uint32_t bucketCount][uint32_t stringsSize]
+   [Record records[count]]          sorted by fileId
+   [uint32_t buckets[bucketCount]]  index + 1 into records by hash of the path, 0 is empty
+   [char strings[stringsSize]]
+
+   A generation is never rewritten, a new one shows up under its name once
+   it's complete.
+*/
+
+class FileIdSnapshot
+{
+public:
+    FileIdSnapshot();
+    ~FileIdSnapshot();
+
+    static Path path(const Path &base, uint32_t generation)
+    {
+        return base + String::format<16>(".%u", generation);
+    }
+    static bool write(const Path &base, uint32_t generation, const Hash<uint32_t, Path> &files, String *error = 0);
+    static bool remove(const Path &base, uint32_t generation);
+
+    bool load(const Path &base, uint32_t generation, String *error = 0);
+    bool isNull() const { return !mPointer; }
+    uint32_t count() const { return mCount; }
+
+    bool contains(uint32_t fileId) const;
+    uint32_t fileId(const Path &path) const;
+private:
+    struct Record {
+        uint32_t fileId, offset, size;
+    };
+    enum {
+        Magic = 0x53565452, // "RTVS"
+        HeaderSize = sizeof(uint32_t) * 4
+    };
+
+    const char *mPointer;
+    uint64_t mSize;
+    uint32_t mCount, mBucketCount, mStringsSize;
+    const Record *mRecords;
+    const uint32_t *mBuckets;
+    const char *mStrings;
+};
+
+#endif
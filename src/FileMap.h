@@ -17,14 +17,15 @@
    along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include <assert.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <sys/file.h>
-#include <sys/mman.h>
 #include <rct/Serializer.h>
 #include <rct/Rct.h>
 #include "Location.h"
+#include <algorithm>
 #include <functional>
+#include <memory>
+#include <stdint.h>
+#include <strings.h>
+#include <type_traits>
 
 template <typename T> inline static int compare(const T &l, const T &r)
 {
@@ -45,83 +46,91 @@ template <> inline int compare(const Location &l, const Location &r)
     return l.compare(r);
 }
 
-template <typename Key, typename Value>
-class FileMap
+// A borrowed pointer/length pair into the mapped region of a FileMap. Only
+// valid for as long as the FileMap it came from. Keys are stored
+// nul-terminated so data can be passed to functions that expect a C string.
+struct KeyView
 {
-public:
-    FileMap()
-        : mPointer(0), mSize(0), mCount(0), mKeySize(0), mFD(-1)
+    KeyView(const char *d = 0, uint32_t s = 0)
+        : data(d), size(s)
     {}
 
-    void init(const char *pointer, size_t size)
+    const char *data;
+    uint32_t size;
+
+    int compare(const String &str) const
     {
-        mPointer = pointer;
-        mSize = size;
-        memcpy(&mCount, mPointer, sizeof(size_t));
-        memcpy(&mKeySize, mPointer + sizeof(size_t), sizeof(size_t));
+        const int cmp = memcmp(data, str.constData(), std::min<size_t>(size, str.size()));
+        if (cmp)
+            return cmp;
+        return intCompare(size, str.size());
     }
 
-    bool load(const Path &path, String *error = 0)
+    bool startsWith(const String &str, String::CaseSensitivity cs = String::CaseSensitive) const
     {
-        eintrwrap(mFD, open(path.constData(), O_RDONLY));
-        if (mFD == -1) {
-            if (error) {
-                *error = Rct::strerror();
-                *error << " " << __LINE__;
-            }
+        if (static_cast<int>(size) < str.size())
             return false;
-        }
-        if (!lock(mFD, Read)) {
-            if (error) {
-                *error = Rct::strerror();
-                *error << " " << __LINE__;
-            }
+        if (cs == String::CaseInsensitive)
+            return !strncasecmp(data, str.constData(), str.size());
+        return !memcmp(data, str.constData(), str.size());
+    }
 
-            close(mFD);
-            mFD = -1;
-            return false;
-        }
+    String toString() const { return String(data, size); }
+};
 
-        struct stat st;
-        if (fstat(mFD, &st)) {
-            if (error) {
-                *error = Rct::strerror();
-                *error << " " << __LINE__;
-            }
-            lock(mFD, Unlock);
-            int ret;
-            eintrwrap(ret, close(mFD));
-            mFD = -1;
-            return false;
-        }
+template <typename T> inline static int compareKey(const T &key, const T &entry)
+{
+    return compare<T>(key, entry);
+}
 
-        const char *pointer = static_cast<const char*>(mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, mFD, 0));
-        // error() << errno;//  << mPointer;
-        if (pointer == MAP_FAILED) {
-            if (error) {
-                *error = Rct::strerror();
-                *error << " " << __LINE__;
-            }
-            lock(mFD, Unlock);
-            int ret;
-            eintrwrap(ret, close(mFD));
-            mFD = -1;
-            return false;
-        }
+inline static int compareKey(const String &key, const KeyView &entry)
+{
+    return -entry.compare(key);
+}
 
-        init(pointer, st.st_size);
-        return true;
+/*
+  Layout:
+  [size_t count][size_t indexOffset]
+  count * [key][value]
+  key heap or search index
+  value heap
+
+  Fixed size keys and values are stored inline in the entry table.
+  Variable size keys (String) are stored as a uint32_t offset/length pair
+  pointing into the key heap where each key is nul-terminated, variable size
+  values are stored as a size_t offset into the value heap. encode() refuses
+  String keyed maps whose entries and key heap don't fit in 4GB.
+
+  Maps with fixed size keys and at least EytzingerThreshold entries get a
+  search index instead of a key heap: count keys in Eytzinger (BFS) order
+  followed by count uint32_t indexes into the entry table. This keeps the top
+  levels of the search in a handful of cache lines instead of touching a new
+  line for every probe. indexOffset is 0 when there is neither.
+*/
+
+template <typename Key, typename Value>
+class FileMap
+{
+    static_assert(FixedSize<Key>::value || std::is_same<Key, String>::value,
+                  "Variable size keys must be Strings");
+public:
+    FileMap()
+        : mPointer(0), mSize(0), mCount(0), mIndexOffset(0)
+    {}
+
+    void init(const char *pointer, size_t size)
+    {
+        mPointer = pointer;
+        mSize = size;
+        memcpy(&mCount, mPointer, sizeof(size_t));
+        memcpy(&mIndexOffset, mPointer + sizeof(size_t), sizeof(size_t));
     }
 
-    ~FileMap()
+    // for maps that live inside a mapping owned by someone else, e.g. a Pack
+    void init(const char *pointer, size_t size, const std::shared_ptr<const void> &mapping)
     {
-        if (mFD != -1) {
-            assert(mPointer);
-            munmap(const_cast<char*>(mPointer), mSize);
-            lock(mFD, Unlock);
-            int ret;
-            eintrwrap(ret, close(mFD));
-        }
+        mMapping = mapping;
+        init(pointer, size);
     }
 
     Value value(const Key &key, bool *matched = 0) const
@@ -140,19 +149,22 @@ public:
 
     Key keyAt(size_t index) const
     {
+        return toKey(probe(index));
+    }
+
+    KeyView keyViewAt(size_t index) const
+    {
+        static_assert(!FixedSize<Key>::value, "keyViewAt is only available for variable size keys");
         const char *ptr = (dataSegment() + (entrySize() * index));
-        return read<Key>(ptr);
+        uint32_t ref[2]; // offset, length
+        memcpy(ref, ptr, sizeof(ref));
+        return KeyView(mPointer + ref[0], ref[1]);
     }
 
     Value valueAt(size_t idx) const
     {
         assert(idx >= 0 && idx < mCount);
-        const char *data = dataSegment() + (entrySize() * idx) + keySize();
-        if (FixedSize<Value>::value)
-            return read<Value>(data);
-
-        const size_t offset = read<size_t>(data);
-        return read<Value>(mPointer + offset);
+        return valueFrom(dataSegment() + (entrySize() * idx) + keySize());
     }
     size_t lowerBound(const Key &k, bool *match = 0) const
     {
@@ -161,12 +173,138 @@ public:
                 *match = false;
             return -1;
         }
+        return search(k, match);
+    }
+
+    // map is anything that iterates pairs in key order without duplicate
+    // keys, a Map or a sorted List of std::pairs. The keys may be KeyViews
+    // for a String map and the values anything that serializes like Value.
+    // Returns an empty String if the map doesn't fit the format, see below.
+    template <typename Container>
+    static String encode(const Container &map, String *error = 0)
+    {
+        List<String> pieces;
+        if (!encode(map, pieces, error))
+            return String();
+        if (pieces.size() == 1)
+            return pieces.first();
+        String out;
+        size_t size = 0;
+        for (const String &piece : pieces)
+            size += piece.size();
+        out.reserve(size);
+        for (const String &piece : pieces)
+            out += piece;
+        return out;
+    }
+
+    // Appends the encoded map to pieces in the order they go in the file, for
+    // writers that don't need it in one String. Fails, leaving pieces alone,
+    // if the entries or the key heap are too large for the uint32_t indexes
+    // and key refs.
+    template <typename Container>
+    static bool encode(const Container &map, List<String> &pieces, String *error = 0)
+    {
+        const size_t entryCount = map.size();
+        const size_t keysOffset = HeaderSize + (entrySize() * entryCount);
+        const size_t keysSize = keyHeapSize(map) + searchIndexSize(map); // at most one of them
+        if (entryCount > UINT32_MAX || (!FixedSize<Key>::value && keysOffset + keysSize > UINT32_MAX)) {
+            if (error)
+                *error = String::format<128>("Map too large to encode: %zu entries, %zu bytes of keys",
+                                             entryCount, keysSize);
+            return false;
+        }
+
+        String out;
+        Serializer serializer(out);
+
+        String values;
+        Serializer valuesSerializer(values);
+
+        size_t valuesOffset = keysOffset + keysSize;
+
+        serializer << entryCount;
+        serializer << static_cast<size_t>(keysSize ? keysOffset : 0);
+        out.reserve(valuesOffset);
+
+        String keys;
+        keys.reserve(keysSize);
+        for (const auto &pair : map) {
+            encodeKey(pair.first, out, keys, keysOffset);
+            const auto &value = pair.second;
+            if (const size_t size = FixedSize<Value>::value) {
+                out.append(reinterpret_cast<const char*>(&value), size);
+            } else {
+                out.append(reinterpret_cast<const char *>(&valuesOffset), sizeof(valuesOffset));
+                const int old = values.size();
+                valuesSerializer << value;
+                valuesOffset += (values.size() - old);
+            }
+        }
+        assert(static_cast<size_t>(out.size()) == keysOffset);
+        encodeSearchIndex(map, keys);
+        assert(static_cast<size_t>(keys.size()) == keysSize);
+        pieces.append(std::move(out));
+        if (!keys.isEmpty())
+            pieces.append(std::move(keys));
+        if (!values.isEmpty())
+            pieces.append(std::move(values));
+        return true;
+    }
+
+private:
+    enum {
+        HeaderSize = sizeof(size_t) + sizeof(size_t),
+        KeyRefSize = sizeof(uint32_t) + sizeof(uint32_t),
+        EytzingerThreshold = 128
+    };
+    const char *dataSegment() const { return mPointer + HeaderSize; }
+
+    template <typename K = Key>
+    typename std::enable_if<FixedSize<K>::value != 0, size_t>::type search(const K &k, bool *match) const
+    {
+        if (!mIndexOffset)
+            return binarySearch(k, match);
+
+        // Descend the implicit tree rooted at 1, the bits shifted into i
+        // record whether we went right. Once we fall off the bottom, shifting
+        // out the trailing right turns (and the final left) leaves the node of
+        // the first key >= k, or 0 if every key is less.
+        enum { PrefetchNodes = 64 / FixedSize<K>::value };
+        const char *keys = mPointer + mIndexOffset;
+        size_t i = 1;
+        while (i <= mCount) {
+            // the PrefetchNodes descendants log2(PrefetchNodes) levels down (3
+            // for 8 byte keys) are adjacent. The index isn't aligned so they
+            // may straddle two cache lines, this fetches the first.
+            __builtin_prefetch(keys + (((i * PrefetchNodes) - 1) * FixedSize<K>::value));
+            i = (i << 1) | (compare<K>(read<K>(keys + ((i - 1) * FixedSize<K>::value)), k) < 0);
+        }
+        i >>= __builtin_ffsll(~static_cast<unsigned long long>(i));
+        if (!i) {
+            if (match)
+                *match = false;
+            return -1;
+        }
+        const size_t idx = read<uint32_t>(keys + (mCount * FixedSize<K>::value) + ((i - 1) * sizeof(uint32_t)));
+        if (match)
+            *match = !compare<K>(probe(idx), k);
+        return idx;
+    }
+    template <typename K = Key>
+    typename std::enable_if<FixedSize<K>::value == 0, size_t>::type search(const K &k, bool *match) const
+    {
+        return binarySearch(k, match);
+    }
+
+    size_t binarySearch(const Key &k, bool *match) const
+    {
         int lower = 0;
         int upper = mCount - 1;
 
         do {
             const int mid = lower + ((upper - lower) / 2);
-            const int cmp = compare<Key>(k, keyAt(mid));
+            const int cmp = compareKey(k, probe(mid));
             if (cmp < 0) {
                 upper = mid - 1;
             } else if (cmp > 0) {
@@ -185,146 +323,141 @@ public:
         return lower;
     }
 
-    static String encode(const Map<Key, Value> &map)
+    // Fixed size keys are cheap to copy out of the map, String keys are
+    // compared in place so a binary search doesn't allocate.
+    template <typename K = Key>
+    typename std::enable_if<FixedSize<K>::value != 0, K>::type probe(size_t index) const
     {
-        String out;
-        Serializer serializer(out);
+        return read<K>(dataSegment() + (entrySize() * index));
+    }
+    template <typename K = Key>
+    typename std::enable_if<FixedSize<K>::value == 0, KeyView>::type probe(size_t index) const
+    {
+        return keyViewAt(index);
+    }
+    static const Key &toKey(const Key &key) { return key; }
+    static Key toKey(const KeyView &view) { return view.toString(); }
 
-        String values;
-        Serializer valuesSerializer(values);
-        size_t valuesOffset = 0;
-
-        size_t keySize = 0;
-        serializer << static_cast<size_t>(map.size());
-        serializer << static_cast<size_t>(0); // keysize
-
-        auto encodePair = [&out, &valuesSerializer, &values, &valuesOffset](const char *keyData, size_t keySize, const Value &value)
-            {
-                out.append(keyData, keySize);
-                if (const size_t size = FixedSize<Value>::value) {
-                    out.append(reinterpret_cast<const char*>(&value), size);
-                } else {
-                    out.append(reinterpret_cast<const char *>(&valuesOffset), sizeof(valuesOffset));
-                    const int old = values.size();
-                    valuesSerializer << value;
-                    valuesOffset += (values.size() - old);
-                }
-            };
-
-        if (!FixedSize<Key>::value) {
-            List<String> keys(map.size());
-            int idx = 0;
-            for (const auto &pair : map) {
-                String &str = keys[idx++];
-                Serializer s(str);
-                s << pair.first;
-                keySize = std::max<size_t>(str.size(), keySize);
-            }
-            memcpy(out.data() + sizeof(size_t), &keySize, sizeof(keySize));
-            char buf[keySize];
-            size_t entrySize = keySize;
-            if (const size_t size = FixedSize<Value>::value) {
-                entrySize += size;
-            } else {
-                entrySize += sizeof(size_t);
-            }
-            valuesOffset = sizeof(size_t) + sizeof(size_t) + (entrySize * map.size());
-            out.reserve(valuesOffset);
-            idx = 0;
-            for (const auto &pair : map) {
-                memset(buf, 0, sizeof(buf));
-                const String &str = keys[idx++];
-                memcpy(buf, str.data(), str.size()); // no need to copy the \0 :-)
-                encodePair(buf, keySize, pair.second);
-            }
-        } else {
-            size_t entrySize = FixedSize<Key>::value;
-            if (const size_t size = FixedSize<Value>::value) {
-                entrySize += size;
-            } else {
-                entrySize += sizeof(size_t);
-            }
-            valuesOffset = sizeof(size_t) + sizeof(size_t) + (entrySize * map.size());
-            out.reserve(valuesOffset);
-            for (const auto &pair : map) {
-                // error() << "Encoding a key" << pair.first;
-                encodePair(reinterpret_cast<const char*>(&pair.first), FixedSize<Key>::value, pair.second);
-            }
-        }
+    static size_t keyLength(const String &key) { return key.size(); }
+    static size_t keyLength(const KeyView &key) { return key.size; }
+    static const char *keyData(const String &key) { return key.constData(); }
+    static const char *keyData(const KeyView &key) { return key.data; }
 
-        if (!FixedSize<Value>::value)
-            out += values;
-        return out;
+    template <typename Container, typename K = Key>
+    static typename std::enable_if<FixedSize<K>::value != 0, size_t>::type keyHeapSize(const Container &)
+    {
+        return 0;
+    }
+    template <typename Container, typename K = Key>
+    static typename std::enable_if<FixedSize<K>::value == 0, size_t>::type keyHeapSize(const Container &map)
+    {
+        size_t ret = 0;
+        for (const auto &pair : map)
+            ret += keyLength(pair.first) + 1;
+        return ret;
     }
 
-    static bool write(const Path &path, const Map<Key, Value> &map)
+    template <typename Container, typename K = Key>
+    static typename std::enable_if<FixedSize<K>::value != 0, size_t>::type searchIndexSize(const Container &map)
     {
-        FILE *f = fopen(path.constData(), "w+");
-        if (!f && Path::mkdir(path.parentDir(), Path::Recursive)) {
-            f = fopen(path.constData(), "w+");
-        }
-        if (!f)
-            return false;
-        int err;
-        const int fd = fileno(f);
-        if (!lock(fd, Write)) {
-            fclose(f);
-            return false;
+        if (map.size() < EytzingerThreshold)
+            return 0;
+        return map.size() * (FixedSize<K>::value + sizeof(uint32_t));
+    }
+    template <typename Container, typename K = Key>
+    static typename std::enable_if<FixedSize<K>::value == 0, size_t>::type searchIndexSize(const Container &)
+    {
+        return 0;
+    }
+
+    // ranks[node - 1] is the position in sorted order of the key at node
+    static void eytzinger(List<uint32_t> &ranks, uint32_t &next, size_t node)
+    {
+        if (node <= static_cast<size_t>(ranks.size())) {
+            eytzinger(ranks, next, node * 2);
+            ranks[node - 1] = next++;
+            eytzinger(ranks, next, (node * 2) + 1);
         }
+    }
 
-        const String data = encode(map);
-        bool ret = fwrite(data.constData(), data.size(), 1, f);
-        if (ret)
-            eintrwrap(err, ftruncate(fd, data.size()));
-        ret = lock(fd, Unlock) && ret;
-        fclose(f);
-        if (!ret)
-            unlink(data.constData());
-        return ret;
+    template <typename Container, typename K = Key>
+    static typename std::enable_if<FixedSize<K>::value != 0>::type encodeSearchIndex(const Container &map, String &out)
+    {
+        if (!searchIndexSize(map))
+            return;
+        List<const K *> sorted;
+        sorted.reserve(map.size());
+        for (const auto &pair : map)
+            sorted.append(&pair.first);
+
+        List<uint32_t> ranks(map.size());
+        uint32_t next = 0;
+        eytzinger(ranks, next, 1);
+        for (uint32_t rank : ranks)
+            out.append(reinterpret_cast<const char*>(sorted.at(rank)), FixedSize<K>::value);
+        out.append(reinterpret_cast<const char*>(ranks.data()), ranks.size() * sizeof(uint32_t));
     }
-private:
-    enum Mode {
-        Read = F_RDLCK,
-        Write = F_WRLCK,
-        Unlock = F_UNLCK
-    };
-    static bool lock(int fd, Mode mode)
+    template <typename Container, typename K = Key>
+    static typename std::enable_if<FixedSize<K>::value == 0>::type encodeSearchIndex(const Container &, String &)
     {
-        struct flock fl = { 0, 0, getpid(), static_cast<short>(mode), SEEK_SET };
-        int ret;
-        eintrwrap(ret, fcntl(fd, F_SETLKW, &fl));
-        return ret != -1;
     }
-    const char *dataSegment() const { return mPointer + sizeof(size_t) + sizeof(size_t); }
+
+    template <typename K = Key>
+    static typename std::enable_if<FixedSize<K>::value != 0>::type encodeKey(const K &key, String &out, String &, size_t)
+    {
+        out.append(reinterpret_cast<const char*>(&key), FixedSize<K>::value);
+    }
+    template <typename KeyType, typename K = Key>
+    static typename std::enable_if<FixedSize<K>::value == 0>::type encodeKey(const KeyType &key, String &out, String &keys, size_t keysOffset)
+    {
+        // encode() checked that the whole heap fits
+        const size_t size = keyLength(key);
+        const uint32_t ref[2] = {
+            static_cast<uint32_t>(keysOffset + keys.size()),
+            static_cast<uint32_t>(size)
+        };
+        out.append(reinterpret_cast<const char*>(ref), sizeof(ref));
+        keys.append(keyData(key), size);
+        keys.append('\0');
+    }
 
     template <typename T>
-    inline static T read(const char *data)
+    inline static typename std::enable_if<FixedSize<T>::value != 0, T>::type read(const char *data)
+    {
+        T t = T();
+        memcpy(&t, data, FixedSize<T>::value);
+        return t;
+    }
+    template <typename T>
+    inline static typename std::enable_if<FixedSize<T>::value == 0, T>::type read(const char *data)
     {
-        if (FixedSize<T>::value) {
-            T t = T();
-            memcpy(&t, data, FixedSize<T>::value);
-            return t;
-        }
         Deserializer deserializer(data, INT_MAX);
         T t;
         deserializer >> t;
         return t;
     }
-    size_t keySize() const { return mKeySize ? mKeySize : FixedSize<Key>::value; }
-    size_t entrySize() const
+
+    template <typename V = Value>
+    typename std::enable_if<FixedSize<V>::value != 0, V>::type valueFrom(const char *entry) const
     {
-        if (FixedSize<Value>::value) {
-            return keySize() + sizeof(Value);
-        } else {
-            return keySize() + sizeof(size_t);
-        }
+        return read<V>(entry);
+    }
+    template <typename V = Value>
+    typename std::enable_if<FixedSize<V>::value == 0, V>::type valueFrom(const char *entry) const
+    {
+        return read<V>(mPointer + read<size_t>(entry));
+    }
+    static constexpr size_t keySize() { return FixedSize<Key>::value ? FixedSize<Key>::value : KeyRefSize; }
+    static constexpr size_t entrySize()
+    {
+        return keySize() + (FixedSize<Value>::value ? sizeof(Value) : sizeof(size_t));
     }
 
     const char *mPointer;
     size_t mSize;
     size_t mCount;
-    size_t mKeySize;
-    int mFD;
+    size_t mIndexOffset;
+    std::shared_ptr<const void> mMapping;
 };
 
 #endif
@@ -32,8 +32,8 @@ int FollowLocationJob::execute()
         return 1;
 
     if (queryFlags() & QueryMessage::AllTargets) {
-        const Set<String> usrs = project()->findTargetUsrs(location);
-        for (const String &usr : usrs) {
+        const Set<uint64_t> usrs = project()->findTargetUsrs(location);
+        for (uint64_t usr : usrs) {
             for (const Symbol &s : project()->findByUsr(usr, location.fileId(), Project::ArgDependsOn)) {
                 write(s.toString());
             }
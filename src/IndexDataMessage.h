@@ -22,6 +22,7 @@
 #include <rct/Serializer.h>
 #include <rct/String.h>
 #include "IndexerJob.h"
+#include "Pack.h"
 #include <rct/Flags.h>
 
 class IndexDataMessage : public RTagsMessage
@@ -44,7 +45,10 @@ public:
     enum Flag {
         None = 0x0,
         ParseFailure = 0x1,
-        InclusionError = 0x2
+        InclusionError = 0x2,
+        Worker = 0x4, // sent by rp --worker, which keeps the connection
+        PchFailure = 0x8, // the shared pch couldn't be built or used
+        LastJob = 0x10 // the worker exits after this one, don't give it another
     };
     Flags<Flag> flags() const { return mFlags; }
     void setFlags(Flags<Flag> flags) { mFlags = flags; }
@@ -99,12 +103,16 @@ public:
     Diagnostics &diagnostics() { return mDiagnostics; }
     Includes &includes() { return mIncludes; }
     Declarations &declarations() { return mDeclarations; }
+    Hash<uint64_t, String> &usrs() { return mUsrs; }
+    Hash<uint32_t, ClassHierarchy> &baseClasses() { return mBaseClasses; }
+    List<uint32_t> &includePrefix() { return mIncludePrefix; }
     enum FileFlag {
         NoFileFlag = 0x0,
         Visited = 0x1,
         HeaderError = 0x2
     };
     Hash<uint32_t, Flags<FileFlag> > &files() { return mFiles; }
+    Hash<uint32_t, Pack::Segment> &segments() { return mSegments; }
 private:
     Path mProject;
     uint64_t mParseTime, mKey, mId;
@@ -114,7 +122,11 @@ private:
     Diagnostics mDiagnostics;
     Includes mIncludes;
     Declarations mDeclarations; // function declarations and forward declaration
+    Hash<uint64_t, String> mUsrs; // usr id -> usr for everything declared in the visited files
+    Hash<uint32_t, ClassHierarchy> mBaseClasses; // fileId -> class -> base classes defined in that file
+    List<uint32_t> mIncludePrefix; // see SharedPch.h
     Hash<uint32_t, Flags<FileFlag> > mFiles;
+    Hash<uint32_t, Pack::Segment> mSegments; // where rp put each visited file in the project's pack
     Flags<Flag> mFlags;
 };
 
@@ -125,14 +137,14 @@ inline void IndexDataMessage::encode(Serializer &serializer) const
 {
     serializer << mProject << mParseTime << mKey << mId << mIndexerJobFlags
                << mMessage << mFixIts << mIncludes << mDiagnostics << mFiles
-               << mDeclarations << mFlags;
+               << mDeclarations << mUsrs << mBaseClasses << mIncludePrefix << mSegments << mFlags;
 }
 
 inline void IndexDataMessage::decode(Deserializer &deserializer)
 {
     deserializer >> mProject >> mParseTime >> mKey >> mId >> mIndexerJobFlags
                  >> mMessage >> mFixIts >> mIncludes >> mDiagnostics
-                 >> mFiles >> mDeclarations >> mFlags;
+                 >> mFiles >> mDeclarations >> mUsrs >> mBaseClasses >> mIncludePrefix >> mSegments >> mFlags;
 }
 
 #endif
@@ -26,7 +26,8 @@ IndexerJob::IndexerJob(const Source &s,
                        const std::shared_ptr<Project> &p,
                        const UnsavedFiles &u)
     : id(0), source(s), sourceFile(s.sourceFile()), flags(f),
-      project(p->path()), priority(0), unsavedFiles(u), crashCount(0)
+      project(p->path()), priority(0), packGeneration(0), visitedGeneration(0), unsavedFiles(u), crashCount(0),
+      pch(0), buildsPch(false)
 {
     acquireId();
     if (flags & Dirty)
@@ -121,9 +122,12 @@ String IndexerJob::encode() const
                    << static_cast<int32_t>(options.rpNiceValue)
                    << options.options
                    << unsavedFiles
-                   << options.dataDir;
+                   << options.dataDir
+                   << packGeneration;
         assert(proj);
-        proj->encodeVisitedFiles(serializer);
+        proj->encodeVisitedFiles(serializer, source.key());
+        proj->encodeSharedPch(serializer, source.key());
+        serializer << proj->remappedUsrs();
     }
     const uint32_t size = ret.size() - sizeof(int);
     memcpy(&ret[0], &size, sizeof(size));
@@ -139,6 +143,9 @@ String IndexerJob::dumpFlags(Flags<Flag> flags)
     if (flags & Compile) {
         ret += "Compile";
     }
+    if (flags & DeclarationsOnly) {
+        ret += "DeclarationsOnly";
+    }
     if (flags & Running) {
         ret += "Running";
     }
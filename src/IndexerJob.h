@@ -32,11 +32,12 @@ public:
         None = 0x000,
         Dirty = 0x001,
         Compile = 0x002,
+        DeclarationsOnly = 0x004,
         Running = 0x010,
         Crashed = 0x020,
         Aborted = 0x040,
         Complete = 0x080,
-        Type_Mask = Dirty|Compile
+        Type_Mask = Dirty|Compile|DeclarationsOnly
     };
 
     static String dumpFlags(Flags<Flag> flags);
@@ -54,10 +55,23 @@ public:
     Flags<Flag> flags;
     Path project;
     int priority;
-    enum { HeaderError = -1 };
+    uint32_t packGeneration; // the pack rp appends to, see Pack.h
+    uint32_t visitedGeneration; // the FileIdSnapshot rp maps, 0 if none
+    enum {
+        HeaderError = -1,
+        Deferred = -2 // the full pass after a DeclarationsOnly one
+    };
     UnsavedFiles unsavedFiles;
     Set<uint32_t> visited;
+    // headers the source included last time that nobody else had when the
+    // job started, they're in visited from the outset
+    Set<uint32_t> claimed;
+    // headers the DeclarationsOnly pass of this source indexed, the full pass
+    // claims them back
+    Set<uint32_t> deferred;
     int crashCount;
+    uint64_t pch; // the SharedPch group it was given, 0 if none
+    bool buildsPch;
 private:
     static uint64_t sNextId;
 };
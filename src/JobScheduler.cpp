@@ -29,6 +29,8 @@ JobScheduler::~JobScheduler()
             job.first->kill();
         }
     }
+    for (Process *process : mIdleWorkers)
+        process->kill();
 }
 
 void JobScheduler::add(const std::shared_ptr<IndexerJob> &job)
@@ -80,6 +82,89 @@ uint32_t JobScheduler::hasHeaderError(uint32_t file, const std::shared_ptr<Proje
     return hasHeaderError(node, seen);
 }
 
+Process *JobScheduler::startProcess(const Path &rp)
+{
+    const auto &options = Server::instance()->options();
+    Process *process = new Process;
+    List<String> arguments;
+    for (int i=logLevel(); i>0; --i)
+        arguments << "-v";
+    if (options.rpWorkerJobs) {
+        arguments << "--worker";
+        if (options.rpWorkerMaxMemory)
+            arguments << "--max-memory" << String::number(options.rpWorkerMaxMemory);
+    }
+    if (!process->start(rp, arguments)) {
+        error() << "Couldn't start rp" << rp << process->errorString();
+        delete process;
+        return 0;
+    }
+    process->finished().connect(std::bind(&JobScheduler::onProcessFinished, this, std::placeholders::_1));
+    if (options.rpWorkerJobs) {
+        // a worker could be around for a long time, don't let its output pile up
+        auto log = [this](Process *proc) {
+            const String stdErr = proc->readAllStdErr();
+            const String stdOut = proc->readAllStdOut();
+            if (!stdOut.isEmpty() || !stdErr.isEmpty()) {
+                const auto node = mActiveByProcess.value(proc);
+                error() << (node ? node->job->sourceFile : String("Idle worker")) << '\n' << stdErr << stdOut;
+            }
+        };
+        process->readyReadStdErr().connect(log);
+        process->readyReadStdOut().connect(log);
+        mWorkers[process] = 0;
+    }
+    return process;
+}
+
+void JobScheduler::onProcessFinished(Process *proc)
+{
+    EventLoop::deleteLater(proc);
+    mWorkers.remove(proc);
+    mIdleWorkers.remove(proc);
+    auto node = mActiveByProcess.take(proc);
+    assert(!node || node->process == proc);
+    const String stdErr = proc->readAllStdErr();
+    const String stdOut = proc->readAllStdOut();
+    if (!stdOut.isEmpty() || !stdErr.isEmpty()) {
+        error() << (node ? node->job->sourceFile : String("Orphaned process")) << '\n' << stdErr << stdOut;
+    }
+
+    if (node) {
+        assert(node->process == proc);
+        node->process = 0;
+        const uint64_t jobId = node->job->id;
+        assert(!(node->job->flags & IndexerJob::Aborted));
+        if (!(node->job->flags & IndexerJob::Complete)) {
+            // rp doesn't exit before we've handled its IndexDataMessage so
+            // the job failed, even if it exited with 0 (a worker that quit
+            // before it read the job)
+            auto nodeById = mActiveById.take(jobId);
+            assert(nodeById);
+            assert(nodeById == node);
+            node->job->flags |= IndexerJob::Crashed;
+            debug() << "job crashed" << jobId << node->job->source.key() << node->job.get();
+            std::shared_ptr<IndexDataMessage> msg(new IndexDataMessage(node->job));
+            msg->setFlag(IndexDataMessage::ParseFailure);
+            jobFinished(node->job, msg);
+        }
+        mHeaderErrorJobIds.remove(jobId);
+    }
+    startJobs();
+}
+
+void JobScheduler::workerIdle(Process *process, bool lastJob)
+{
+    const auto &options = Server::instance()->options();
+    if (lastJob || mWorkers.value(process) >= options.rpWorkerJobs) {
+        // it exits when it runs out of stdin
+        debug() << "Recycling rp worker" << process->pid();
+        process->closeStdIn();
+    } else {
+        mIdleWorkers.append(process);
+    }
+}
+
 void JobScheduler::startJobs()
 {
     static Path rp;
@@ -128,14 +213,15 @@ void JobScheduler::startJobs()
         }
 
         const uint64_t jobId = node->job->id;
-        Process *process = new Process;
-        debug() << "Starting process for" << jobId << node->job->source.key() << node->job.get();
-        List<String> arguments;
-        for (int i=logLevel(); i>0; --i)
-            arguments << "-v";
-        if (!process->start(rp, arguments)) {
-            error() << "Couldn't start rp" << rp << process->errorString();
-            delete process;
+        Process *process = 0;
+        if (!mIdleWorkers.isEmpty()) {
+            process = mIdleWorkers.takeLast();
+            debug() << "Giving" << jobId << node->job->source.key() << node->job.get() << "to rp worker" << process->pid();
+        } else {
+            debug() << "Starting process for" << jobId << node->job->source.key() << node->job.get();
+            process = startProcess(rp);
+        }
+        if (!process) {
             node->job->flags |= IndexerJob::Crashed;
             debug() << "job crashed (didn't start)" << jobId << node->job->source.key() << node->job.get();
             std::shared_ptr<IndexDataMessage> msg(new IndexDataMessage(node->job));
@@ -150,42 +236,15 @@ void JobScheduler::startJobs()
             warning() << "Letting" << node->job->sourceFile << "go even with a headerheader error from" << Location::path(headerError);
             mHeaderErrorJobIds.insert(jobId);
         }
-        process->finished().connect([this, jobId](Process *proc) {
-                EventLoop::deleteLater(proc);
-                auto node = mActiveByProcess.take(proc);
-                assert(!node || node->process == proc);
-                const String stdErr = proc->readAllStdErr();
-                const String stdOut = proc->readAllStdOut();
-                if (!stdOut.isEmpty() || !stdErr.isEmpty()) {
-                    error() << (node ? node->job->sourceFile : String("Orphaned process")) << '\n' << stdErr << stdOut;
-                }
-
-                if (node) {
-                    assert(node->process == proc);
-                    node->process = 0;
-                    assert(!(node->job->flags & IndexerJob::Aborted));
-                    if (!(node->job->flags & IndexerJob::Complete) && proc->returnCode() != 0) {
-                        auto nodeById = mActiveById.take(jobId);
-                        assert(nodeById);
-                        assert(nodeById == node);
-                        // job failed, probably no IndexDataMessage coming
-                        node->job->flags |= IndexerJob::Crashed;
-                        debug() << "job crashed" << jobId << node->job->source.key() << node->job.get();
-                        std::shared_ptr<IndexDataMessage> msg(new IndexDataMessage(node->job));
-                        msg->setFlag(IndexDataMessage::ParseFailure);
-                        jobFinished(node->job, msg);
-                    }
-                }
-                mHeaderErrorJobIds.remove(jobId);
-                startJobs();
-            });
-
 
         node->process = process;
         assert(!(node->job->flags & ~IndexerJob::Type_Mask));
         node->job->flags |= IndexerJob::Running;
         process->write(node->job->encode());
         mActiveByProcess[process] = node;
+        auto worker = mWorkers.find(process);
+        if (worker != mWorkers.end())
+            ++worker->second;
         mInactiveById.remove(jobId);
         mActiveById[jobId] = node;
         cont();
@@ -200,7 +259,18 @@ void JobScheduler::handleIndexDataMessage(const std::shared_ptr<IndexDataMessage
         return;
     }
     debug() << "job got index data message" << node->job->id << node->job->source.key() << node->job.get();
+    Process *worker = 0;
+    if (node->process && mWorkers.contains(node->process)) {
+        // the process is done with this job, it's not going to exit
+        worker = node->process;
+        mActiveByProcess.remove(worker);
+        node->process = 0;
+        mHeaderErrorJobIds.remove(node->job->id);
+        workerIdle(worker, message->flags() & IndexDataMessage::LastJob);
+    }
     jobFinished(node->job, message);
+    if (worker)
+        startJobs();
 }
 
 void JobScheduler::jobFinished(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &message)
@@ -293,9 +363,11 @@ void JobScheduler::abort(const std::shared_ptr<IndexerJob> &job)
         debug() << "Aborting active job" << job->source.sourceFile() << job->source.key() << job->id << job.get();
     }
     if (node->process) {
+        // workers too, they might be in the middle of sending us data for it
         debug() << "Killing process" << node->process;
         node->process->kill();
         mActiveByProcess.remove(node->process);
+        mHeaderErrorJobIds.remove(job->id);
     }
 }
 
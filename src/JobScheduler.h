@@ -63,12 +63,20 @@ private:
     };
     uint32_t hasHeaderError(DependencyNode *node, Set<uint32_t> &seen) const;
     uint32_t hasHeaderError(uint32_t file, const std::shared_ptr<Project> &project) const;
+    Process *startProcess(const Path &rp);
+    void onProcessFinished(Process *process);
+    // lastJob if the worker said it's going to exit
+    void workerIdle(Process *process, bool lastJob);
 
     int mProcrastination;
     Set<uint32_t> mHeaderErrors;
     Set<uint64_t> mHeaderErrorJobIds;
     EmbeddedLinkedList<std::shared_ptr<Node> > mPendingJobs;
     Hash<Process *, std::shared_ptr<Node> > mActiveByProcess;
+    // with --rp-worker-jobs, jobs given to each running rp and the ones
+    // waiting for another job
+    Hash<Process *, int> mWorkers;
+    List<Process *> mIdleWorkers;
     Hash<uint64_t, std::shared_ptr<Node> > mActiveById, mInactiveById;
 };
 
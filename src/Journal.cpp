@@ -0,0 +1,195 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "Journal.h"
+#include "RTags.h"
+#include <rct/Log.h>
+#include <rct/Rct.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static inline void setError(String *error, int line)
+{
+    if (error) {
+        *error = Rct::strerror();
+        *error << " " << line;
+    }
+}
+
+// FNV-1a, like the fileids log
+static inline uint32_t checksum(const char *data, uint32_t size)
+{
+    uint32_t hash = 2166136261u;
+    for (uint32_t i=0; i<size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static inline bool writeAll(int fd, const char *data, uint64_t size)
+{
+    while (size) {
+        ssize_t w;
+        eintrwrap(w, ::write(fd, data, size));
+        if (w <= 0)
+            return false;
+        data += w;
+        size -= w;
+    }
+    return true;
+}
+
+Journal::Journal()
+    : mFD(-1), mSize(0)
+{
+}
+
+Journal::~Journal()
+{
+    close();
+}
+
+void Journal::close()
+{
+    if (mFD != -1) {
+        int ret;
+        eintrwrap(ret, ::close(mFD));
+        mFD = -1;
+    }
+    mSize = 0;
+}
+
+bool Journal::load(const Path &path, uint64_t checkpoint, List<String> &records, String *error)
+{
+    close();
+    int fd;
+    eintrwrap(fd, ::open(path.constData(), O_RDWR|O_APPEND));
+    if (fd == -1) {
+        setError(error, __LINE__);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        setError(error, __LINE__);
+        int ret;
+        eintrwrap(ret, ::close(fd));
+        return false;
+    }
+
+    String data(st.st_size, '\0');
+    ssize_t r = 0;
+    if (st.st_size)
+        eintrwrap(r, pread(fd, data.data(), st.st_size, 0));
+    if (r != st.st_size) {
+        setError(error, __LINE__);
+        int ret;
+        eintrwrap(ret, ::close(fd));
+        return false;
+    }
+
+    uint32_t magic = 0;
+    uint16_t version = 0;
+    uint64_t cp = 0;
+    if (data.size() >= HeaderSize) {
+        memcpy(&magic, data.constData(), sizeof(magic));
+        memcpy(&version, data.constData() + sizeof(magic), sizeof(version));
+        memcpy(&cp, data.constData() + sizeof(magic) + sizeof(version), sizeof(cp));
+    }
+    if (magic != Magic || version != RTags::DatabaseVersion || cp != checkpoint) {
+        if (error)
+            *error = "Journal doesn't belong to this project file";
+        int ret;
+        eintrwrap(ret, ::close(fd));
+        return false;
+    }
+
+    uint64_t size = HeaderSize;
+    while (size + RecordHeaderSize <= static_cast<uint64_t>(data.size())) {
+        uint32_t header[2]; // size, checksum
+        memcpy(header, data.constData() + size, sizeof(header));
+        const char *record = data.constData() + size + RecordHeaderSize;
+        if (size + RecordHeaderSize + header[0] > static_cast<uint64_t>(data.size())
+            || header[1] != checksum(record, header[0])) {
+            break;
+        }
+        records.append(String(record, header[0]));
+        size += RecordHeaderSize + header[0];
+    }
+
+    if (size != static_cast<uint64_t>(data.size())) {
+        // we died halfway through a write or the disk did, the records after
+        // a bad one can't be applied without it
+        ::error() << "Dropping" << (data.size() - size) << "bytes of damaged journal records from" << path;
+        int ret;
+        eintrwrap(ret, ftruncate(fd, size));
+    }
+    mFD = fd;
+    mSize = size;
+    return true;
+}
+
+bool Journal::reset(const Path &path, uint64_t checkpoint, String *error)
+{
+    close();
+    eintrwrap(mFD, ::open(path.constData(), O_RDWR|O_CREAT|O_TRUNC|O_APPEND, 0644));
+    if (mFD == -1 && Path::mkdir(path.parentDir(), Path::Recursive))
+        eintrwrap(mFD, ::open(path.constData(), O_RDWR|O_CREAT|O_TRUNC|O_APPEND, 0644));
+    if (mFD == -1) {
+        setError(error, __LINE__);
+        return false;
+    }
+
+    char header[HeaderSize];
+    const uint32_t magic = Magic;
+    const uint16_t version = RTags::DatabaseVersion;
+    memcpy(header, &magic, sizeof(magic));
+    memcpy(header + sizeof(magic), &version, sizeof(version));
+    memcpy(header + sizeof(magic) + sizeof(version), &checkpoint, sizeof(checkpoint));
+    if (!writeAll(mFD, header, sizeof(header))) {
+        setError(error, __LINE__);
+        close();
+        return false;
+    }
+    mSize = HeaderSize;
+    return true;
+}
+
+bool Journal::append(const String &record, String *error)
+{
+    if (mFD == -1) {
+        if (error)
+            *error = "Journal is not open";
+        return false;
+    }
+    String data;
+    const uint32_t header[] = {
+        static_cast<uint32_t>(record.size()),
+        checksum(record.constData(), record.size())
+    };
+    data.reserve(sizeof(header) + record.size());
+    data.append(reinterpret_cast<const char*>(header), sizeof(header));
+    data.append(record);
+    if (!writeAll(mFD, data.constData(), data.size())) {
+        setError(error, __LINE__);
+        int ret;
+        eintrwrap(ret, ftruncate(mFD, mSize));
+        return false;
+    }
+    mSize += data.size();
+    return true;
+}
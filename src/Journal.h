@@ -0,0 +1,62 @@
+#ifndef Journal_h
+#define Journal_h
+
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <rct/List.h>
+#include <rct/Path.h>
+#include <rct/String.h>
+
+/* Append-only log of the changes made to a project since its project file
+   was last written:
+
+   [uint32_t magic][uint16_t version][uint64_t checkpoint]
+   [uint32_t size][uint32_t checksum][char record[size]]...
+
+   checkpoint is the one the project file was written with, a journal that
+   doesn't match the project file belongs to an older one and is ignored.
+   Reading stops at the first record that's truncated or doesn't match its
+   checksum and the journal is cut off there. Only rdm writes to it so
+   there's no locking.
+*/
+
+class Journal
+{
+public:
+    Journal();
+    ~Journal();
+
+    // records that belong to checkpoint, a damaged record and everything
+    // after it is dropped
+    bool load(const Path &path, uint64_t checkpoint, List<String> &records, String *error = 0);
+    // starts over empty for a new checkpoint
+    bool reset(const Path &path, uint64_t checkpoint, String *error = 0);
+    bool append(const String &record, String *error = 0);
+    void close();
+
+    // not until it's been loaded or reset for a project file
+    bool isOpen() const { return mFD != -1; }
+    uint64_t size() const { return mSize; }
+private:
+    enum { Magic = 0x4c4a5452 }; // "RTJL"
+    enum { HeaderSize = sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint64_t) };
+    enum { RecordHeaderSize = sizeof(uint32_t) * 2 }; // size, checksum
+
+    int mFD;
+    uint64_t mSize;
+};
+
+#endif
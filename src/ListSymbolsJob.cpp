@@ -89,7 +89,7 @@ Set<String> ListSymbolsJob::imenu(const std::shared_ptr<Project> &project)
             continue;
         const int count = symbols->count();
         for (int j=0; j<count; ++j) {
-            const Symbol &symbol = symbols->valueAt(j);
+            const Symbol symbol = symbols->recordAt(j);
             if (symbol.isReference())
                 continue;
             switch (symbol.kind) {
@@ -105,7 +105,7 @@ Set<String> ListSymbolsJob::imenu(const std::shared_ptr<Project> &project)
                     break;
                 // fall through
             default: {
-                const String &symbolName = symbol.symbolName;
+                const String symbolName = symbols->valueAt(j).symbolName;
                 if (!string.isEmpty() && !symbolName.contains(string))
                     continue;
                 out.insert(symbolName);
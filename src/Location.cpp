@@ -15,12 +15,231 @@ along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include "Location.h"
 #include "Server.h"
+#include "SourceCache.h"
 #include <rct/Rct.h>
 #include "RTags.h"
-Hash<Path, uint32_t> Location::sPathsToIds;
-Hash<uint32_t, Path> Location::sIdsToPaths;
-uint32_t Location::sLastId = 0;
-std::mutex Location::sMutex;
+#include <atomic>
+#include <mutex>
+
+/* The path table. Paths are interned in an arena that's only ever appended
+   to, so anything handed out stays valid for the life of the process. Ids
+   index a two level array of nodes and the path -> id hash is open
+   addressed with atomic slots. Readers never lock, there's a single writer
+   at a time (sWriteMutex) and everything it adds is published with release
+   stores. When the hash grows the new table is published over the old one
+   which is retired but never freed since a reader might still be probing
+   it. Retired tables add up to less than the current one. */
+
+namespace {
+struct PathNode
+{
+    const char *data; // nul-terminated
+    uint32_t size, hash;
+    std::atomic<uint32_t> id;
+};
+
+struct PathHash
+{
+    PathHash(uint32_t c)
+        : capacity(c), slots(new std::atomic<PathNode*>[c])
+    {
+        for (uint32_t i=0; i<capacity; ++i)
+            slots[i].store(0, std::memory_order_relaxed);
+    }
+    const uint32_t capacity; // power of 2
+    std::atomic<PathNode*> *slots;
+};
+
+enum {
+    BlockBits = 12,
+    BlockSize = 1 << BlockBits,
+    BlockCount = (1 << Location::FileBits) >> BlockBits,
+    ArenaChunkSize = 64 * 1024,
+    InitialHashCapacity = 1024
+};
+}
+
+static std::atomic<std::atomic<PathNode*> *> sBlocks[BlockCount]; // id -> node
+static std::atomic<PathHash*> sHash;
+static std::atomic<uint32_t> sLastId;
+
+// only touched by the writer
+static std::mutex sWriteMutex;
+static uint32_t sHashCount = 0;
+static char *sArena = 0;
+static size_t sArenaLeft = 0;
+
+static inline uint32_t hashPath(const char *data, uint32_t size)
+{
+    uint32_t hash = 2166136261u;
+    for (uint32_t i=0; i<size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static inline PathNode *lookup(const char *data, uint32_t size, uint32_t hash)
+{
+    const PathHash *table = sHash.load(std::memory_order_acquire);
+    if (!table)
+        return 0;
+    const uint32_t mask = table->capacity - 1;
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        PathNode *node = table->slots[i].load(std::memory_order_acquire);
+        if (!node)
+            return 0;
+        if (node->hash == hash && node->size == size && !memcmp(node->data, data, size))
+            return node;
+    }
+}
+
+static inline PathNode *nodeForId(uint32_t id)
+{
+    if (!id || id >= (1u << Location::FileBits))
+        return 0;
+    const std::atomic<PathNode*> *block = sBlocks[id >> BlockBits].load(std::memory_order_acquire);
+    return block ? block[id & (BlockSize - 1)].load(std::memory_order_acquire) : 0;
+}
+
+static PathNode *createNode(const char *data, uint32_t size, uint32_t hash, uint32_t id)
+{
+    // writer only
+    const size_t needed = size + 1;
+    if (needed > sArenaLeft) {
+        const size_t chunk = std::max<size_t>(ArenaChunkSize, needed);
+        sArena = static_cast<char*>(malloc(chunk));
+        sArenaLeft = chunk;
+    }
+    char *str = sArena;
+    memcpy(str, data, size);
+    str[size] = '\0';
+    sArena += needed;
+    sArenaLeft -= needed;
+
+    PathNode *node = new PathNode;
+    node->data = str;
+    node->size = size;
+    node->hash = hash;
+    node->id.store(id, std::memory_order_relaxed);
+    return node;
+}
+
+static void insertNode(PathHash *table, PathNode *node)
+{
+    const uint32_t mask = table->capacity - 1;
+    uint32_t i = node->hash & mask;
+    while (table->slots[i].load(std::memory_order_relaxed))
+        i = (i + 1) & mask;
+    table->slots[i].store(node, std::memory_order_release);
+}
+
+static void addNode(PathNode *node)
+{
+    // writer only, keep the load at or below one half
+    PathHash *table = sHash.load(std::memory_order_relaxed);
+    if (!table || (sHashCount + 1) * 2 > table->capacity) {
+        PathHash *grown = new PathHash(table ? table->capacity * 2 : InitialHashCapacity);
+        if (table) {
+            for (uint32_t i=0; i<table->capacity; ++i) {
+                if (PathNode *n = table->slots[i].load(std::memory_order_relaxed))
+                    insertNode(grown, n);
+            }
+        }
+        sHash.store(grown, std::memory_order_release);
+        table = grown; // the old one is retired, see above
+    }
+    insertNode(table, node);
+    ++sHashCount;
+}
+
+static void setNodeForId(uint32_t id, PathNode *node)
+{
+    // writer only
+    assert(id && id < (1u << Location::FileBits));
+    std::atomic<PathNode*> *block = sBlocks[id >> BlockBits].load(std::memory_order_relaxed);
+    if (!block) {
+        block = new std::atomic<PathNode*>[BlockSize];
+        for (int i=0; i<BlockSize; ++i)
+            block[i].store(0, std::memory_order_relaxed);
+        sBlocks[id >> BlockBits].store(block, std::memory_order_release);
+    }
+    std::atomic<PathNode*> &slot = block[id & (BlockSize - 1)];
+    if (!slot.load(std::memory_order_relaxed))
+        slot.store(node, std::memory_order_release);
+}
+
+uint32_t Location::fileId(const char *path, int size)
+{
+    const PathNode *node = lookup(path, size, hashPath(path, size));
+    return node ? node->id.load(std::memory_order_acquire) : 0;
+}
+
+const char *Location::pathData(uint32_t id, int *size)
+{
+    const PathNode *node = nodeForId(id);
+    if (size)
+        *size = node ? node->size : 0;
+    return node ? node->data : 0;
+}
+
+uint32_t Location::lastId()
+{
+    return sLastId.load(std::memory_order_acquire);
+}
+
+uint32_t Location::insert(const Path &path, bool *added)
+{
+    *added = false;
+    const uint32_t hash = hashPath(path.constData(), path.size());
+    if (const PathNode *node = lookup(path.constData(), path.size(), hash))
+        return node->id.load(std::memory_order_acquire);
+
+    std::lock_guard<std::mutex> lock(sWriteMutex);
+    if (const PathNode *node = lookup(path.constData(), path.size(), hash))
+        return node->id.load(std::memory_order_relaxed);
+    const uint32_t id = sLastId.load(std::memory_order_relaxed) + 1;
+    PathNode *node = createNode(path.constData(), path.size(), hash, id);
+    setNodeForId(id, node);
+    addNode(node);
+    sLastId.store(id, std::memory_order_release);
+    *added = true;
+    return id;
+}
+
+void Location::set(const Path &path, uint32_t fileId)
+{
+    std::lock_guard<std::mutex> lock(sWriteMutex);
+    const uint32_t hash = hashPath(path.constData(), path.size());
+    PathNode *node = lookup(path.constData(), path.size(), hash);
+    if (node) {
+        node->id.store(fileId, std::memory_order_release);
+    } else {
+        node = createNode(path.constData(), path.size(), hash, fileId);
+        addNode(node);
+    }
+    setNodeForId(fileId, node);
+    if (fileId > sLastId.load(std::memory_order_relaxed))
+        sLastId.store(fileId, std::memory_order_release);
+}
+
+void Location::init(const Hash<uint32_t, Path> &idsToPaths)
+{
+    for (const auto &it : idsToPaths)
+        set(it.second, it.first);
+}
+
+Hash<uint32_t, Path> Location::idsToPaths()
+{
+    Hash<uint32_t, Path> ret;
+    const uint32_t last = lastId();
+    for (uint32_t id=1; id<=last; ++id) {
+        int size;
+        if (const char *data = pathData(id, &size))
+            ret[id] = Path(data, size);
+    }
+    return ret;
+}
 static inline uint64_t createMask(int startBit, int bitCount)
 {
     uint64_t mask = 0;
@@ -48,11 +267,14 @@ String Location::key(Flags<KeyFlag> flags) const
         extra += ctx.size();
     }
 
-    const Path p = path();
+    int size;
+    const char *p = pathData(fileId(), &size);
+    if (!p)
+        p = "";
 
-    String ret(p.size() + extra, ' ');
+    String ret(size + extra, ' ');
 
-    const int w = snprintf(ret.data(), ret.size() + extra + 1, "%s:%d:%d:", p.constData(), l, c);
+    const int w = snprintf(ret.data(), ret.size() + extra + 1, "%s:%d:%d:", p, l, c);
     if (!ctx.isEmpty()) {
         memcpy(ret.data() + w, ctx.constData(), ctx.size());
     }
@@ -61,41 +283,32 @@ String Location::key(Flags<KeyFlag> flags) const
 
 String Location::context(Flags<KeyFlag> flags) const
 {
-    const String code = path().readAll();
     String ret;
-    if (!code.isEmpty()) {
-        unsigned int l = line();
-        if (!l)
+    if (SourceCache *cache = SourceCache::instance()) {
+        if (!cache->line(fileId(), line(), ret))
             return String();
-        const char *ch = code.constData();
-        while (--l) {
-            ch = strchr(ch, '\n');
-            if (!ch)
-                return String();
-            ++ch;
-        }
-        const char *end = strchr(ch, '\n');
-        if (!end)
+    } else {
+        const String code = path().readAll();
+        if (!SourceCache::findLine(code.constData(), code.size(), line(), ret))
             return String();
+    }
 
-        ret.assign(ch, end - ch);
-        // error() << "foobar" << ret << bool(flags & NoColor);
-        if (!(flags & NoColor)) {
-            const int col = column() - 1;
-            if (col + 1 < ret.size()) {
-                int last = col;
-                if (ret.at(last) == '~')
-                    ++last;
-                while (ret.size() > last && (isalnum(ret.at(last)) || ret.at(last) == '_'))
-                    ++last;
-                static const char *color = "\x1b[32;1m"; // dark yellow
-                static const char *resetColor = "\x1b[0;0m";
-                // error() << "foobar"<< end << col << ret.size();
-                ret.insert(last, resetColor);
-                ret.insert(col, color);
-            }
-            // printf("[%s]\n", ret.constData());
+    // error() << "foobar" << ret << bool(flags & NoColor);
+    if (!(flags & NoColor)) {
+        const int col = column() - 1;
+        if (col + 1 < ret.size()) {
+            int last = col;
+            if (ret.at(last) == '~')
+                ++last;
+            while (ret.size() > last && (isalnum(ret.at(last)) || ret.at(last) == '_'))
+                ++last;
+            static const char *color = "\x1b[32;1m"; // dark yellow
+            static const char *resetColor = "\x1b[0;0m";
+            // error() << "foobar"<< end << col << ret.size();
+            ret.insert(last, resetColor);
+            ret.insert(col, color);
         }
+        // printf("[%s]\n", ret.constData());
     }
     return ret;
 }
@@ -27,12 +27,6 @@
 #if defined(OS_Linux)
 #include <linux/limits.h>
 #endif
-#ifndef RTAGS_SINGLE_THREAD
-#include <mutex>
-#define LOCK() const std::lock_guard<std::mutex> lock(sMutex)
-#else
-#define LOCK() do {} while (0)
-#endif
 
 static inline int intCompare(uint32_t l, uint32_t r)
 {
@@ -54,6 +48,12 @@ class Location
 public:
     uint64_t value;
 
+    enum {
+        FileBits = 22,
+        LineBits = 21,
+        ColumnBits = 64 - FileBits - LineBits
+    };
+
     Location()
         : value(0)
     {}
@@ -63,43 +63,29 @@ public:
     {
     }
 
-    static inline uint32_t fileId(const Path &path)
-    {
-        LOCK();
-        return sPathsToIds.value(path);
-    }
+    /* The path table is append-only and none of these lookups take a lock,
+       see Location.cpp. */
+    static uint32_t fileId(const Path &path) { return fileId(path.constData(), path.size()); }
+    static uint32_t fileId(const char *path, int size);
     static inline Path path(uint32_t id)
     {
-        LOCK();
-        return sIdsToPaths.value(id);
-    }
-
-    static uint32_t lastId()
-    {
-        LOCK();
-        return sLastId;
+        int size;
+        const char *data = pathData(id, &size);
+        return data ? Path(data, size) : Path();
     }
+    // the interned path, nul-terminated and valid for the life of the process
+    static const char *pathData(uint32_t id, int *size = 0);
+    static uint32_t lastId();
 
     static inline uint32_t insertFile(const Path &path)
     {
-        bool save = false;
-        (void)save;
         assert(!path.contains(".."));
         assert(path.resolved() == path);
-        uint32_t ret;
-        {
-            LOCK();
-            uint32_t &id = sPathsToIds[path];
-            if (!id) {
-                id = ++sLastId;
-                sIdsToPaths[id] = path;
-                save = true;
-            }
-            ret = id;
-        }
+        bool added;
+        const uint32_t ret = insert(path, &added);
 #ifndef RTAGS_SINGLE_THREAD
         extern void saveFileIds();
-        if (save)
+        if (added)
             saveFileIds();
 #endif
 
@@ -112,10 +98,8 @@ public:
 
     inline Path path() const
     {
-        if (mCachedPath.isEmpty()) {
-            LOCK();
-            mCachedPath = sIdsToPaths.value(fileId());
-        }
+        if (mCachedPath.isEmpty())
+            mCachedPath = Location::path(fileId());
         return mCachedPath;
     }
     inline bool isNull() const { return !value; }
@@ -216,55 +200,14 @@ public:
             return Location();
         return Location(fileId, line, col);
     }
-    static Hash<uint32_t, Path> idsToPaths()
-    {
-        LOCK();
-        return sIdsToPaths;
-    }
-    static Hash<Path, uint32_t> pathsToIds()
-    {
-        LOCK();
-        return sPathsToIds;
-    }
-    static void init(const Hash<Path, uint32_t> &pathsToIds)
-    {
-        LOCK();
-        sPathsToIds = pathsToIds;
-        sLastId = sPathsToIds.size();
-        for (const auto &it : sPathsToIds) {
-            sIdsToPaths[it.second] = it.first;
-        }
-    }
-
-    static void init(const Hash<uint32_t, Path> &idsToPaths)
-    {
-        LOCK();
-        sIdsToPaths = idsToPaths;
-        sLastId = sIdsToPaths.size();
-        for (const auto &it : sIdsToPaths) {
-            sPathsToIds[it.second] = it.first;
-        }
-    }
-
-    static void set(const Path &path, uint32_t fileId)
-    {
-        LOCK();
-        sPathsToIds[path] = fileId;
-        Path &p = sIdsToPaths[fileId];
-        if (p.isEmpty())
-            p = path;
-    }
+    static Hash<uint32_t, Path> idsToPaths();
+    // only meant to be called before anyone else looks at the table
+    static void init(const Hash<uint32_t, Path> &idsToPaths);
+    static void set(const Path &path, uint32_t fileId);
 private:
-    static std::mutex sMutex;
-    static Hash<Path, uint32_t> sPathsToIds;
-    static Hash<uint32_t, Path> sIdsToPaths;
-    static uint32_t sLastId;
+    static uint32_t insert(const Path &path, bool *added);
+
     mutable Path mCachedPath;
-    enum {
-        FileBits = 22,
-        LineBits = 21,
-        ColumnBits = 64 - FileBits - LineBits
-    };
     static const uint64_t FILEID_MASK;
     static const uint64_t LINE_MASK;
     static const uint64_t COLUMN_MASK;
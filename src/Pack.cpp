@@ -0,0 +1,311 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "Pack.h"
+#include <rct/Rct.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+
+// flock rather than fcntl locks since the latter are dropped when any
+// descriptor for the file is closed by the process, including the ones
+// Pack::load opens while an append is holding the lock
+static inline bool lock(int fd)
+{
+    int ret;
+    eintrwrap(ret, flock(fd, LOCK_EX));
+    return ret != -1;
+}
+
+static inline bool writeAll(int fd, const char *data, uint64_t size)
+{
+    while (size) {
+        ssize_t w;
+        eintrwrap(w, ::write(fd, data, size));
+        if (w <= 0)
+            return false;
+        data += w;
+        size -= w;
+    }
+    return true;
+}
+
+static inline void closeFD(int fd)
+{
+    int ret;
+    eintrwrap(ret, ::close(fd));
+}
+
+static inline void setError(String *error, int line)
+{
+    if (error) {
+        *error = Rct::strerror();
+        *error << " " << line;
+    }
+}
+
+Pack::~Pack()
+{
+    if (mPointer)
+        munmap(const_cast<char*>(mPointer), mSize);
+}
+
+std::shared_ptr<Pack> Pack::load(const Path &path, String *error)
+{
+    int fd;
+    eintrwrap(fd, open(path.constData(), O_RDONLY));
+    if (fd == -1) {
+        setError(error, __LINE__);
+        return std::shared_ptr<Pack>();
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        setError(error, __LINE__);
+        closeFD(fd);
+        return std::shared_ptr<Pack>();
+    }
+
+    std::shared_ptr<Pack> pack(new Pack);
+    if (st.st_size) {
+        // segments are never modified once they've been appended so we don't
+        // need to hold on to the file or any locks
+        const char *pointer = static_cast<const char*>(mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+        if (pointer == MAP_FAILED) {
+            setError(error, __LINE__);
+            closeFD(fd);
+            return std::shared_ptr<Pack>();
+        }
+        pack->mPointer = pointer;
+        pack->mSize = st.st_size;
+    }
+    closeFD(fd);
+    return pack;
+}
+
+bool Pack::contains(const Segment &segment, uint32_t fileId) const
+{
+    enum { HeaderSize = sizeof(uint32_t) * 3 };
+    if (segment.size < HeaderSize || segment.end() > mSize)
+        return false;
+    uint32_t header[3]; // magic, fileId, mapCount
+    memcpy(header, mPointer + segment.offset, sizeof(header));
+    return (header[0] == Magic
+            && header[1] == fileId
+            && HeaderSize + (header[2] * sizeof(uint64_t)) <= segment.size);
+}
+
+bool Pack::map(const Segment &segment, uint32_t fileId, int index,
+               const char **data, uint64_t *size, String *error) const
+{
+    if (!contains(segment, fileId)) {
+        if (error)
+            *error = String::format<128>("Invalid segment %llu/%llu in pack of size %llu",
+                                         static_cast<unsigned long long>(segment.offset),
+                                         static_cast<unsigned long long>(segment.size),
+                                         static_cast<unsigned long long>(mSize));
+        return false;
+    }
+    const char *header = mPointer + segment.offset;
+    uint32_t mapCount;
+    memcpy(&mapCount, header + (sizeof(uint32_t) * 2), sizeof(mapCount));
+    if (index < 0 || static_cast<uint32_t>(index) >= mapCount) {
+        if (error)
+            *error = String::format<64>("Invalid map %d, segment has %u", index, mapCount);
+        return false;
+    }
+
+    const char *sizes = header + (sizeof(uint32_t) * 3);
+    uint64_t offset = (sizeof(uint32_t) * 3) + (mapCount * sizeof(uint64_t));
+    uint64_t mapSize;
+    for (int i=0; i<=index; ++i) {
+        memcpy(&mapSize, sizes + (i * sizeof(uint64_t)), sizeof(mapSize));
+        if (i < index)
+            offset += mapSize;
+    }
+    if (offset + mapSize > segment.size || mapSize < sizeof(size_t)) {
+        if (error)
+            *error = String::format<64>("Truncated map %d", index);
+        return false;
+    }
+    *data = header + offset;
+    *size = mapSize;
+    return true;
+}
+
+static bool writeAll(int fd, List<iovec> &iov)
+{
+    size_t index = 0;
+    while (index < static_cast<size_t>(iov.size())) {
+        ssize_t w;
+        eintrwrap(w, ::writev(fd, &iov[index], std::min<size_t>(iov.size() - index, IOV_MAX)));
+        if (w <= 0)
+            return false;
+        while (w && static_cast<size_t>(w) >= iov[index].iov_len)
+            w -= iov[index++].iov_len;
+        if (w) {
+            iov[index].iov_base = static_cast<char*>(iov[index].iov_base) + w;
+            iov[index].iov_len -= w;
+        }
+        while (index < static_cast<size_t>(iov.size()) && !iov[index].iov_len)
+            ++index;
+    }
+    return true;
+}
+
+bool Pack::append(const Path &base, uint32_t generation, const Hash<uint32_t, SegmentMaps> &segments,
+                  Hash<uint32_t, Segment> &written, String *error)
+{
+    const Path path = Pack::path(base, generation);
+    int fd;
+    eintrwrap(fd, open(path.constData(), O_WRONLY|O_CREAT, 0644));
+    if (fd == -1 && Path::mkdir(path.parentDir(), Path::Recursive))
+        eintrwrap(fd, open(path.constData(), O_WRONLY|O_CREAT, 0644));
+    if (fd == -1) {
+        setError(error, __LINE__);
+        return false;
+    }
+    // only other rps appending to the same generation ever take this lock
+    if (!lock(fd)) {
+        setError(error, __LINE__);
+        closeFD(fd);
+        return false;
+    }
+
+    const off_t end = lseek(fd, 0, SEEK_END);
+    if (end == -1) {
+        setError(error, __LINE__);
+        closeFD(fd);
+        return false;
+    }
+
+    // [uint32_t magic][uint32_t fileId][uint32_t mapCount][uint64_t mapSizes[mapCount]][maps]
+    List<String> headers;
+    headers.reserve(segments.size());
+    List<iovec> iov;
+    uint64_t offset = end;
+    for (const auto &segment : segments) {
+        const SegmentMaps &maps = segment.second;
+        headers.append(String());
+        String &header = headers.last();
+        Serializer serializer(header);
+        serializer << static_cast<uint32_t>(Magic) << segment.first << static_cast<uint32_t>(maps.size());
+        uint64_t size = header.size() + (maps.size() * sizeof(uint64_t));
+        for (const List<String> &pieces : maps) {
+            uint64_t mapSize = 0;
+            for (const String &piece : pieces)
+                mapSize += piece.size();
+            serializer << mapSize;
+            size += mapSize;
+        }
+        iov.append({ const_cast<char*>(header.constData()), static_cast<size_t>(header.size()) });
+        for (const List<String> &pieces : maps) {
+            for (const String &piece : pieces) {
+                if (!piece.isEmpty())
+                    iov.append({ const_cast<char*>(piece.constData()), static_cast<size_t>(piece.size()) });
+            }
+        }
+
+        Segment &s = written[segment.first];
+        s.offset = offset;
+        s.size = size;
+        s.generation = generation;
+        offset += size;
+    }
+
+    bool ret = writeAll(fd, iov);
+    if (!ret) {
+        setError(error, __LINE__);
+        written.clear();
+        int err;
+        eintrwrap(err, ftruncate(fd, end));
+    }
+    closeFD(fd); // releases the lock
+    return ret;
+}
+
+bool Pack::compact(const Path &base, uint32_t generation,
+                   const Hash<uint32_t, Segment> &live,
+                   const Hash<uint32_t, std::shared_ptr<Pack> > &packs,
+                   Hash<uint32_t, Segment> &compacted, String *error)
+{
+    struct Source {
+        uint32_t generation;
+        uint64_t offset;
+        uint32_t fileId;
+        bool operator<(const Source &other) const
+        {
+            return generation < other.generation || (generation == other.generation && offset < other.offset);
+        }
+    };
+    List<Source> sources;
+    sources.reserve(live.size());
+    for (const auto &segment : live) {
+        const std::shared_ptr<Pack> pack = packs.value(segment.second.generation);
+        if (pack && pack->contains(segment.second, segment.first))
+            sources.append({ segment.second.generation, segment.second.offset, segment.first });
+    }
+    // read each of the old packs front to back
+    std::sort(sources.begin(), sources.end());
+
+    const Path path = Pack::path(base, generation);
+    const Path tmp = path + ".tmp";
+    int out;
+    eintrwrap(out, open(tmp.constData(), O_WRONLY|O_CREAT|O_TRUNC, 0644));
+    if (out == -1) {
+        setError(error, __LINE__);
+        return false;
+    }
+
+    uint64_t offset = 0;
+    for (const Source &source : sources) {
+        const Segment &old = live.value(source.fileId);
+        const std::shared_ptr<Pack> &pack = packs.value(old.generation);
+        if (!writeAll(out, pack->mPointer + old.offset, old.size)) {
+            setError(error, __LINE__);
+            closeFD(out);
+            unlink(tmp.constData());
+            compacted.clear();
+            return false;
+        }
+        Segment &s = compacted[source.fileId];
+        s.offset = offset;
+        s.size = old.size;
+        s.generation = generation;
+        offset += old.size;
+    }
+    closeFD(out);
+
+    // nobody knows about this generation yet so there's no one to wait for
+    const bool ret = !rename(tmp.constData(), path.constData());
+    if (!ret) {
+        setError(error, __LINE__);
+        unlink(tmp.constData());
+        compacted.clear();
+    }
+    return ret;
+}
+
+bool Pack::remove(const Path &base, uint32_t generation)
+{
+    const Path path = Pack::path(base, generation);
+    return !unlink(path.constData()) || errno == ENOENT;
+}
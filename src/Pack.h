@@ -0,0 +1,132 @@
+#ifndef Pack_h
+#define Pack_h
+
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <rct/Hash.h>
+#include <rct/List.h>
+#include <rct/Path.h>
+#include <rct/Serializer.h>
+#include <rct/String.h>
+#include <memory>
+#include "FileMap.h"
+
+/* Pack file layout:
+
+   A project's index lives in append-only pack files. Each indexer job
+   appends one segment per file it visited:
+
+   [uint32_t magic][uint32_t fileId][uint32_t mapCount][uint64_t mapSizes[mapCount]][maps...]
+
+   Every map is an encoded FileMap, or a SymbolMap for the symbols. The project keeps a directory of
+   fileId -> Segment pointing at the current segment of each file, segments
+   that have been superseded or belong to removed files are stale until the
+   pack is compacted.
+
+   Packs come in generations, <base>.<generation>. Jobs append to the
+   generation they were started with and compaction writes the live segments
+   into a brand new generation that only shows up under its name once it's
+   complete, so nothing ever rewrites or truncates a pack someone might have
+   mapped and appenders never wait for a compaction. Old generations are
+   removed once nothing refers to them anymore, mappings of them stay valid
+   until they're released.
+*/
+
+class Pack : public std::enable_shared_from_this<Pack>
+{
+public:
+    struct Segment {
+        Segment()
+            : offset(0), size(0), generation(0)
+        {}
+        uint64_t offset, size;
+        uint32_t generation;
+
+        bool isNull() const { return !size; }
+        uint64_t end() const { return offset + size; }
+        bool operator==(const Segment &other) const
+        {
+            return offset == other.offset && size == other.size && generation == other.generation;
+        }
+        bool operator!=(const Segment &other) const { return !operator==(other); }
+    };
+
+    ~Pack();
+
+    static Path path(const Path &base, uint32_t generation)
+    {
+        return base + String::format<16>(".%u", generation);
+    }
+    static std::shared_ptr<Pack> load(const Path &path, String *error = 0);
+    uint64_t size() const { return mSize; }
+
+    bool contains(const Segment &segment, uint32_t fileId) const;
+
+    // T is a FileMap or anything else that can be init()'ed from a map
+    template <typename T>
+    std::shared_ptr<T> openFileMap(const Segment &segment, uint32_t fileId, int index, String *error = 0) const
+    {
+        const char *data;
+        uint64_t size;
+        if (!map(segment, fileId, index, &data, &size, error))
+            return std::shared_ptr<T>();
+        std::shared_ptr<T> fileMap(new T);
+        fileMap->init(data, size, shared_from_this());
+        return fileMap;
+    }
+
+    // the maps of a segment, each in the pieces FileMap::encode() left it in
+    typedef List<List<String> > SegmentMaps;
+    // writes the maps of each file straight from their pieces
+    static bool append(const Path &base, uint32_t generation, const Hash<uint32_t, SegmentMaps> &segments,
+                       Hash<uint32_t, Segment> &written, String *error = 0);
+    // writes the live segments, found in packs, to a new pack of generation
+    static bool compact(const Path &base, uint32_t generation,
+                        const Hash<uint32_t, Segment> &live,
+                        const Hash<uint32_t, std::shared_ptr<Pack> > &packs,
+                        Hash<uint32_t, Segment> &compacted, String *error = 0);
+    static bool remove(const Path &base, uint32_t generation);
+private:
+    Pack()
+        : mPointer(0), mSize(0)
+    {}
+    bool map(const Segment &segment, uint32_t fileId, int index,
+             const char **data, uint64_t *size, String *error) const;
+
+    enum { Magic = 0x4b505452 }; // "RTPK"
+
+    const char *mPointer;
+    uint64_t mSize;
+};
+
+template <> struct FixedSize<Pack::Segment>
+{
+    static constexpr size_t value = sizeof(Pack::Segment);
+};
+
+template <> inline Serializer &operator<<(Serializer &s, const Pack::Segment &t)
+{
+    s << t.offset << t.size << t.generation;
+    return s;
+}
+
+template <> inline Deserializer &operator>>(Deserializer &s, Pack::Segment &t)
+{
+    s >> t.offset >> t.size >> t.generation;
+    return s;
+}
+
+#endif
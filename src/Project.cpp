@@ -15,12 +15,14 @@
 
 #include "Project.h"
 #include "FileManager.h"
+#include "FileIdSnapshot.h"
 #include "Diagnostic.h"
 #include "IndexerJob.h"
 #include "RTags.h"
 #include "Server.h"
 #include "JobScheduler.h"
 #include "RTagsLogOutput.h"
+#include "SourceCache.h"
 #include <math.h>
 #include <fnmatch.h>
 #include <rct/Log.h>
@@ -35,7 +37,39 @@
 #include <memory>
 #include "LogOutputMessage.h"
 
-enum { DirtyTimeout = 100 };
+enum {
+    DirtyTimeout = 100,
+    PackCompactionThreshold = 32 * 1024 * 1024,
+    JournalCheckpointThreshold = 4 * 1024 * 1024,
+    VisitedSnapshotDelta = 1024
+};
+
+class PackCompactionThread : public Thread
+{
+public:
+    typedef std::function<void(bool, const Hash<uint32_t, Pack::Segment> &)> Callback;
+    PackCompactionThread(const Path &path, uint32_t generation, const Hash<uint32_t, Pack::Segment> &live,
+                         const Hash<uint32_t, std::shared_ptr<Pack> > &packs, const Callback &callback)
+        : mPath(path), mGeneration(generation), mLive(live), mPacks(packs), mCallback(callback)
+    {}
+
+    virtual void run() override
+    {
+        Hash<uint32_t, Pack::Segment> compacted;
+        String err;
+        const bool ok = Pack::compact(mPath, mGeneration, mLive, mPacks, compacted, &err);
+        if (!ok)
+            error() << "Failed to compact" << mPath << err;
+        const Callback callback = mCallback;
+        EventLoop::mainEventLoop()->callLater([callback, ok, compacted]() { callback(ok, compacted); });
+    }
+private:
+    const Path mPath;
+    const uint32_t mGeneration;
+    const Hash<uint32_t, Pack::Segment> mLive;
+    const Hash<uint32_t, std::shared_ptr<Pack> > mPacks;
+    const Callback mCallback;
+};
 
 // these are externed from Source.cpp
 String findSymbolNameByUsr(const std::shared_ptr<Project> &project, uint32_t fileId, const String &usr)
@@ -61,6 +95,12 @@ Set<Symbol> findCallers(const std::shared_ptr<Project> &project, const Symbol &s
     return project->findCallers(symbol);
 }
 
+bool loadSymbolDetails(const std::shared_ptr<Project> &project, Symbol &symbol)
+{
+    assert(project);
+    return project->loadDetails(symbol);
+}
+
 
 class Dirty
 {
@@ -241,13 +281,19 @@ static void saveDependencies(DataFile &file, const Dependencies &dependencies)
 }
 
 Project::Project(const Path &path)
-    : mPath(path), mSourceFilePathBase(RTags::encodeSourceFilePath(Server::instance()->options().dataDir, path)),
-      mJobCounter(0), mJobsStarted(0)
+    : mFileMapCache(this, Server::instance()->options().maxFileMapCacheSize),
+      mPath(path), mPackPath(RTags::encodeSourceFilePath(Server::instance()->options().dataDir, path) + "pack"),
+      mVisitedPath(RTags::encodeSourceFilePath(Server::instance()->options().dataDir, path) + "visited"),
+      mPackGeneration(0), mPackLiveSize(0), mCompactingPack(false), mCheckpoint(0), mProjectFileSize(0),
+      mVisitedGeneration(0), mJobCounter(0), mJobsStarted(0), mSymbolNamesIndexed(false),
+      mSharedPch(RTags::encodeSourceFilePath(Server::instance()->options().dataDir, path) + "pch/",
+                 Server::instance()->options().sharedPchSources)
 {
     Path srcPath = mPath;
     RTags::encodePath(srcPath);
     const Server::Options &options = Server::instance()->options();
     mProjectFilePath = options.dataDir + srcPath + "/project";
+    mJournalPath = mProjectFilePath + ".journal";
 }
 
 Project::~Project()
@@ -257,6 +303,8 @@ Project::~Project()
         Server::instance()->jobScheduler()->abort(job.second);
     }
     mDependencies.deleteAll();
+    for (uint32_t generation : mVisitedGenerations)
+        FileIdSnapshot::remove(mVisitedPath, generation);
 
     assert(EventLoop::isMainThread());
     mDirtyTimer.stop();
@@ -298,6 +346,12 @@ bool Project::init()
     fileManager->init(shared_from_this(), FileManager::Asynchronous);
     mDirtyTimer.timeout().connect(std::bind(&Project::onDirtyTimeout, this, std::placeholders::_1));
 
+    {
+        String err;
+        if (!mUsrDictionary.load(RTags::encodeSourceFilePath(options.dataDir, mPath) + "usrs", &err))
+            error() << "Failed to load usr dictionary for" << mPath << err;
+    }
+
     DataFile file(mProjectFilePath, RTags::DatabaseVersion);
     if (!file.open(DataFile::Read)) {
         if (!file.error().isEmpty())
@@ -313,6 +367,29 @@ bool Project::init()
     }
     file >> mDeclarations;
     loadDependencies(file, mDependencies);
+    file >> mPackDirectory >> mPackGeneration >> mPackGenerations >> mUsrFiles >> mClassHierarchyFiles
+         >> mSymbolNamesIndexed >> mSymbolNameIndex >> mCheckpoint;
+    mProjectFileSize = mProjectFilePath.fileSize();
+    {
+        // the jobs that finished since the project file was written
+        List<String> records;
+        String err;
+        if (mJournal.load(mJournalPath, mCheckpoint, records, &err)) {
+            for (const String &record : records)
+                replay(record);
+            if (!records.isEmpty())
+                warning() << "Replayed" << records.size() << "jobs from" << mJournalPath;
+        } else if (mJournalPath.exists()) {
+            warning() << "Ignoring journal" << mJournalPath << err;
+        }
+    }
+    for (const auto &hierarchy : mClassHierarchyFiles)
+        addClassHierarchy(hierarchy.second);
+    for (const auto &segment : mPackDirectory) {
+        mPackLiveSize += segment.second.size;
+        uint64_t &end = mPackEnds[segment.second.generation];
+        end = std::max(end, segment.second.end());
+    }
 
     for (const auto &dep : mDependencies) {
         watch(Location::path(dep.first));
@@ -398,6 +475,8 @@ bool Project::init()
 
     if (needsSave)
         save();
+    // before the dirty jobs so the ones for the same sources take them over
+    startPendingFullPasses();
     startDirtyJobs(dirty.get());
     if (!missingFileMaps.isEmpty()) {
         SimpleDirty simple;
@@ -526,6 +605,77 @@ static String formatDiagnostics(const Diagnostics &diagnostics, DiagnosticsForma
     return ret;
 }
 
+void Project::encodeVisitedFiles(Serializer &serializer, uint64_t key)
+{
+    const std::shared_ptr<IndexerJob> job = mActiveJobs.value(key);
+    assert(job);
+    const Set<uint32_t> dependencies = Project::dependencies(job->source.fileId, ArgDependsOn);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    // rp maps the visited files as of the last snapshot and we send what
+    // changed since. Once that's too much we publish a new one.
+    if (!mVisitedGeneration || mVisitedDelta.size() > std::max<int>(VisitedSnapshotDelta, mVisitedFiles.size() / 16)) {
+        String err;
+        const uint32_t generation = mVisitedGeneration + 1;
+        if (FileIdSnapshot::write(mVisitedPath, generation, mVisitedFiles, &err)) {
+            mVisitedGeneration = generation;
+            mVisitedGenerations.insert(generation);
+            mVisitedDelta.clear();
+            removeStaleVisitedSnapshots();
+        } else {
+            error() << "Failed to write" << FileIdSnapshot::path(mVisitedPath, generation) << err;
+        }
+    }
+    Hash<uint32_t, Path> added;
+    Set<uint32_t> removed;
+    if (mVisitedGeneration && !mVisitedDelta.isEmpty()) {
+        for (uint32_t fileId : mVisitedDelta) {
+            const auto it = mVisitedFiles.find(fileId);
+            if (it != mVisitedFiles.end()) {
+                added[fileId] = it->second;
+            } else {
+                removed.insert(fileId);
+            }
+        }
+    }
+    job->visitedGeneration = mVisitedGeneration;
+    serializer << mVisitedPath << mVisitedGeneration;
+    serializer << (mVisitedGeneration ? added : mVisitedFiles) << removed;
+
+    // Saves rp a VisitFileMessage for every header it would have won anyway.
+    // If the job doesn't include one of these anymore it's released when the
+    // job finishes.
+    job->claimed.clear();
+    Hash<uint32_t, Path> claimed;
+    for (uint32_t fileId : dependencies) {
+        // the headers of a full pass are still ours from the declarations
+        // only one
+        const bool deferred = job->deferred.contains(fileId);
+        if (fileId == job->source.fileId || (!deferred && mVisitedFiles.contains(fileId)))
+            continue;
+        const Path path = Location::path(fileId);
+        if (path.isEmpty())
+            continue;
+        if (!mVisitedFiles.contains(fileId)) {
+            mVisitedFiles[fileId] = path;
+            mVisitedDelta.insert(fileId);
+        }
+        job->visited.insert(fileId);
+        job->claimed.insert(fileId);
+        claimed[fileId] = path;
+    }
+    serializer << claimed;
+}
+
+void Project::encodeSharedPch(Serializer &serializer, uint64_t key)
+{
+    const std::shared_ptr<IndexerJob> job = mActiveJobs.value(key);
+    assert(job);
+    Path pch, header;
+    mSharedPch.assign(job, pch, header);
+    serializer << pch << header;
+}
+
 void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &msg)
 {
     std::shared_ptr<IndexerJob> restart;
@@ -546,6 +696,17 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
     const auto &options = Server::instance()->options();
     if (!success) {
         releaseFileIds(job->visited);
+    } else if (!job->claimed.isEmpty()) {
+        // claimed headers it didn't include this time
+        const Set<uint32_t> visited = msg->visitedFiles();
+        Set<uint32_t> unused;
+        for (uint32_t fileId : job->claimed) {
+            if (!visited.contains(fileId)) {
+                unused.insert(fileId);
+                job->visited.remove(fileId);
+            }
+        }
+        releaseFileIds(unused);
     }
 
     auto src = mSources.find(msg->key());
@@ -554,6 +715,9 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
         error() << "Can't find source for" << Location::path(fileId);
         return;
     }
+    for (const auto &segment : msg->segments())
+        setSegment(segment.first, segment.second);
+
     if (!(msg->flags() & IndexDataMessage::ParseFailure)) {
         for (uint32_t fileId : job->visited) {
             if (!validate(fileId)) {
@@ -602,10 +766,41 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
     int symbolNames = 0;
     Set<uint32_t> visited = msg->visitedFiles();
     updateFixIts(visited, msg->fixIts());
-    updateDependencies(msg);
-    updateDeclarations(visited, msg->declarations());
+    const Set<uint32_t> dependencies = updateDependencies(msg);
+    Set<uint64_t> declarations;
+    updateDeclarations(visited, msg->declarations(), declarations);
+    updateClassHierarchy(visited, msg->baseClasses());
+    if (success && !(job->flags & IndexerJob::DeclarationsOnly) && !(msg->flags() & IndexDataMessage::ParseFailure))
+        mSharedPch.setPrefix(src->second, msg->includePrefix());
+    if (job->buildsPch) {
+        // what's in it is known now that the dependencies are
+        const bool built = success && !(msg->flags() & IndexDataMessage::PchFailure);
+        Set<uint32_t> files;
+        if (built) {
+            for (uint32_t header : mSharedPch.prefix(job->pch)) {
+                files.insert(header);
+                files += Project::dependencies(header, ArgDependsOn);
+            }
+        }
+        mSharedPch.finished(job, built, files);
+    } else if (job->pch && msg->flags() & IndexDataMessage::PchFailure) {
+        warning() << Location::path(fileId) << "was indexed without its shared pch";
+    }
+    bool collided = false;
+    {
+        String err;
+        Set<String> usrs;
+        if (!mUsrDictionary.insert(msg->usrs(), &err, &usrs))
+            error() << "Failed to add usrs to dictionary for" << mPath << err;
+        collided = !usrs.isEmpty();
+    }
     if (success) {
         src->second.parsed = msg->parseTime();
+        if (job->flags & IndexerJob::DeclarationsOnly) {
+            src->second.flags |= Source::DeclarationsOnly;
+        } else {
+            src->second.flags &= ~Source::DeclarationsOnly;
+        }
         error("[%3d%%] %d/%d %s %s. (%s)",
               static_cast<int>(round((double(idx) / double(mJobCounter)) * 100.0)), idx, mJobCounter,
               String::formatTime(time(0), String::Time).constData(),
@@ -621,7 +816,20 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
               Location::path(fileId).toTilde().constData());
     }
 
-    save();
+    // Write down what this job changed. Once the journal has grown to the
+    // size of the project file we write out the whole thing instead.
+    if (mJournal.size() > std::max<uint64_t>(JournalCheckpointThreshold, mProjectFileSize)
+        || !journal(job, visited, dependencies, declarations, msg->segments())) {
+        save();
+    }
+    // A usr that collided with another one was indexed with the other one's
+    // id, this and its headers are indexed again with the remapped id. Other
+    // sources that use the usr pick it up when they're indexed.
+    if (success && (job->flags & IndexerJob::DeclarationsOnly || collided)) {
+        Set<uint32_t> deferred = job->visited;
+        deferred.remove(job->source.fileId);
+        startFullPass(src->second, deferred);
+    }
     if (mActiveJobs.isEmpty()) {
         double timerElapsed = (mTimer.elapsed() / 1000.0);
         const double averageJobTime = timerElapsed / mJobsStarted;
@@ -632,11 +840,16 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
         mJobsStarted = mJobCounter = 0;
 
         // error() << "Finished this
+        removeStalePacks();
+        removeStaleVisitedSnapshots();
+        compactPack();
     }
 }
 
 bool Project::save()
 {
+    // the ids have to be on disk before anything that refers to them
+    Server::instance()->saveFileIds();
     DataFile file(mProjectFilePath, RTags::DatabaseVersion);
     if (!file.open(DataFile::Write)) {
         error("Save error %s: %s", mProjectFilePath.constData(), file.error().constData());
@@ -650,14 +863,181 @@ bool Project::save()
     }
     file << mDeclarations;
     saveDependencies(file, mDependencies);
+    file << mPackDirectory << mPackGeneration << mPackGenerations << mUsrFiles << mClassHierarchyFiles
+         << mSymbolNamesIndexed << mSymbolNameIndex << ++mCheckpoint;
     if (!file.flush()) {
         error("Save error %s: %s", mProjectFilePath.constData(), file.error().constData());
         return false;
     }
+    mProjectFileSize = mProjectFilePath.fileSize();
+
+    // everything in the journal is in the project file now
+    String err;
+    if (!mJournal.reset(mJournalPath, mCheckpoint, &err))
+        error() << "Failed to reset journal" << mJournalPath << err;
+    return true;
+}
+
+bool Project::journal(const std::shared_ptr<IndexerJob> &job, const Set<uint32_t> &visited,
+                      const Set<uint32_t> &dependencies, const Set<uint64_t> &declarations,
+                      const Hash<uint32_t, Pack::Segment> &segments)
+{
+    // there's no project file to journal against before the first save()
+    if (!mJournal.isOpen())
+        return false;
+
+    Server::instance()->saveFileIds();
+
+    // Everything is written as it is now, not as what changed, so replaying
+    // a record just overwrites those entries. Empty means gone.
+    String record;
+    Serializer serializer(record);
+
+    Sources sources;
+    for (auto it = mSources.lower_bound(Source::key(job->source.fileId, 0)); it != mSources.end(); ++it) {
+        uint32_t f, b;
+        Source::decodeKey(it->first, f, b);
+        if (f != job->source.fileId)
+            break;
+        sources.insert(*it);
+    }
+    serializer << job->source.fileId << sources;
+
+    Hash<uint32_t, Path> visitedFiles;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (uint32_t fileId : job->visited)
+            visitedFiles[fileId] = mVisitedFiles.value(fileId);
+        for (uint32_t fileId : visited)
+            visitedFiles[fileId] = mVisitedFiles.value(fileId);
+    }
+    serializer << visitedFiles;
+
+    Declarations decls;
+    for (uint64_t usr : declarations)
+        decls[usr] = mDeclarations.value(usr);
+    serializer << decls;
+
+    Hash<uint32_t, Set<uint32_t> > includes;
+    for (uint32_t fileId : dependencies) {
+        if (const DependencyNode *node = mDependencies.value(fileId)) {
+            Set<uint32_t> &inc = includes[fileId];
+            for (const auto &include : node->includes)
+                inc.insert(include.first);
+        }
+    }
+    serializer << includes;
+
+    Hash<uint32_t, Pack::Segment> directory;
+    for (const auto &segment : segments)
+        directory[segment.first] = mPackDirectory.value(segment.first);
+    serializer << directory;
+
+    Hash<uint32_t, ClassHierarchy> hierarchies;
+    for (uint32_t fileId : visited)
+        hierarchies[fileId] = mClassHierarchyFiles.value(fileId);
+    serializer << hierarchies << mPackGeneration << mPackGenerations;
 
+    String err;
+    if (!mJournal.append(record, &err)) {
+        error() << "Failed to journal" << Location::path(job->source.fileId) << mJournalPath << err;
+        return false;
+    }
     return true;
 }
 
+void Project::replay(const String &record)
+{
+    Deserializer deserializer(record);
+
+    uint32_t sourceFileId;
+    Sources sources;
+    deserializer >> sourceFileId >> sources;
+    auto it = mSources.lower_bound(Source::key(sourceFileId, 0));
+    while (it != mSources.end()) {
+        uint32_t f, b;
+        Source::decodeKey(it->first, f, b);
+        if (f != sourceFileId)
+            break;
+        mSources.erase(it++);
+    }
+    for (const auto &source : sources)
+        mSources[source.first] = source.second;
+
+    Hash<uint32_t, Path> visitedFiles;
+    deserializer >> visitedFiles;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (const auto &file : visitedFiles) {
+            if (file.second.isEmpty()) {
+                mVisitedFiles.remove(file.first);
+            } else {
+                mVisitedFiles[file.first] = file.second;
+            }
+            mVisitedDelta.insert(file.first);
+        }
+    }
+
+    Declarations declarations;
+    deserializer >> declarations;
+    Set<uint64_t> added;
+    for (auto &decl : declarations) {
+        if (decl.second.isEmpty()) {
+            mDeclarations.remove(decl.first);
+            mUsrFiles.remove(decl.first);
+        } else {
+            if (!mUsrFiles.contains(decl.first))
+                added.insert(decl.first);
+            mDeclarations[decl.first] = std::move(decl.second);
+        }
+    }
+
+    Hash<uint32_t, Set<uint32_t> > includes;
+    deserializer >> includes;
+    for (const auto &inc : includes) {
+        // don't bring back a node that's gone for a file that includes nothing
+        if (inc.second.isEmpty() && !mDependencies.contains(inc.first))
+            continue;
+        DependencyNode *&node = mDependencies[inc.first];
+        if (!node)
+            node = new DependencyNode(inc.first);
+        for (auto include : node->includes)
+            include.second->dependents.remove(inc.first);
+        node->includes.clear();
+        for (uint32_t fileId : inc.second) {
+            DependencyNode *&dependee = mDependencies[fileId];
+            if (!dependee)
+                dependee = new DependencyNode(fileId);
+            node->include(dependee);
+        }
+    }
+
+    Hash<uint32_t, Pack::Segment> directory;
+    deserializer >> directory;
+    for (const auto &segment : directory) {
+        updateIndexes(segment.first, mPackDirectory.value(segment.first), false);
+        if (segment.second.isNull()) {
+            mPackDirectory.remove(segment.first);
+        } else {
+            mPackDirectory[segment.first] = segment.second;
+            updateIndexes(segment.first, segment.second, true);
+        }
+    }
+
+    Hash<uint32_t, ClassHierarchy> hierarchies;
+    deserializer >> hierarchies;
+    for (auto &hierarchy : hierarchies) {
+        if (hierarchy.second.isEmpty()) {
+            mClassHierarchyFiles.remove(hierarchy.first);
+        } else {
+            mClassHierarchyFiles[hierarchy.first] = std::move(hierarchy.second);
+        }
+    }
+    deserializer >> mPackGeneration >> mPackGenerations;
+    if (!added.isEmpty())
+        addUsrFiles(added);
+}
+
 static inline void markActive(Sources::iterator start, uint32_t buildId, const Sources::iterator end)
 {
     const uint32_t fileId = start->second.fileId;
@@ -731,6 +1111,7 @@ void Project::index(const std::shared_ptr<IndexerJob> &job)
                         // no updates
                         return;
                     } else if (disallowMultiple) {
+                        mSharedPch.removeSource(it->first);
                         mSources.erase(it++);
                         continue;
                     }
@@ -745,12 +1126,21 @@ void Project::index(const std::shared_ptr<IndexerJob> &job)
         }
     }
 
+    Server *server = Server::instance();
+    if (job->flags & IndexerJob::Compile && server->options().options & Server::TieredIndexing
+        && !server->isActiveBuffer(job->source.fileId)) {
+        // references and targets come later, see onJobFinished()
+        job->flags |= IndexerJob::DeclarationsOnly;
+    }
+
     Source &src = mSources[key];
     src = job->source;
     src.flags |= Source::Active;
 
     std::shared_ptr<IndexerJob> &ref = mActiveJobs[key];
     if (ref) {
+        // whatever replaces a pending full pass takes over its headers
+        job->deferred.unite(ref->deferred);
         releaseFileIds(ref->visited);
         Server::instance()->jobScheduler()->abort(ref);
         --mJobCounter;
@@ -762,6 +1152,8 @@ void Project::index(const std::shared_ptr<IndexerJob> &job)
         mTimer.start();
     }
 
+    job->packGeneration = mPackGeneration;
+    mPackGenerations.insert(mPackGeneration);
     Server::instance()->jobScheduler()->add(job);
 }
 
@@ -771,6 +1163,8 @@ void Project::onFileModifiedOrAdded(const Path &file)
     debug() << file << "was modified or added " << fileId;
     if (!fileId)
         return;
+    if (SourceCache *cache = SourceCache::instance())
+        cache->invalidate(fileId);
     if (Server::instance()->suspended() || mSuspendedFiles.contains(fileId)) {
         warning() << file << "is suspended. Ignoring modification";
         return;
@@ -787,11 +1181,15 @@ void Project::onFileRemoved(const Path &file)
     debug() << file << "was removed" << fileId;
     if (!fileId)
         return;
-    Rct::removeDirectory(Project::sourceFilePath(fileId));
+    if (SourceCache *cache = SourceCache::instance())
+        cache->invalidate(fileId);
+    // nothing that isn't a job gets journaled
+    bool needSave = mPackDirectory.contains(fileId);
+    removeSegment(fileId);
+    removeClassHierarchy(fileId);
 
     const uint64_t key = Source::key(fileId, 0);
     auto it = mSources.lower_bound(key);
-    bool needSave = false;
     while (it != mSources.end()) {
         uint32_t f, b;
         Source::decodeKey(it->first, f, b);
@@ -804,6 +1202,7 @@ void Project::onFileRemoved(const Path &file)
             Server::instance()->jobScheduler()->abort(job);
         }
         debug() << "Erasing source" << Location::path(f);
+        mSharedPch.removeSource(it->first);
         mSources.erase(it++);
     }
 
@@ -884,7 +1283,7 @@ void Project::removeDependencies(uint32_t fileId)
     }
 }
 
-void Project::updateDependencies(const std::shared_ptr<IndexDataMessage> &msg)
+Set<uint32_t> Project::updateDependencies(const std::shared_ptr<IndexDataMessage> &msg)
 {
     const bool prune = !(msg->flags() & (IndexDataMessage::InclusionError|IndexDataMessage::ParseFailure));
     Set<uint32_t> files;
@@ -917,26 +1316,80 @@ void Project::updateDependencies(const std::shared_ptr<IndexDataMessage> &msg)
             inclusiary = new DependencyNode(it.second);
         includer->include(inclusiary);
     }
+    return files;
 }
 
-void Project::updateDeclarations(const Set<uint32_t> &visited, Declarations &declarations)
+void Project::updateDeclarations(const Set<uint32_t> &visited, Declarations &declarations, Set<uint64_t> &touched)
 {
     auto it = mDeclarations.begin();
     while (it != mDeclarations.end()) {
-        if (it->second.remove([&visited](uint32_t key) { return visited.contains(key); }) && it->second.isEmpty()) {
-            mDeclarations.erase(it++);
-        } else {
-            ++it;
+        if (it->second.remove([&visited](uint32_t key) { return visited.contains(key); })) {
+            touched.insert(it->first);
+            // the ones that are declared again keep their files
+            if (it->second.isEmpty() && !declarations.contains(it->first)) {
+                mUsrFiles.remove(it->first);
+                mDeclarations.erase(it++);
+                continue;
+            }
         }
+        ++it;
     }
+    Set<uint64_t> added;
     for (auto &u : declarations) {
+        touched.insert(u.first);
         auto &cur = mDeclarations[u.first];
         if (cur.isEmpty()) {
+            if (!mUsrFiles.contains(u.first))
+                added.insert(u.first);
             cur = std::move(u.second);
         } else {
             cur.unite(u.second);
         }
     }
+    if (!added.isEmpty())
+        addUsrFiles(added);
+}
+
+void Project::updateClassHierarchy(const Set<uint32_t> &visited, Hash<uint32_t, ClassHierarchy> &baseClasses)
+{
+    for (uint32_t fileId : visited)
+        removeClassHierarchy(fileId);
+    for (auto &hierarchy : baseClasses) {
+        addClassHierarchy(hierarchy.second);
+        mClassHierarchyFiles[hierarchy.first] = std::move(hierarchy.second);
+    }
+}
+
+void Project::addClassHierarchy(const ClassHierarchy &baseClasses)
+{
+    for (const auto &derived : baseClasses) {
+        for (uint64_t base : derived.second) {
+            if (!mClassEdges[std::make_pair(derived.first, base)]++) {
+                mBaseClasses[derived.first].insert(base);
+                mSubclasses[base].insert(derived.first);
+            }
+        }
+    }
+}
+
+void Project::removeClassHierarchy(uint32_t fileId)
+{
+    auto remove = [](ClassHierarchy &graph, uint64_t from, uint64_t to) {
+        auto it = graph.find(from);
+        if (it != graph.end() && it->second.remove(to) && it->second.isEmpty())
+            graph.erase(it);
+    };
+    for (const auto &derived : mClassHierarchyFiles.take(fileId)) {
+        for (uint64_t base : derived.second) {
+            auto edge = mClassEdges.find(std::make_pair(derived.first, base));
+            assert(edge != mClassEdges.end());
+            if (!--edge->second) {
+                mClassEdges.erase(edge);
+                remove(mBaseClasses, derived.first, base);
+                remove(mSubclasses, base, derived.first);
+            }
+        }
+    }
 }
 
 int Project::reindex(const Match &match, const std::shared_ptr<QueryMessage> &query)
@@ -970,6 +1423,7 @@ int Project::remove(const Match &match)
         if (match.match(it->second.sourceFile())) {
             const uint32_t fileId = it->second.fileId;
             const uint64_t key = it->first;
+            mSharedPch.removeSource(key);
             mSources.erase(it++);
             std::shared_ptr<IndexerJob> job = mActiveJobs.take(key);
             if (job) {
@@ -977,12 +1431,14 @@ int Project::remove(const Match &match)
                 Server::instance()->jobScheduler()->abort(job);
             }
             removeDependencies(fileId);
+            removeSegment(fileId);
             ++count;
-            unlink(sourceFilePath(fileId).constData());
         } else {
             ++it;
         }
     }
+    if (count)
+        save();
     return count;
 }
 
@@ -996,11 +1452,13 @@ int Project::startDirtyJobs(Dirty *dirty, const UnsavedFiles &unsavedFiles)
         }
     }
     const Set<uint32_t> dirtyFiles = dirty->dirtied();
+    mSharedPch.invalidate(dirtyFiles);
 
     {
         std::lock_guard<std::mutex> lock(mMutex);
         for (const auto &fileId : dirtyFiles) {
-            mVisitedFiles.remove(fileId);
+            if (mVisitedFiles.remove(fileId))
+                mVisitedDelta.insert(fileId);
         }
     }
 
@@ -1012,6 +1470,39 @@ int Project::startDirtyJobs(Dirty *dirty, const UnsavedFiles &unsavedFiles)
     return toIndex.size();
 }
 
+void Project::startFullPass(const Source &source, const Set<uint32_t> &deferred)
+{
+    std::shared_ptr<IndexerJob> job(new IndexerJob(source, IndexerJob::Dirty, shared_from_this()));
+    job->priority = IndexerJob::Deferred;
+    job->deferred = deferred;
+    index(job);
+}
+
+void Project::startPendingFullPasses()
+{
+    List<Source> pending;
+    for (const auto &source : mSources) {
+        if (source.second.flags & Source::DeclarationsOnly)
+            pending << source.second;
+    }
+    if (pending.isEmpty())
+        return;
+
+    // Which headers each declarations only pass won isn't saved so they're
+    // handed out in order. A header some other source had indexed fully
+    // gets indexed again.
+    const JobScheduler::JobScope scope(Server::instance()->jobScheduler());
+    Set<uint32_t> assigned;
+    for (const auto &source : pending) {
+        Set<uint32_t> deferred;
+        for (uint32_t fileId : dependencies(source.fileId, ArgDependsOn)) {
+            if (fileId != source.fileId && assigned.insert(fileId))
+                deferred.insert(fileId);
+        }
+        startFullPass(source, deferred);
+    }
+}
+
 bool Project::isIndexed(uint32_t fileId) const
 {
     {
@@ -1115,13 +1606,27 @@ void Project::findSymbols(const String &string,
         lowerBound = string;
     }
 
-    auto processFile = [this, &lowerBound, &string, wildcard, cs, inserter](uint32_t file) {
-        auto symNames = openSymbolNames(file);
+    auto matches = [&string, wildcard, cs](const char *key, int size, SymbolMatchType *type) {
+        *type = Exact;
+        if (string.isEmpty())
+            return true;
+        if (wildcard) {
+            if (!Rct::wildCmp(string.constData(), key, cs))
+                return false;
+            *type = Wildcard;
+        } else if (!KeyView(key, size).startsWith(string, cs)) {
+            return false;
+        } else if (size != string.size()) {
+            *type = StartsWith;
+        }
+        return true;
+    };
+
+    if (fileFilter) {
+        auto symNames = openSymbolNames(fileFilter);
         if (!symNames)
             return;
         const int count = symNames->count();
-        // error() << "Looking at" << count << Location::path(dep.first)
-        //         << lowerBound << string;
         int idx = 0;
         if (!lowerBound.isEmpty()) {
             idx = symNames->lowerBound(lowerBound);
@@ -1130,38 +1635,70 @@ void Project::findSymbols(const String &string,
             }
         }
 
+        // entry is only assigned to for keys we're actually going to report so
+        // its buffer gets reused across the whole search
+        String entry;
         for (int i=idx; i<count; ++i) {
-            const String &entry = symNames->keyAt(i);
-            // error() << i << count << entry;
-            SymbolMatchType type = Exact;
-            if (!string.isEmpty()) {
-                if (wildcard) {
-                    if (!Rct::wildCmp(string.constData(), entry.constData(), cs)) {
-                        continue;
-                    }
-                    type = Wildcard;
-                } else if (!entry.startsWith(string, cs)) {
-                    if (cs == String::CaseInsensitive) {
-                        continue;
-                    } else {
-                        break;
-                    }
-                    type = StartsWith;
-                } else if (entry.size() != string.size()) {
-                    type = StartsWith;
-                }
+            const KeyView key = symNames->keyViewAt(i);
+            SymbolMatchType type;
+            if (!matches(key.data, key.size, &type)) {
+                if (!wildcard && cs == String::CaseSensitive)
+                    break;
+                continue;
             }
+            entry.assign(key.data, key.size);
             inserter(type, entry, symNames->valueAt(i));
         }
-    };
+        return;
+    }
 
-    if (fileFilter) {
-        processFile(fileFilter);
-    } else {
-        for (const auto &dep : mDependencies) {
-            processFile(dep.first);
+    if (!mSymbolNamesIndexed)
+        indexSymbolNames();
+
+    List<String> fragments;
+    if (!lowerBound.isEmpty()) {
+        // case sensitive prefix, the sorted names take care of it
+    } else if (wildcard) {
+        String fragment;
+        for (int i=0; i<=string.size(); ++i) {
+            const char ch = i < string.size() ? string.at(i) : '*';
+            if (ch == '*' || ch == '?') {
+                if (!fragment.isEmpty())
+                    fragments << fragment;
+                fragment.clear();
+            } else {
+                fragment += ch;
+            }
         }
+    } else {
+        fragments << string;
     }
+
+    mSymbolNameIndex.visit(lowerBound, fragments, [&](const String &name, const List<uint32_t> &files) {
+            SymbolMatchType type;
+            if (!matches(name.constData(), name.size(), &type))
+                return;
+            for (uint32_t file : files) {
+                auto symNames = openSymbolNames(file);
+                if (!symNames)
+                    continue;
+                bool found;
+                const Set<Location> locations = symNames->value(name, &found);
+                if (found)
+                    inserter(type, name, locations);
+            }
+        });
+}
+
+void Project::indexSymbolNames()
+{
+    assert(!mSymbolNamesIndexed);
+    StopWatch sw;
+    mSymbolNamesIndexed = true;
+    mSymbolNameIndex.clear();
+    for (const auto &segment : mPackDirectory)
+        updateIndexes(segment.first, segment.second, true);
+    warning() << "Indexed symbol names for" << mPath << "in" << sw.elapsed() << "ms";
 }
 
 List<RTags::SortedSymbol> Project::sort(const Set<Symbol> &symbols, Flags<QueryMessage::Flag> flags)
@@ -1259,15 +1796,23 @@ Symbol Project::findSymbol(const Location &location, int *index)
         break;
     }
 
-    const Symbol &ret = symbols->valueAt(idx);
-    if (ret.location.fileId() != location.fileId()
-        || ret.location.line() != location.line()
-        || (location.column() - ret.location.column() >= ret.symbolLength)) {
+    const Symbol record = symbols->recordAt(idx);
+    if (record.location.fileId() != location.fileId()
+        || record.location.line() != location.line()
+        || (location.column() - record.location.column() >= record.symbolLength)) {
         return Symbol();
     }
     if (index)
         *index = idx;
-    return ret;
+    return symbols->valueAt(idx);
+}
+
+bool Project::loadDetails(Symbol &symbol)
+{
+    if (symbol.isNull())
+        return false;
+    auto symbols = openSymbols(symbol.location.fileId());
+    return symbols && symbols->loadDetails(symbol);
 }
 
 Set<Symbol> Project::findTargets(const Symbol &symbol)
@@ -1304,7 +1849,7 @@ Set<Symbol> Project::findTargets(const Symbol &symbol)
         }
         break; }
     default:
-        for (const String &usr : findTargetUsrs(symbol.location)) {
+        for (uint64_t usr : findTargetUsrs(symbol.location)) {
             ret.unite(findByUsr(usr, symbol.location.fileId(), Project::ArgDependsOn));
         }
         break;
@@ -1313,20 +1858,20 @@ Set<Symbol> Project::findTargets(const Symbol &symbol)
     return ret;
 }
 
-Set<Symbol> Project::findByUsr(const String &usr, uint32_t fileId, DependencyMode mode)
+Set<Symbol> Project::findByUsr(uint64_t usr, uint32_t fileId, DependencyMode mode)
 {
     assert(fileId);
     Set<Symbol> ret;
-    if (usr.startsWith("/")) {
+    if (const uint32_t includedFile = RTags::usrFileId(usr)) {
         Symbol sym;
-        sym.location = Location(Location::fileId(usr), 1, 1);
+        sym.location = Location(includedFile, 1, 1);
         ret.insert(sym);
         return ret;
     }
     if (mDeclarations.contains(usr)) {
         assert(!mDeclarations.value(usr).isEmpty());
-        for (const auto &dep : mDependencies) {
-            auto usrs = openUsrs(dep.first);
+        for (uint32_t file : usrFiles(usr)) {
+            auto usrs = openUsrs(file);
             if (usrs) {
                 for (const Location &loc : usrs->value(usr)) {
                     const Symbol c = findSymbol(loc);
@@ -1363,11 +1908,12 @@ static Set<Symbol> findReferences(const Set<Symbol> &inputs,
     // const bool isClazz = s.isClass();
     for (const Symbol &input : inputs) {
         //warning() << "Calling findReferences" << input.location;
+        const uint64_t usr = project->usrId(input.usr);
         auto process = [&](uint32_t dep) {
             // error() << "Looking at file" << Location::path(dep) << "for input" << input.location;
             auto targets = project->openTargets(dep);
             if (targets) {
-                const Set<Location> locations = targets->value(input.usr);
+                const Set<Location> locations = targets->value(usr);
                 // error() << "Got locations for usr" << input.usr << locations;
                 for (const auto &loc : locations) {
                     auto sym = project->findSymbol(loc);
@@ -1377,9 +1923,9 @@ static Set<Symbol> findReferences(const Set<Symbol> &inputs,
             }
         };
 
-        if (project->isDeclaration(input.usr)) {
-            for (auto dep : project->dependencies())
-                process(dep.first);
+        if (project->isDeclaration(usr)) {
+            for (uint32_t dep : project->usrFiles(usr))
+                process(dep);
         } else {
             for (auto dep : project->dependencies(input.location.fileId(), Project::DependsOnArg))
                 process(dep);
@@ -1474,7 +2020,7 @@ Set<Symbol> Project::findVirtuals(const Symbol &symbol)
         return Set<Symbol>();
 
     const Symbol parent = [this](const Symbol &symbol) {
-        for (const String &usr : findTargetUsrs(symbol.location)) {
+        for (uint64_t usr : findTargetUsrs(symbol.location)) {
             const Set<Symbol> syms = findByUsr(usr, symbol.location.fileId(), ArgDependsOn);
             for (const Symbol &sym : syms) {
                 if (findTargetUsrs(sym.location).isEmpty()) {
@@ -1503,48 +2049,49 @@ Set<Symbol> Project::findVirtuals(const Symbol &symbol)
     return ret;
 }
 
-Set<String> Project::findTargetUsrs(const Location &loc)
+Set<uint64_t> Project::findTargetUsrs(const Location &loc)
 {
-    Set<String> usrs;
-    auto targets = openTargets(loc.fileId());
-    if (targets) {
-        const int count = targets->count();
-        for (int i=0; i<count; ++i) {
-            if (targets->valueAt(i).contains(loc))
-                usrs.insert(targets->keyAt(i));
-        }
+    Set<uint64_t> usrs;
+    auto refs = openRefs(loc.fileId());
+    if (refs) {
+        for (uint64_t usr : refs->value(loc))
+            usrs.insert(usr);
     }
     return usrs;
 }
 
+String Project::usr(uint64_t usr) const
+{
+    if (const uint32_t includedFile = RTags::usrFileId(usr))
+        return Location::path(includedFile);
+    return mUsrDictionary.usr(usr);
+}
+
 Set<Symbol> Project::findSubclasses(const Symbol &symbol)
 {
     assert(symbol.isClass() && symbol.isDefinition());
     Set<Symbol> ret;
-    for (uint32_t dep : dependencies(symbol.location.fileId(), DependsOnArg)) {
-        auto symbols = openSymbols(dep);
-        if (symbols) {
-            const int count = symbols->count();
-            for (int i=0; i<count; ++i) {
-                const Symbol s = symbols->valueAt(i);
-                if (s.baseClasses.contains(symbol.usr))
-                    ret.insert(s);
-            }
+    for (uint64_t usr : mSubclasses.value(usrId(symbol.usr))) {
+        for (const Symbol &sym : findByUsr(usr, symbol.location.fileId(), DependsOnArg)) {
+            if (sym.isClass() && sym.isDefinition())
+                ret.insert(sym);
         }
     }
     return ret;
 }
 
-void Project::beginScope()
-{
-    assert(!mFileMapScope);
-    mFileMapScope.reset(new FileMapScope(shared_from_this(), Server::instance()->options().maxFileMapScopeCacheSize));
-}
-
-void Project::endScope()
+Set<Symbol> Project::findSuperclasses(const Symbol &symbol)
 {
-    assert(mFileMapScope);
-    mFileMapScope.reset();
+    Set<Symbol> ret;
+    for (uint64_t usr : mBaseClasses.value(usrId(symbol.usr))) {
+        for (const Symbol &sym : findByUsr(usr, symbol.location.fileId(), ArgDependsOn)) {
+            if (sym.isDefinition()) {
+                ret.insert(sym);
+                break;
+            }
+        }
+    }
+    return ret;
 }
 
 String Project::dumpDependencies(uint32_t fileId) const
@@ -1602,37 +2149,274 @@ void Project::dirty(uint32_t fileId)
     startDirtyJobs(&dirty);
 }
 
-bool Project::validate(uint32_t fileId, String *err) const
+bool Project::validate(uint32_t fileId, String *err)
 {
-    Path path;
+    const Pack::Segment segment = mPackDirectory.value(fileId);
     String error;
-    {
-        path = sourceFilePath(fileId, fileMapName(SymbolNames));
-        FileMap<String, Set<Location> > fileMap;
-        if (!fileMap.load(path, &error))
-            goto error;
+    if (segment.isNull()) {
+        error = "No segment";
+    } else {
+        const std::shared_ptr<Pack> p = pack(segment.generation);
+        if (p && p->contains(segment, fileId))
+            return true;
+        error = "Invalid segment";
     }
-    {
-        path = sourceFilePath(fileId, fileMapName(Symbols));
-        FileMap<Location, Symbol> fileMap;
-        if (!fileMap.load(path, &error))
-            goto error;
+    if (err)
+        Log(err) << "Error during validation:" << Location::path(fileId) << error << mPackPath;
+    return false;
+}
+
+std::shared_ptr<Pack> Project::pack(uint32_t generation)
+{
+    // rp appends to the pack so we have to map it again when a job gave us a
+    // segment we haven't seen yet. Maps opened from the old mapping keep it alive.
+    std::shared_ptr<Pack> &pack = mPacks[generation];
+    if (!pack || pack->size() < mPackEnds.value(generation)) {
+        String err;
+        pack = Pack::load(Pack::path(mPackPath, generation), &err);
+        if (!pack)
+            error() << "Failed to load pack" << Pack::path(mPackPath, generation) << err;
+    }
+    return pack;
+}
+
+void Project::setSegment(uint32_t fileId, const Pack::Segment &segment)
+{
+    Pack::Segment &old = mPackDirectory[fileId];
+    updateIndexes(fileId, old, false);
+    mPackLiveSize -= old.size;
+    mPackLiveSize += segment.size;
+    uint64_t &end = mPackEnds[segment.generation];
+    end = std::max(end, segment.end());
+    old = segment;
+    updateIndexes(fileId, segment, true);
+    mFileMapCache.invalidate(fileId);
+}
+
+void Project::removeSegment(uint32_t fileId)
+{
+    const Pack::Segment segment = mPackDirectory.take(fileId);
+    updateIndexes(fileId, segment, false);
+    mPackLiveSize -= segment.size;
+    mFileMapCache.invalidate(fileId);
+}
+
+const Set<uint32_t> &Project::usrFiles(uint64_t usr) const
+{
+    static const Set<uint32_t> empty;
+    auto it = mUsrFiles.find(usr);
+    return it == mUsrFiles.end() ? empty : it->second;
+}
+
+void Project::addUsrFiles(const Set<uint64_t> &usrs)
+{
+    // The segments that were there before these were declared, e.g. ones
+    // from a job that had the declaring header blocked. They include the
+    // header so they're among its dependents.
+    Set<uint32_t> files;
+    for (uint64_t usr : usrs) {
+        mUsrFiles[usr];
+        for (uint32_t declaration : mDeclarations.value(usr)) {
+            if (!files.contains(declaration))
+                files += dependencies(declaration, DependsOnArg);
+        }
     }
-    {
-        path = sourceFilePath(fileId, fileMapName(Targets));
-        FileMap<String, Set<Location> > fileMap;
-        if (!fileMap.load(path, &error))
-            goto error;
+    for (uint32_t fileId : files) {
+        const Pack::Segment segment = mPackDirectory.value(fileId);
+        const std::shared_ptr<Pack> p = segment.isNull() ? std::shared_ptr<Pack>() : pack(segment.generation);
+        if (!p)
+            continue;
+        for (FileMapType type : { Targets, Usrs }) {
+            auto map = p->openFileMap<FileMap<uint64_t, Set<Location> > >(segment, fileId, type);
+            if (!map)
+                continue;
+            const int count = map->count();
+            if (static_cast<size_t>(count) < usrs.size()) {
+                for (int i=0; i<count; ++i) {
+                    const uint64_t usr = map->keyAt(i);
+                    if (usrs.contains(usr))
+                        mUsrFiles[usr].insert(fileId);
+                }
+            } else {
+                for (uint64_t usr : usrs) {
+                    bool match;
+                    map->lowerBound(usr, &match);
+                    if (match)
+                        mUsrFiles[usr].insert(fileId);
+                }
+            }
+        }
     }
-    {
-        path = sourceFilePath(fileId, fileMapName(Usrs));
-        FileMap<String, Set<Location> > fileMap;
-        if (!fileMap.load(path, &error))
-            goto error;
+}
+
+void Project::updateIndexes(uint32_t fileId, const Pack::Segment &segment, bool add)
+{
+    if (segment.isNull() || (mUsrFiles.isEmpty() && !mSymbolNamesIndexed))
+        return;
+    const std::shared_ptr<Pack> p = pack(segment.generation);
+    if (!p)
+        return;
+
+    if (mSymbolNamesIndexed) {
+        if (auto symNames = p->openFileMap<FileMap<String, Set<Location> > >(segment, fileId, SymbolNames)) {
+            const int count = symNames->count();
+            for (int i=0; i<count; ++i) {
+                if (add) {
+                    mSymbolNameIndex.insert(symNames->keyAt(i), fileId);
+                } else {
+                    mSymbolNameIndex.remove(symNames->keyAt(i), fileId);
+                }
+            }
+        }
+    }
+
+    if (mUsrFiles.isEmpty())
+        return;
+    for (FileMapType type : { Targets, Usrs }) {
+        auto map = p->openFileMap<FileMap<uint64_t, Set<Location> > >(segment, fileId, type);
+        if (!map)
+            continue;
+        auto update = [&](Set<uint32_t> &files) {
+            if (add) {
+                files.insert(fileId);
+            } else {
+                files.remove(fileId);
+            }
+        };
+        // walk whichever side is smaller
+        const int count = map->count();
+        if (static_cast<size_t>(count) < mUsrFiles.size()) {
+            for (int i=0; i<count; ++i) {
+                auto it = mUsrFiles.find(map->keyAt(i));
+                if (it != mUsrFiles.end())
+                    update(it->second);
+            }
+        } else {
+            for (auto &usr : mUsrFiles) {
+                bool match;
+                map->lowerBound(usr.first, &match);
+                if (match)
+                    update(usr.second);
+            }
+        }
+    }
+}
+
+void Project::compactPack()
+{
+    if (mCompactingPack || mPackDirectory.isEmpty())
+        return;
+    // map everything as it is now, queries keep using these until the
+    // compacted pack is ready
+    Hash<uint32_t, std::shared_ptr<Pack> > packs;
+    uint64_t size = 0;
+    for (uint32_t generation : mPackGenerations) {
+        if (const std::shared_ptr<Pack> p = pack(generation)) {
+            packs[generation] = p;
+            size += p->size();
+        }
+    }
+    const uint64_t stale = size - std::min<uint64_t>(size, mPackLiveSize);
+    if (stale < PackCompactionThreshold || stale < mPackLiveSize)
+        return;
+
+    // The compacted pack gets a generation of its own and jobs started from
+    // here on append to the one after that so nobody has to wait for us.
+    const uint32_t generation = mPackGeneration + 1;
+    mPackGeneration += 2;
+    warning() << "Compacting" << mPackPath << "into generation" << generation << "stale" << stale << "live" << mPackLiveSize;
+    mCompactingPack = true;
+    std::weak_ptr<Project> weak = shared_from_this();
+    const Hash<uint32_t, Pack::Segment> live = mPackDirectory;
+    PackCompactionThread *thread = new PackCompactionThread(mPackPath, generation, live, packs,
+                                                            [weak, generation, live](bool ok, const Hash<uint32_t, Pack::Segment> &compacted) {
+            if (std::shared_ptr<Project> project = weak.lock())
+                project->onPackCompacted(ok, generation, live, compacted);
+        });
+    thread->setAutoDelete(true);
+    thread->start();
+}
+
+void Project::onPackCompacted(bool ok, uint32_t generation, const Hash<uint32_t, Pack::Segment> &live,
+                              const Hash<uint32_t, Pack::Segment> &compacted)
+{
+    assert(mCompactingPack);
+    mCompactingPack = false;
+    if (!ok)
+        return;
+
+    mPackGenerations.insert(generation);
+    // Files that have been reindexed or removed while we were compacting
+    // already moved on, the rest now live in the compacted pack.
+    Set<uint32_t> dropped;
+    for (const auto &segment : live) {
+        auto it = mPackDirectory.find(segment.first);
+        if (it == mPackDirectory.end() || it->second != segment.second)
+            continue;
+        const Pack::Segment moved = compacted.value(segment.first);
+        if (moved.isNull()) {
+            dropped.insert(segment.first);
+            updateIndexes(segment.first, segment.second, false); // still mapped
+            mPackDirectory.erase(it);
+        } else {
+            it->second = moved;
+        }
+    }
+    mPackLiveSize = 0;
+    mPackEnds.clear();
+    for (const auto &segment : mPackDirectory) {
+        mPackLiveSize += segment.second.size;
+        uint64_t &end = mPackEnds[segment.second.generation];
+        end = std::max(end, segment.second.end());
+    }
+    mFileMapCache.clear(); // let go of the old mappings
+    removeStalePacks();
+    save();
+    for (uint32_t fileId : dropped) {
+        error() << "Lost" << Location::path(fileId) << "while compacting" << mPackPath;
+        dirty(fileId);
+    }
+}
+
+void Project::removeStaleVisitedSnapshots()
+{
+    Set<uint32_t> used;
+    used.insert(mVisitedGeneration);
+    for (const auto &job : mActiveJobs)
+        used.insert(job.second->visitedGeneration);
+    for (auto it = mVisitedGenerations.begin(); it != mVisitedGenerations.end(); ) {
+        // rp keeps its mapping, it only has to be there when it starts
+        if (used.contains(*it)) {
+            ++it;
+        } else {
+            FileIdSnapshot::remove(mVisitedPath, *it);
+            mVisitedGenerations.erase(it++);
+        }
+    }
+}
+
+void Project::removeStalePacks()
+{
+    if (mPackGenerations.size() <= 1)
+        return;
+    Set<uint32_t> used;
+    used.insert(mPackGeneration);
+    for (const auto &job : mActiveJobs)
+        used.insert(job.second->packGeneration);
+    for (const auto &segment : mPackDirectory)
+        used.insert(segment.second.generation);
+
+    for (auto it = mPackGenerations.begin(); it != mPackGenerations.end(); ) {
+        const uint32_t generation = *it;
+        if (used.contains(generation)) {
+            ++it;
+            continue;
+        }
+        // queries holding on to its maps still have the mapping
+        mPacks.remove(generation);
+        mPackEnds.remove(generation);
+        if (!Pack::remove(mPackPath, generation))
+            error() << "Failed to remove" << Pack::path(mPackPath, generation) << Rct::strerror();
+        mPackGenerations.erase(it++);
     }
-    return true;
-error:
-    if (err)
-        Log(err) << "Error during validation:" << Location::path(fileId) << error << path;
-    return false;
 }
@@ -17,10 +17,16 @@
 #define Project_h
 
 #include "IndexerJob.h"
+#include "Journal.h"
 #include "Match.h"
+#include "Pack.h"
 #include "QueryMessage.h"
 #include "RTags.h"
 #include "RTagsClang.h"
+#include "SharedPch.h"
+#include "SymbolMap.h"
+#include "SymbolNameIndex.h"
+#include "UsrDictionary.h"
 #include <memory>
 #include <mutex>
 #include <rct/FileSystemWatcher.h>
@@ -71,7 +77,9 @@ public:
         Symbols,
         SymbolNames,
         Targets,
-        Usrs
+        Usrs,
+        Refs,
+        FileMapTypeCount
     };
     static const char *fileMapName(FileMapType type)
     {
@@ -84,28 +92,33 @@ public:
             return "targets";
         case Usrs:
             return "usrs";
+        case Refs:
+            return "refs";
+        case FileMapTypeCount:
+            break;
         }
         return 0;
     }
     std::shared_ptr<FileMap<String, Set<Location> > > openSymbolNames(uint32_t fileId)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<String, Set<Location> >(SymbolNames, fileId, mFileMapScope->symbolNames);
+        return mFileMapCache.openFileMap(SymbolNames, fileId, mFileMapCache.symbolNames);
     }
-    std::shared_ptr<FileMap<Location, Symbol> > openSymbols(uint32_t fileId)
+    std::shared_ptr<SymbolMap> openSymbols(uint32_t fileId)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<Location, Symbol>(Symbols, fileId, mFileMapScope->symbols);
+        return mFileMapCache.openFileMap(Symbols, fileId, mFileMapCache.symbols);
     }
-    std::shared_ptr<FileMap<String, Set<Location> > > openTargets(uint32_t fileId)
+    std::shared_ptr<FileMap<uint64_t, Set<Location> > > openTargets(uint32_t fileId)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<String, Set<Location> >(Targets, fileId, mFileMapScope->targets);
+        return mFileMapCache.openFileMap(Targets, fileId, mFileMapCache.targets);
     }
-    std::shared_ptr<FileMap<String, Set<Location> > > openUsrs(uint32_t fileId)
+    std::shared_ptr<FileMap<uint64_t, Set<Location> > > openUsrs(uint32_t fileId)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<String, Set<Location> >(Usrs, fileId, mFileMapScope->usrs);
+        return mFileMapCache.openFileMap(Usrs, fileId, mFileMapCache.usrs);
+    }
+    // the inverse of targets, location -> usr ids
+    std::shared_ptr<FileMap<Location, List<uint64_t> > > openRefs(uint32_t fileId)
+    {
+        return mFileMapCache.openFileMap(Refs, fileId, mFileMapCache.refs);
     }
 
     enum DependencyMode {
@@ -117,7 +130,14 @@ public:
     String dumpDependencies(uint32_t fileId) const;
     const Hash<uint32_t, DependencyNode*> &dependencies() const { return mDependencies; }
     const Declarations &declarations() const { return mDeclarations; }
-    bool isDeclaration(const String &usr) const { return mDeclarations.contains(usr); }
+    bool isDeclaration(uint64_t usr) const { return mDeclarations.contains(usr); }
+    // the files that define, declare or reference a usr that's declared in
+    // the project, so lookups don't have to look at every file
+    const Set<uint32_t> &usrFiles(uint64_t usr) const;
+    String usr(uint64_t usr) const;
+    uint64_t usrId(const String &usr) const { return mUsrDictionary.id(usr); }
+    // the usrs that collided with another one, rp has to use these ids
+    const Hash<String, uint64_t> &remappedUsrs() const { return mUsrDictionary.remapped(); }
 
     enum SymbolMatchType {
         Exact,
@@ -130,6 +150,8 @@ public:
                      uint32_t fileFilter = 0);
 
     Symbol findSymbol(const Location &location, int *index = 0);
+    // comments and base classes aren't part of the symbols returned by the find functions
+    bool loadDetails(Symbol &symbol);
     Set<Symbol> findTargets(const Location &location) { return findTargets(findSymbol(location)); }
     Set<Symbol> findTargets(const Symbol &symbol);
     Symbol findTarget(const Location &location) { return RTags::bestTarget(findTargets(location)); }
@@ -140,12 +162,15 @@ public:
     Set<Symbol> findCallers(const Symbol &symbol);
     Set<Symbol> findVirtuals(const Location &location) { return findVirtuals(findSymbol(location)); }
     Set<Symbol> findVirtuals(const Symbol &symbol);
-    Set<String> findTargetUsrs(const Location &loc);
+    Set<uint64_t> findTargetUsrs(const Location &loc);
     Set<Symbol> findSubclasses(const Symbol &symbol);
+    Set<Symbol> findSuperclasses(const Symbol &symbol);
 
-    Set<Symbol> findByUsr(const String &usr, uint32_t fileId, DependencyMode mode);
-
-    Path sourceFilePath(uint32_t fileId, const char *path = "") const;
+    Set<Symbol> findByUsr(uint64_t usr, uint32_t fileId, DependencyMode mode);
+    Set<Symbol> findByUsr(const String &usr, uint32_t fileId, DependencyMode mode)
+    {
+        return findByUsr(usrId(usr), fileId, mode);
+    }
 
     List<RTags::SortedSymbol> sort(const Set<Symbol> &symbols,
                                    Flags<QueryMessage::Flag> flags = Flags<QueryMessage::Flag>());
@@ -181,29 +206,60 @@ public:
         std::lock_guard<std::mutex> lock(mMutex);
         return mVisitedFiles;
     }
-    void encodeVisitedFiles(Serializer &serializer)
-    {
-        std::lock_guard<std::mutex> lock(mMutex);
-        serializer << mVisitedFiles;
-    }
+    // the files rp should leave alone followed by the ones it gets to index
+    // without asking, see IndexerJob::claimed
+    void encodeVisitedFiles(Serializer &serializer, uint64_t key);
+    // the pch rp should use and the header to build it from if it's the one
+    // to build it
+    void encodeSharedPch(Serializer &serializer, uint64_t key);
 
-    void beginScope();
-    void endScope();
     void dirty(uint32_t fileId);
 private:
-    bool validate(uint32_t fileId, String *error = 0) const;
+    bool validate(uint32_t fileId, String *error = 0);
+    std::shared_ptr<Pack> pack(uint32_t generation);
+    template <typename T>
+    std::shared_ptr<T> openFileMap(FileMapType type, uint32_t fileId, String *error);
+    void setSegment(uint32_t fileId, const Pack::Segment &segment);
+    void removeSegment(uint32_t fileId);
+    // keeps mUsrFiles and mSymbolNameIndex in sync with the pack directory
+    void updateIndexes(uint32_t fileId, const Pack::Segment &segment, bool add);
+    // looks for the usrs that just got declared in the segments we have
+    void addUsrFiles(const Set<uint64_t> &usrs);
+    void indexSymbolNames();
+    void compactPack();
+    void removeStaleVisitedSnapshots();
+    void onPackCompacted(bool ok, uint32_t generation, const Hash<uint32_t, Pack::Segment> &live,
+                         const Hash<uint32_t, Pack::Segment> &compacted);
+    void removeStalePacks();
     void removeDependencies(uint32_t fileId);
     void watch(const Path &file);
     void reloadFileManager();
-    void updateDependencies(const std::shared_ptr<IndexDataMessage> &msg);
-    void updateDeclarations(const Set<uint32_t> &visited, Declarations &declarations);
+    // returns the files whose dependencies might have changed
+    Set<uint32_t> updateDependencies(const std::shared_ptr<IndexDataMessage> &msg);
+    void updateDeclarations(const Set<uint32_t> &visited, Declarations &declarations, Set<uint64_t> &touched);
+    void updateClassHierarchy(const Set<uint32_t> &visited, Hash<uint32_t, ClassHierarchy> &baseClasses);
+    void addClassHierarchy(const ClassHierarchy &baseClasses);
+    void removeClassHierarchy(uint32_t fileId);
     void updateFixIts(const Set<uint32_t> &visited, FixIts &fixIts);
     int startDirtyJobs(Dirty *dirty, const UnsavedFiles &unsavedFiles = UnsavedFiles());
+    // the references and targets of a source indexed DeclarationsOnly
+    void startFullPass(const Source &source, const Set<uint32_t> &deferred);
+    void startPendingFullPasses();
     bool save();
+    bool journal(const std::shared_ptr<IndexerJob> &job, const Set<uint32_t> &visited,
+                 const Set<uint32_t> &dependencies, const Set<uint64_t> &declarations,
+                 const Hash<uint32_t, Pack::Segment> &segments);
+    void replay(const String &record);
     void onDirtyTimeout(Timer *);
 
-    struct FileMapScope {
-        FileMapScope(const std::shared_ptr<Project> &proj, int m)
+    /* Lives as long as the project so consecutive queries reuse the maps the
+       previous one opened. The maps are views into the packs, which stay
+       mapped whether they're cached or not, so this is bounded by the number
+       of maps only. setSegment()/removeSegment() drop the maps of a file when
+       its segment changes and the whole thing is cleared when the pack is
+       replaced. */
+    struct FileMapCache {
+        FileMapCache(Project *proj, int m)
             : project(proj), openedFiles(0), max(m)
         {}
 
@@ -233,60 +289,87 @@ private:
             entryList.append(ptr);
         }
 
-        template <typename Key, typename Value>
-        std::shared_ptr<FileMap<Key, Value> > openFileMap(FileMapType type, uint32_t fileId,
-                                                          Hash<uint32_t, std::shared_ptr<FileMap<Key, Value> > > &cache)
+        template <typename T>
+        std::shared_ptr<T> openFileMap(FileMapType type, uint32_t fileId, Hash<uint32_t, std::shared_ptr<T> > &cache)
         {
             auto it = cache.find(fileId);
             if (it != cache.end()) {
                 poke(type, fileId);
                 return it->second;
             }
-            const Path path = project->sourceFilePath(fileId, Project::fileMapName(type));
-            std::shared_ptr<FileMap<Key, Value> > fileMap(new FileMap<Key, Value>);
             String err;
-            if (fileMap->load(path, &err)) {
+            std::shared_ptr<T> fileMap = project->openFileMap<T>(type, fileId, &err);
+            if (fileMap) {
                 cache[fileId] = fileMap;
                 std::shared_ptr<LRUEntry> entry(new LRUEntry(type, fileId));
                 entryList.append(entry);
                 entryMap[entry->key] = entry;
                 if (++openedFiles > max) {
-                    const std::shared_ptr<LRUEntry> e = entryList.takeFirst();
+                    const std::shared_ptr<LRUEntry> e = entryList.first();
                     assert(e);
-                    entryMap.remove(e->key);
-                    switch (e->key.type) {
-                    case SymbolNames:
-                        assert(symbolNames.contains(e->key.fileId));
-                        symbolNames.remove(e->key.fileId);
-                        break;
-                    case Symbols:
-                        assert(symbols.contains(e->key.fileId));
-                        symbols.remove(e->key.fileId);
-                        break;
-                    case Targets:
-                        assert(targets.contains(e->key.fileId));
-                        targets.remove(e->key.fileId);
-                        break;
-                    case Usrs:
-                        assert(usrs.contains(e->key.fileId));
-                        usrs.remove(e->key.fileId);
-                        break;
-                    }
-                    --openedFiles;
+                    remove(e);
                 }
                 assert(openedFiles <= max);
             } else {
-                error() << "Failed to open" << path << Location::path(fileId) << err;
+                error() << "Failed to open" << Project::fileMapName(type) << Location::path(fileId) << err;
                 project->dirty(fileId);
-                fileMap.reset();
             }
             return fileMap;
         }
 
+        void remove(const std::shared_ptr<LRUEntry> &e)
+        {
+            entryList.remove(e);
+            entryMap.remove(e->key);
+            switch (e->key.type) {
+            case SymbolNames:
+                assert(symbolNames.contains(e->key.fileId));
+                symbolNames.remove(e->key.fileId);
+                break;
+            case Symbols:
+                assert(symbols.contains(e->key.fileId));
+                symbols.remove(e->key.fileId);
+                break;
+            case Targets:
+                assert(targets.contains(e->key.fileId));
+                targets.remove(e->key.fileId);
+                break;
+            case Usrs:
+                assert(usrs.contains(e->key.fileId));
+                usrs.remove(e->key.fileId);
+                break;
+            case Refs:
+                assert(refs.contains(e->key.fileId));
+                refs.remove(e->key.fileId);
+                break;
+            case FileMapTypeCount:
+                assert(0);
+                break;
+            }
+            --openedFiles;
+        }
+
+        void invalidate(uint32_t fileId)
+        {
+            for (int type=0; type<FileMapTypeCount; ++type) {
+                const LRUKey key = { static_cast<FileMapType>(type), fileId };
+                if (std::shared_ptr<LRUEntry> e = entryMap.value(key))
+                    remove(e);
+            }
+        }
+
+        void clear()
+        {
+            while (std::shared_ptr<LRUEntry> e = entryList.first())
+                remove(e);
+            assert(!openedFiles);
+        }
+
         Hash<uint32_t, std::shared_ptr<FileMap<String, Set<Location> > > > symbolNames;
-        Hash<uint32_t, std::shared_ptr<FileMap<Location, Symbol> > > symbols;
-        Hash<uint32_t, std::shared_ptr<FileMap<String, Set<Location> > > > targets, usrs;
-        std::shared_ptr<Project> project;
+        Hash<uint32_t, std::shared_ptr<SymbolMap> > symbols;
+        Hash<uint32_t, std::shared_ptr<FileMap<uint64_t, Set<Location> > > > targets, usrs;
+        Hash<uint32_t, std::shared_ptr<FileMap<Location, List<uint64_t> > > > refs;
+        Project *project;
         int openedFiles;
         const int max;
 
@@ -294,14 +377,32 @@ private:
         Map<LRUKey, std::shared_ptr<LRUEntry> > entryMap;
     };
 
-    std::shared_ptr<FileMapScope> mFileMapScope;
+    FileMapCache mFileMapCache;
+
+    const Path mPath, mPackPath, mVisitedPath;
+    Path mProjectFilePath, mJournalPath;
 
-    const Path mPath, mSourceFilePathBase;
-    Path mProjectFilePath;
+    // fileId -> the file's current segment in the pack
+    Hash<uint32_t, Pack::Segment> mPackDirectory;
+    uint32_t mPackGeneration; // the one new jobs append to
+    Set<uint32_t> mPackGenerations; // the ones that might exist on disk
+    Hash<uint32_t, std::shared_ptr<Pack> > mPacks;
+    Hash<uint32_t, uint64_t> mPackEnds; // generation -> end of its last known segment
+    uint64_t mPackLiveSize;
+    bool mCompactingPack;
+
+    // save() writes the whole project with a new checkpoint and starts a new
+    // journal, finished jobs are journaled in between
+    Journal mJournal;
+    uint64_t mCheckpoint, mProjectFileSize;
 
     Files mFiles;
 
     Hash<uint32_t, Path> mVisitedFiles;
+    // mVisitedFiles as of mVisitedGeneration is published as a FileIdSnapshot
+    // for rp, mVisitedDelta has the files that came or went since
+    uint32_t mVisitedGeneration;
+    Set<uint32_t> mVisitedGenerations, mVisitedDelta;
     int mJobCounter, mJobsStarted;
 
     Set<uint32_t> mHadDiagnostics;
@@ -315,6 +416,21 @@ private:
     StopWatch mTimer;
     FileSystemWatcher mWatcher;
     Declarations mDeclarations;
+    // see usrFiles(), there's an entry for every usr in mDeclarations
+    Hash<uint64_t, Set<uint32_t> > mUsrFiles;
+    // Inheritance edges by the file that defines the derived class. mBaseClasses
+    // and mSubclasses are the graph in both directions, built from these. The
+    // same class can be defined in more than one file so an edge stays in the
+    // graph until none of them has it, mClassEdges counts them.
+    Hash<uint32_t, ClassHierarchy> mClassHierarchyFiles;
+    ClassHierarchy mBaseClasses, mSubclasses;
+    Map<std::pair<uint64_t, uint64_t>, int> mClassEdges; // derived, base -> files
+    // built the first time someone searches for symbol names and saved with
+    // the project from then on, the journal keeps it up to date in between
+    SymbolNameIndex mSymbolNameIndex;
+    bool mSymbolNamesIndexed;
+    UsrDictionary mUsrDictionary;
+    SharedPch mSharedPch;
     Sources mSources;
     Set<Path> mWatchedPaths;
     FixIts mFixIts;
@@ -332,6 +448,7 @@ inline bool Project::visitFile(uint32_t visitFileId, const Path &path, uint64_t
     Path &p = mVisitedFiles[visitFileId];
     if (p.isEmpty()) {
         p = path;
+        mVisitedDelta.insert(visitFileId);
         if (key) {
             assert(mActiveJobs.contains(key));
             std::shared_ptr<IndexerJob> &job = mActiveJobs[key];
@@ -349,14 +466,24 @@ inline void Project::releaseFileIds(const Set<uint32_t> &fileIds)
         std::lock_guard<std::mutex> lock(mMutex);
         for (const auto &f : fileIds) {
             // error() << "Returning files" << Location::path(f);
-            mVisitedFiles.remove(f);
+            if (mVisitedFiles.remove(f))
+                mVisitedDelta.insert(f);
         }
     }
 }
 
-inline Path Project::sourceFilePath(uint32_t fileId, const char *type) const
+template <typename T>
+inline std::shared_ptr<T> Project::openFileMap(FileMapType type, uint32_t fileId, String *error)
 {
-    return String::format<1024>("%s%d/%s", mSourceFilePathBase.constData(), fileId, type);
+    const Pack::Segment segment = mPackDirectory.value(fileId);
+    std::shared_ptr<Pack> p;
+    if (segment.isNull()) {
+        if (error)
+            *error = "No segment in pack";
+    } else if ((p = pack(segment.generation))) {
+        return p->openFileMap<T>(segment, fileId, type, error);
+    }
+    return std::shared_ptr<T>();
 }
 
 #endif
@@ -26,8 +26,6 @@ QueryJob::QueryJob(const std::shared_ptr<QueryMessage> &query,
                    Flags<JobFlag> jobFlags)
     : mAborted(false), mLinesWritten(0), mQueryMessage(query), mJobFlags(jobFlags), mProject(proj)
 {
-    if (mProject)
-        mProject->beginScope();
     assert(query);
     if (query->flags() & QueryMessage::SilentQuery)
         setJobFlag(QuietJob);
@@ -48,8 +46,6 @@ QueryJob::QueryJob(const std::shared_ptr<QueryMessage> &query,
 
 QueryJob::~QueryJob()
 {
-    if (mProject)
-        mProject->endScope();
 }
 
 uint32_t QueryJob::fileFilter() const
@@ -150,14 +146,14 @@ bool QueryJob::write(const Location &location, Flags<WriteFlag> flags)
                 auto fileMap = project()->openSymbols(location.fileId());
                 if (fileMap) {
                     while (idx > 0) {
-                        symbol = fileMap->valueAt(--idx);
+                        symbol = fileMap->recordAt(--idx);
                         if (symbol.location.fileId() != fileId)
                             break;
                         if (symbol.isDefinition()
                             && RTags::isContainer(symbol.kind)
                             && comparePosition(line, column, symbol.startLine, symbol.startColumn) >= 0
                             && comparePosition(line, column, symbol.endLine, symbol.endColumn) <= 0) {
-                            out += "\tfunction: " + symbol.symbolName;
+                            out += "\tfunction: " + fileMap->valueAt(idx).symbolName;
                             break;
                         }
                     }
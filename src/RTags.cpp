@@ -26,6 +26,7 @@ along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
 #include <fnmatch.h>
 #include <rct/Rct.h>
 #include <rct/StopWatch.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #ifdef OS_FreeBSD
 #include <sys/sysctl.h>
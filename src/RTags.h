@@ -37,7 +37,7 @@ namespace RTags {
 enum {
     MajorVersion = 2,
     MinorVersion = 0,
-    DatabaseVersion = 68
+    DatabaseVersion = 83
 };
 
 inline String versionString()
@@ -69,7 +69,8 @@ typedef Map<Location, Diagnostic> Diagnostics;
 struct DependencyNode;
 typedef List<std::pair<uint32_t, uint32_t> > Includes;
 typedef Hash<uint32_t, DependencyNode*> Dependencies;
-typedef Hash<String, Set<uint32_t> > Declarations;
+typedef Hash<uint64_t, Set<uint32_t> > Declarations; // usr id -> files
+typedef Hash<uint64_t, Set<uint64_t> > ClassHierarchy; // class usr id -> base or derived class usr ids
 typedef Map<uint64_t, Source> Sources;
 typedef Map<Path, Set<String> > Files;
 typedef Hash<uint32_t, Set<FixIt> > FixIts;
@@ -86,6 +87,38 @@ inline bool addTo(Container &container, const Value &value)
     return container.size() != oldSize;
 }
 
+/* The index refers to usrs by 64 bit ids, the strings live in the project's
+   UsrDictionary which also gives a usr another id if this one is taken, so
+   look ids up through it (or the table it sends to rp). The targets of #include directives aren't usrs but the
+   included file, they get ids with FileUsrBit set and the fileId in the low
+   bits. */
+static const uint64_t FileUsrBit = 1ull << 63;
+
+static inline uint64_t usrId(const String &usr)
+{
+    if (usr.isEmpty())
+        return 0;
+    // FNV-1a, it has to be stable across processes and runs
+    uint64_t hash = 14695981039346656037ull;
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(usr.constData());
+    for (int i=0; i<usr.size(); ++i) {
+        hash ^= p[i];
+        hash *= 1099511628211ull;
+    }
+    hash &= ~FileUsrBit;
+    return hash ? hash : 1;
+}
+
+static inline uint64_t fileUsrId(uint32_t fileId)
+{
+    return FileUsrBit | fileId;
+}
+
+static inline uint32_t usrFileId(uint64_t usr)
+{
+    return usr & FileUsrBit ? static_cast<uint32_t>(usr) : 0;
+}
+
 static inline bool isSymbol(char ch)
 {
     return (isalnum(ch) || ch == '_' || ch == '~');
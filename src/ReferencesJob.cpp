@@ -76,8 +76,8 @@ int ReferencesJob::execute()
         if (rename && sym.isConstructorOrDestructor()) {
             const Location loc = sym.location;
             sym.clear();
-            const Set<String> usrs = proj->findTargetUsrs(loc);
-            for (const String &usr : usrs) {
+            const Set<uint64_t> usrs = proj->findTargetUsrs(loc);
+            for (uint64_t usr : usrs) {
                 for (const Symbol &s : proj->findByUsr(usr, loc.fileId(), Project::ArgDependsOn)) {
                     if (s.isClass()) {
                         sym = s;
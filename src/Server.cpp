@@ -45,10 +45,10 @@
 #include "IndexDataMessage.h"
 #include "RTags.h"
 #include "ReferencesJob.h"
+#include "SourceCache.h"
 #include "StatusJob.h"
 #include <clang-c/Index.h>
 #include <rct/Connection.h>
-#include <rct/DataFile.h>
 #include <rct/Value.h>
 #include <rct/EventLoop.h>
 #include <rct/SocketClient.h>
@@ -59,6 +59,7 @@
 #include <rct/Rct.h>
 #include <stdio.h>
 #include <arpa/inet.h>
+#include <unistd.h>
 #include <limits>
 #include <regex>
 #include <rct/QuitMessage.h>
@@ -116,15 +117,30 @@ private:
     SocketClient::SharedPtr mSocket;
 };
 
+// Called by Location::insertFile from whatever thread, the new ids are
+// written out in one go the next time the event loop gets to it.
 void saveFileIds()
 {
-    assert(Server::instance());
-    Server::instance()->saveFileIds();
+    Server *server = Server::instance();
+    assert(server);
+    if (!server->mFileIdsFlushPending.exchange(true)) {
+        if (EventLoop::SharedPtr loop = EventLoop::mainEventLoop()) {
+            loop->callLater([]() {
+                    if (Server *s = Server::instance()) {
+                        s->mFileIdsFlushPending = false;
+                        s->saveFileIds();
+                    }
+                });
+        } else {
+            server->mFileIdsFlushPending = false;
+        }
+    }
 }
 
 Server *Server::sInstance = 0;
 Server::Server()
-    : mSuspended(false), mVerbose(false), mExitCode(0), mLastFileId(0), mCompletionThread(0)
+    : mSuspended(false), mVerbose(false), mExitCode(0),
+      mFileIdsFlushPending(false), mCompletionThread(0)
 {
     assert(!sInstance);
     sInstance = this;
@@ -141,6 +157,12 @@ Server::~Server()
 
     stopServers();
     mProjects.clear(); // need to be destroyed before sInstance is set to 0
+    if (mFileIds.isDamaged()) {
+        writeFileIds();
+    } else {
+        saveFileIds();
+    }
+    mFileIds.close();
     assert(sInstance == this);
     sInstance = 0;
     Message::cleanup();
@@ -213,6 +235,7 @@ bool Server::init(const Options &options)
     }
 
     mJobScheduler.reset(new JobScheduler);
+    mSourceCache.reset(new SourceCache(static_cast<uint64_t>(mOptions.maxSourceCacheMemory) * 1024 * 1024));
 
     restoreFileIds();
     mUnixServer->newConnection().connect(std::bind(&Server::onNewConnection, this, std::placeholders::_1));
@@ -625,7 +648,11 @@ void Server::handleLogOutputMessage(const std::shared_ptr<LogOutputMessage> &mes
 void Server::handleIndexDataMessage(const std::shared_ptr<IndexDataMessage> &message, const std::shared_ptr<Connection> &conn)
 {
     mJobScheduler->handleIndexDataMessage(message);
-    conn->finish();
+    if (message->flags() & IndexDataMessage::Worker) {
+        conn->send(ResponseMessage()); // the worker keeps the connection for its next job
+    } else {
+        conn->finish();
+    }
     mIndexDataMessageReceived();
 }
 
@@ -1149,7 +1176,7 @@ void Server::clearProjects()
     Rct::removeDirectory(mOptions.dataDir);
     setCurrentProject(std::shared_ptr<Project>());
     mProjects.clear();
-    saveFileIds();
+    writeFileIds();
 }
 
 void Server::reindex(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1564,54 +1591,69 @@ void Server::classHierarchy(const std::shared_ptr<QueryMessage> &query, const st
 
 void Server::handleVisitFileMessage(const std::shared_ptr<VisitFileMessage> &message, const std::shared_ptr<Connection> &conn)
 {
-    uint32_t fileId = 0;
-    bool visit = false;
-
     std::shared_ptr<Project> project = mProjects.value(message->project());
     const uint64_t key = message->key();
-    if (project && project->isActiveJob(key)) {
-        assert(message->file() == message->file().resolved());
-        fileId = Location::insertFile(message->file());
-        visit = project->visitFile(fileId, message->file(), key);
+    const bool active = project && project->isActiveJob(key);
+    VisitFileResponseMessage msg;
+    for (const Path &file : message->files()) {
+        uint32_t fileId = 0;
+        bool visit = false;
+        if (active) {
+            assert(file == file.resolved());
+            fileId = Location::insertFile(file);
+            visit = project->visitFile(fileId, file, key);
+        }
+        msg.add(fileId, visit);
     }
-    VisitFileResponseMessage msg(fileId, visit);
     conn->send(msg);
 }
 
 void Server::restoreFileIds()
 {
-    const Path p = mOptions.dataDir + "fileids";
-    DataFile fileIdsFile(mOptions.dataDir + "fileids", RTags::DatabaseVersion);
-    if (fileIdsFile.open(DataFile::Read)) {
-        Hash<Path, uint32_t> pathsToIds;
-        fileIdsFile >> pathsToIds;
-        Location::init(pathsToIds);
-    } else {
-        if (!fileIdsFile.error().isEmpty()) {
-            error("Can't restore file ids: %s", fileIdsFile.error().constData());
-        }
+    const Path path = mOptions.dataDir + "fileids";
+    Hash<uint32_t, Path> idsToPaths;
+    String err;
+    if (!mFileIds.load(path, idsToPaths, &err)) {
+        if (!err.isEmpty())
+            error("Can't restore file ids: %s", err.constData());
         clearProjects();
+        return;
     }
+    Location::init(idsToPaths);
 }
 
 bool Server::saveFileIds()
 {
     const uint32_t lastId = Location::lastId();
-    if (mLastFileId == lastId)
+    if (mFileIds.lastId() == lastId)
         return true;
-    DataFile fileIdsFile(mOptions.dataDir + "fileids", RTags::DatabaseVersion);
-    if (!fileIdsFile.open(DataFile::Write)) {
-        error("Can't save file ids: %s", fileIdsFile.error().constData());
+    if (!mFileIds.isOpen())
+        return writeFileIds();
+
+    List<Path> paths;
+    for (uint32_t id = mFileIds.lastId() + 1; id <= lastId; ++id)
+        paths.append(Location::path(id));
+    String err;
+    if (!mFileIds.append(paths, &err)) {
+        error("Can't save file ids: %s", err.constData());
         return false;
     }
-    const Hash<Path, uint32_t> pathsToIds = Location::pathsToIds();
-    fileIdsFile << pathsToIds;
-    if (!fileIdsFile.flush()) {
-        error("Can't save file ids: %s", fileIdsFile.error().constData());
+    return true;
+}
+
+bool Server::writeFileIds()
+{
+    const uint32_t lastId = Location::lastId();
+    List<Path> paths;
+    paths.reserve(lastId);
+    for (uint32_t id=1; id<=lastId; ++id)
+        paths.append(Location::path(id));
+
+    String err;
+    if (!mFileIds.write(mOptions.dataDir + "fileids", paths, &err)) {
+        error("Can't save file ids: %s", err.constData());
         return false;
     }
-
-    mLastFileId = lastId;
     return true;
 }
 
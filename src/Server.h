@@ -16,6 +16,7 @@ along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
 #ifndef Server_h
 #define Server_h
 
+#include "FileIdLog.h"
 #include "FileManager.h"
 #include "RTagsClang.h"
 #include "RTags.h"
@@ -31,6 +32,7 @@ along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
 #include <rct/Timer.h>
 #include <rct/SocketServer.h>
 #include <rct/Flags.h>
+#include <atomic>
 
 class CompletionThread;
 class Connection;
@@ -44,6 +46,7 @@ class Project;
 class QueryMessage;
 class VisitFileMessage;
 class JobScheduler;
+class SourceCache;
 class Server
 {
 public:
@@ -74,6 +77,7 @@ public:
         NoComments = 0x80000,
         Launchd = 0x100000,     /* Only valid for Darwin... but you're
                                  * not out of bits yet. */
+        TieredIndexing = 0x200000
     };
     struct Options {
         Options()
@@ -81,13 +85,15 @@ public:
               rpVisitFileTimeout(0), rpIndexDataMessageTimeout(0), rpConnectTimeout(0),
               rpConnectAttempts(0), rpNiceValue(0), threadStackSize(0), maxCrashCount(0),
               completionCacheSize(0), testTimeout(60 * 1000 * 5),
-              maxFileMapScopeCacheSize(512)
+              maxFileMapCacheSize(512), maxSourceCacheMemory(64),
+              rpWorkerJobs(0), rpWorkerMaxMemory(0), sharedPchSources(0)
         {}
         Path socketFile, dataDir, argTransform;
         Flags<Option> options;
         int jobCount, headerErrorJobCount, rpVisitFileTimeout, rpIndexDataMessageTimeout,
             rpConnectTimeout, rpConnectAttempts, rpNiceValue, threadStackSize, maxCrashCount,
-            completionCacheSize, testTimeout, maxFileMapScopeCacheSize;
+            completionCacheSize, testTimeout, maxFileMapCacheSize, maxSourceCacheMemory,
+            rpWorkerJobs, rpWorkerMaxMemory, sharedPchSources;
         List<String> defaultArguments, excludeFilters;
         Set<String> blockedArguments;
         List<Source::Include> includePaths;
@@ -111,10 +117,12 @@ public:
     const Set<uint32_t> &activeBuffers() const { return mActiveBuffers; }
     bool isActiveBuffer(uint32_t fileId) const { return mActiveBuffers.contains(fileId); }
     int exitCode() const { return mExitCode; }
+    // appends the ids that aren't on disk yet
+    bool saveFileIds();
 private:
     String guessArguments(const String &args, const Path &pwd, const Path &projectRootOverride);
-    bool saveFileIds();
     void restoreFileIds();
+    bool writeFileIds(); // rewrites the whole log
     bool index(const String &arguments,
                const Path &pwd,
                const Path &projectRootOverride,
@@ -188,8 +196,10 @@ private:
     bool mVerbose;
 
     int mExitCode;
-    uint32_t mLastFileId;
+    FileIdLog mFileIds;
+    std::atomic<bool> mFileIdsFlushPending;
     std::shared_ptr<JobScheduler> mJobScheduler;
+    std::shared_ptr<SourceCache> mSourceCache;
     CompletionThread *mCompletionThread;
     Set<uint32_t> mActiveBuffers;
     Set<std::shared_ptr<Connection> > mConnections;
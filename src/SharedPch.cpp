@@ -0,0 +1,255 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "SharedPch.h"
+#include "IndexerJob.h"
+#include "Location.h"
+#include <rct/Log.h>
+#include <rct/Rct.h>
+#include <rct/Serializer.h>
+#include <algorithm>
+#include <assert.h>
+#include <functional>
+
+enum {
+    RetryDelay = 30 * 1000, // ms after the first failure
+    MaxRetryDelay = 60 * 60 * 1000
+};
+
+static inline uint64_t combine(uint64_t hash, uint64_t value)
+{
+    // like hashIncludePaths() in Source.cpp
+    return hash ^ (value + 0x9e3779b9 + (hash << 6) + (hash >> 2));
+}
+
+// what has to be the same for two sources to share a pch, the include paths
+// are only the same in the same build root
+static uint64_t argumentsHash(const Source &source)
+{
+    String data;
+    {
+        Serializer serializer(data);
+        serializer << source.compilerId << source.buildRootId << source.includePathHash
+                   << static_cast<uint8_t>(source.language) << source.defines << source.arguments;
+    }
+    return std::hash<String>()(data);
+}
+
+SharedPch::SharedPch(const Path &dir, int minSources)
+    : mDir(dir), mMinSources(minSources)
+{
+}
+
+SharedPch::~SharedPch()
+{
+    for (auto &group : mGroups)
+        drop(group.first, group.second);
+}
+
+bool SharedPch::isEligible(const Source &source)
+{
+    switch (source.language) {
+    case Source::CHeader:
+    case Source::CPlusPlusHeader:
+    case Source::CPlusPlus11Header:
+    case Source::NoLanguage:
+        return false;
+    default:
+        break;
+    }
+    // a pch of their own or something that's included before the prefix
+    for (const String &arg : source.arguments) {
+        if (arg == "-include" || arg == "-include-pch" || arg == "-imacros")
+            return false;
+    }
+    return true;
+}
+
+void SharedPch::setPrefix(const Source &source, const List<uint32_t> &prefix)
+{
+    if (!mMinSources)
+        return;
+    if (prefix.isEmpty() || !isEligible(source)) {
+        setPrefix(source.key(), 0, List<uint32_t>());
+    } else {
+        setPrefix(source.key(), argumentsHash(source), prefix);
+    }
+}
+
+void SharedPch::setPrefix(uint64_t key, uint64_t arguments, const List<uint32_t> &prefix)
+{
+    auto it = mPrefixes.find(key);
+    if (it != mPrefixes.end()) {
+        if (it->second.arguments == arguments && it->second.prefix == prefix)
+            return;
+        uint64_t hash = it->second.arguments;
+        for (uint32_t fileId : it->second.prefix) {
+            hash = combine(hash, fileId);
+            auto group = mGroups.find(hash);
+            assert(group != mGroups.end());
+            if (!--group->second.sources) {
+                drop(group->first, group->second);
+                mGroups.erase(group);
+            }
+        }
+        mPrefixes.erase(it);
+    }
+    if (prefix.isEmpty())
+        return;
+
+    mPrefixes[key] = { arguments, prefix };
+    uint64_t hash = arguments;
+    for (int i=0; i<prefix.size(); ++i) {
+        hash = combine(hash, prefix.at(i));
+        Group &group = mGroups[hash];
+        if (!group.sources++)
+            group.prefix = prefix.mid(0, i + 1);
+    }
+}
+
+bool SharedPch::isBuilding(const Group &group) const
+{
+    assert(group.state == Group::Building);
+    const std::shared_ptr<IndexerJob> job = group.builder.lock();
+    return job && !(job->flags & (IndexerJob::Complete|IndexerJob::Crashed|IndexerJob::Aborted));
+}
+
+bool SharedPch::assign(const std::shared_ptr<IndexerJob> &job, Path &pch, Path &header)
+{
+    job->pch = 0;
+    job->buildsPch = false;
+    if (!mMinSources)
+        return false;
+    const auto it = mPrefixes.find(job->source.key());
+    if (it == mPrefixes.end() || it->second.arguments != argumentsHash(job->source))
+        return false;
+
+    // the longest part of the prefix enough sources share, or the longest one
+    // with a pch while someone else is building that
+    uint64_t hash = it->second.arguments, longest = 0, ready = 0;
+    for (uint32_t fileId : it->second.prefix) {
+        hash = combine(hash, fileId);
+        const auto group = mGroups.find(hash);
+        assert(group != mGroups.end());
+        if (group->second.sources < mMinSources)
+            break;
+        longest = hash;
+        if (group->second.state == Group::Ready)
+            ready = hash;
+    }
+    if (!longest)
+        return false;
+
+    uint64_t ret = ready;
+    Group &group = mGroups[longest];
+    if (group.state == Group::None
+        || (group.state == Group::Failed && Rct::monoMs() >= group.retryTime)
+        || (group.state == Group::Building && (group.builder.lock() == job || !isBuilding(group)))) {
+        String contents;
+        for (uint32_t fileId : group.prefix) {
+            const Path path = Location::path(fileId);
+            if (path.isEmpty()) {
+                contents.clear();
+                break;
+            }
+            contents << "#include \"" << path << "\"\n";
+        }
+        const Path path = SharedPch::header(longest);
+        if (contents.isEmpty() || !Path::mkdir(mDir, Path::Recursive) || !path.write(contents)) {
+            error() << "Failed to write" << path;
+            fail(group);
+        } else {
+            group.state = Group::Building;
+            group.builder = job;
+            job->buildsPch = true;
+            header = path;
+            ret = longest;
+        }
+    }
+    if (!ret)
+        return false;
+    job->pch = ret;
+    pch = SharedPch::header(ret) + ".pch";
+    return true;
+}
+
+List<uint32_t> SharedPch::prefix(uint64_t group) const
+{
+    const auto it = mGroups.find(group);
+    return it == mGroups.end() ? List<uint32_t>() : it->second.prefix;
+}
+
+void SharedPch::finished(const std::shared_ptr<IndexerJob> &job, bool built, const Set<uint32_t> &files)
+{
+    auto it = mGroups.find(job->pch);
+    // dropped while it was being built
+    if (it == mGroups.end() || it->second.state != Group::Building || it->second.builder.lock() != job)
+        return;
+    Group &group = it->second;
+    group.builder.reset();
+    if (built) {
+        group.state = Group::Ready;
+        group.files = files;
+        group.failures = 0;
+    } else {
+        drop(it->first, group);
+        fail(group);
+        error() << "Failed to build a pch for" << Location::path(job->source.fileId);
+    }
+}
+
+void SharedPch::invalidate(const Set<uint32_t> &dirty)
+{
+    if (dirty.isEmpty())
+        return;
+    for (auto &group : mGroups) {
+        if (group.second.state == Group::None)
+            continue;
+        for (uint32_t fileId : dirty) {
+            if (group.second.files.contains(fileId) || group.second.prefix.contains(fileId)) {
+                if (group.second.state == Group::Ready)
+                    warning() << "Dropping" << header(group.first) + ".pch" << Location::path(fileId) << "changed";
+                drop(group.first, group.second);
+                group.second.failures = 0; // might build now
+                break;
+            }
+        }
+    }
+}
+
+void SharedPch::drop(uint64_t group, Group &data)
+{
+    if (data.state != Group::None) {
+        const Path path = header(group);
+        Path::rm(path + ".pch");
+        Path::rm(path);
+    }
+    data.state = Group::None;
+    data.builder.reset();
+    data.files.clear();
+}
+
+void SharedPch::fail(Group &group)
+{
+    group.state = Group::Failed;
+    group.builder.reset();
+    const int shift = std::min(group.failures++, 7);
+    group.retryTime = Rct::monoMs() + std::min<uint64_t>(static_cast<uint64_t>(RetryDelay) << shift, MaxRetryDelay);
+}
+
+Path SharedPch::header(uint64_t group) const
+{
+    return mDir + String::format<32>("%llx.h", static_cast<unsigned long long>(group));
+}
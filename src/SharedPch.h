@@ -0,0 +1,110 @@
+#ifndef SharedPch_h
+#define SharedPch_h
+
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "RTags.h"
+#include "Source.h"
+#include <rct/Hash.h>
+#include <rct/List.h>
+#include <rct/Path.h>
+#include <rct/Set.h>
+#include <memory>
+
+class IndexerJob;
+
+/* The precompiled headers a project has rp build for the #include lines
+   many of its sources start out with (--shared-pch). rp reports the include
+   guarded headers a source includes before anything else, its prefix. Every
+   leading part of a prefix shared by enough sources with the same arguments
+   is a group and gets a pch of its own, <dir>/<group>.h includes the headers
+   and rp saves <dir>/<group>.h.pch next to it.
+
+   The first job of a group to start builds the pch and uses it, the ones
+   after that are only given it once it's there. A source is indexed with the
+   longest of its groups that has one. The headers in the source file are
+   skipped by their guards so the index is the same.
+
+   A pch is dropped as soon as any file in it is dirty and built again by the
+   next job that wants it. rp parses without it when it can't use it. A group
+   whose pch couldn't be built is tried again by a later job, waiting twice
+   as long after every failure.
+
+   Nothing is saved, the prefixes are learned again as the sources are
+   indexed.
+*/
+
+class SharedPch
+{
+public:
+    SharedPch(const Path &dir, int minSources);
+    ~SharedPch();
+
+    // rp only reports prefixes for sources this says yes to
+    static bool isEligible(const Source &source);
+
+    // an empty prefix removes the source
+    void setPrefix(const Source &source, const List<uint32_t> &prefix);
+    void removeSource(uint64_t key) { setPrefix(key, 0, List<uint32_t>()); }
+
+    // Finds the pch job should be indexed with. If it's the one to build it
+    // header is the header to build it from.
+    bool assign(const std::shared_ptr<IndexerJob> &job, Path &pch, Path &header);
+    // the prefix of the group a job was told to build the pch for
+    List<uint32_t> prefix(uint64_t group) const;
+    // files are the ones in the pch if it was built
+    void finished(const std::shared_ptr<IndexerJob> &job, bool built, const Set<uint32_t> &files);
+    // drops the pchs with any of these files
+    void invalidate(const Set<uint32_t> &dirty);
+private:
+    struct Group {
+        Group()
+            : sources(0), state(None), failures(0), retryTime(0)
+        {}
+
+        List<uint32_t> prefix;
+        int sources; // the ones with this prefix or one that starts with it
+        enum State {
+            None,
+            Building,
+            Ready,
+            Failed
+        } state;
+        std::weak_ptr<IndexerJob> builder;
+        Set<uint32_t> files;
+        int failures; // in a row
+        uint64_t retryTime; // Rct::monoMs() when a Failed group can be built again
+    };
+
+    struct Prefix {
+        uint64_t arguments;
+        List<uint32_t> prefix;
+    };
+
+    void setPrefix(uint64_t key, uint64_t arguments, const List<uint32_t> &prefix);
+    bool isBuilding(const Group &group) const;
+    void drop(uint64_t group, Group &data);
+    void fail(Group &group);
+    Path header(uint64_t group) const;
+
+    const Path mDir;
+    const int mMinSources;
+    Hash<uint64_t, Prefix> mPrefixes; // by Source::key()
+    // by the hash of the arguments and the prefix up to the group
+    Hash<uint64_t, Group> mGroups;
+};
+
+#endif
@@ -57,6 +57,8 @@ String Source::toString() const
         ret << " Parsed: " << String::formatTime(parsed / 1000, String::DateTime);
     if (flags & Active)
         ret << " Active";
+    if (flags & DeclarationsOnly)
+        ret << " DeclarationsOnly";
     return ret;
 }
 
@@ -49,7 +49,8 @@ struct Source
         NoRtti = 0x1,
         M32 = 0x2,
         M64 = 0x4,
-        Active = 0x8
+        Active = 0x8,
+        DeclarationsOnly = 0x10 // indexed without references, a full pass is pending
     };
     Flags<Flag> flags;
 
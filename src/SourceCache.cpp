@@ -0,0 +1,127 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "SourceCache.h"
+#include "Location.h"
+#include <assert.h>
+#include <string.h>
+
+SourceCache *SourceCache::sInstance = 0;
+
+SourceCache::SourceCache(uint64_t maxBytes)
+    : mBytes(0), mMaxBytes(maxBytes)
+{
+    assert(!sInstance);
+    sInstance = this;
+}
+
+SourceCache::~SourceCache()
+{
+    clear();
+    assert(sInstance == this);
+    sInstance = 0;
+}
+
+bool SourceCache::findLine(const char *data, size_t size, unsigned int line, String &out)
+{
+    if (!line)
+        return false;
+    const char *end = data + size;
+    while (--line) {
+        data = static_cast<const char*>(memchr(data, '\n', end - data));
+        if (!data)
+            return false;
+        ++data;
+    }
+    const char *eol = static_cast<const char*>(memchr(data, '\n', end - data));
+    if (!eol)
+        return false;
+    out.assign(data, eol - data);
+    return true;
+}
+
+bool SourceCache::line(uint32_t fileId, unsigned int line, String &out)
+{
+    if (!line)
+        return false;
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::shared_ptr<Entry> entry = mEntries.value(fileId);
+    if (entry) {
+        mEntryList.remove(entry);
+        mEntryList.append(entry);
+    } else {
+        entry = load(fileId);
+        if (!entry)
+            return false;
+    }
+
+    // like findLine(), the last line only counts if it has a newline
+    if (line >= static_cast<unsigned int>(entry->lines.size()))
+        return false;
+    const uint32_t start = entry->lines.at(line - 1);
+    out.assign(entry->contents.constData() + start, entry->lines.at(line) - start - 1);
+    return true;
+}
+
+std::shared_ptr<SourceCache::Entry> SourceCache::load(uint32_t fileId)
+{
+    const Path path = Location::path(fileId);
+    std::shared_ptr<Entry> entry(new Entry(fileId));
+    entry->contents = path.readAll();
+    if (entry->contents.isEmpty() || entry->contents.size() >= static_cast<int>(INT32_MAX))
+        return std::shared_ptr<Entry>();
+
+    const char *data = entry->contents.constData();
+    const char *end = data + entry->contents.size();
+    entry->lines.append(0);
+    while ((data = static_cast<const char*>(memchr(data, '\n', end - data)))) {
+        ++data;
+        entry->lines.append(data - entry->contents.constData());
+    }
+
+    mEntries[fileId] = entry;
+    mEntryList.append(entry);
+    mBytes += entry->size();
+    // always keep the one we just loaded
+    while (mBytes > mMaxBytes) {
+        const std::shared_ptr<Entry> first = mEntryList.first();
+        if (first == entry)
+            break;
+        remove(first);
+    }
+    return entry;
+}
+
+void SourceCache::remove(const std::shared_ptr<Entry> &entry)
+{
+    mEntryList.remove(entry);
+    mEntries.remove(entry->fileId);
+    mBytes -= entry->size();
+}
+
+void SourceCache::invalidate(uint32_t fileId)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (std::shared_ptr<Entry> entry = mEntries.value(fileId))
+        remove(entry);
+}
+
+void SourceCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    while (std::shared_ptr<Entry> entry = mEntryList.first())
+        remove(entry);
+    assert(!mBytes);
+}
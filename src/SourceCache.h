@@ -0,0 +1,81 @@
+#ifndef SourceCache_h
+#define SourceCache_h
+
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <rct/EmbeddedLinkedList.h>
+#include <rct/Hash.h>
+#include <rct/List.h>
+#include <rct/String.h>
+#include <memory>
+#include <mutex>
+
+/* The text of the source files rdm prints context lines for (ShowContext),
+   keyed by fileId, with the offset of every line so looking up a line doesn't
+   have to scan the file. The line table is built the first time a file is
+   asked for. Files are evicted least recently used first once the contents
+   and line tables add up to more than maxBytes, the one just loaded is always
+   kept.
+
+   Nothing here notices a file changing on disk, the projects invalidate()
+   files when their watchers tell them. Lookups may come from other threads
+   (DumpThread) so everything is under a mutex.
+
+   Location::context() uses the instance if there is one and reads the file
+   itself otherwise.
+*/
+
+class SourceCache
+{
+public:
+    SourceCache(uint64_t maxBytes);
+    ~SourceCache();
+
+    static SourceCache *instance() { return sInstance; }
+
+    // line is 1-indexed, the newline isn't included
+    bool line(uint32_t fileId, unsigned int line, String &out);
+    void invalidate(uint32_t fileId);
+    void clear();
+
+    // line of the size bytes at data, for when there's no cache
+    static bool findLine(const char *data, size_t size, unsigned int line, String &out);
+private:
+    struct Entry {
+        Entry(uint32_t f) : fileId(f) {}
+
+        const uint32_t fileId;
+        String contents;
+        List<uint32_t> lines; // offset of the start of each line
+
+        uint64_t size() const { return contents.size() + (lines.size() * sizeof(uint32_t)); }
+
+        std::shared_ptr<Entry> next, prev;
+    };
+
+    std::shared_ptr<Entry> load(uint32_t fileId);
+    void remove(const std::shared_ptr<Entry> &entry);
+
+    std::mutex mMutex;
+    Hash<uint32_t, std::shared_ptr<Entry> > mEntries;
+    EmbeddedLinkedList<std::shared_ptr<Entry> > mEntryList;
+    uint64_t mBytes;
+    const uint64_t mMaxBytes;
+
+    static SourceCache *sInstance;
+};
+
+#endif
@@ -167,8 +167,8 @@ int StatusJob::execute()
                 continue;
             const int count = targets->count();
             for (int i=0; i<count; ++i) {
-                const String usr = targets->keyAt(i);
-                write<128>("  %s", usr.constData());
+                const uint64_t usr = targets->keyAt(i);
+                write<128>("  %s", proj->usr(usr).constData());
                 for (const auto &t : proj->findByUsr(usr, dep.first, Project::ArgDependsOn)) {
                     write<1024>("      %s\t%s", t.location.key(keyFlags()).constData(),
                                 t.kindSpelling().constData());
@@ -246,7 +246,7 @@ int StatusJob::execute()
 
     if (query.isEmpty() || match("declarations")) {
         for (const auto &it : proj->declarations()) {
-            write(it.first);
+            write(proj->usr(it.first));
             for (uint32_t file : it.second) {
                 write<128>("  %s", Location::path(file).constData());
             }
@@ -40,6 +40,14 @@ String Symbol::toString(Flags<ToStringFlag> cursorInfoFlags,
                         Flags<Location::KeyFlag> keyFlags,
                         const std::shared_ptr<Project> &project) const
 {
+    if (project && baseClasses.isEmpty() && briefComment.isEmpty() && xmlComment.isEmpty()) {
+        // symbols from the project don't carry their comments and base classes
+        extern bool loadSymbolDetails(const std::shared_ptr<Project> &, Symbol &);
+        Symbol symbol = *this;
+        if (loadSymbolDetails(project, symbol))
+            return symbol.toString(cursorInfoFlags, keyFlags, project);
+    }
+
     static auto properties = [this]()
         {
             List<String> ret;
@@ -54,7 +54,7 @@ int SymbolInfoJob::execute()
         const unsigned int line = location.line();
         const unsigned int column = location.column();
         while (idx-- > 0) {
-            const Symbol symbol = syms->valueAt(idx);
+            const Symbol symbol = syms->recordAt(idx);
             if (symbol.isDefinition()
                 && symbol.isContainer()
                 && comparePosition(line, column, symbol.startLine, symbol.startColumn) >= 0
@@ -62,7 +62,7 @@ int SymbolInfoJob::execute()
                 ret = 0;
                 write("====================");
                 write(symbol.location);
-                write(symbol, toStringFlags);
+                write(syms->valueAt(idx), toStringFlags);
                 break;
             }
         }
@@ -0,0 +1,182 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "SymbolMap.h"
+#include <rct/Hash.h>
+
+enum { HeaderSize = sizeof(size_t) * 2 };
+
+void SymbolMap::init(const char *pointer, size_t size, const std::shared_ptr<const void> &mapping)
+{
+    assert(size >= HeaderSize);
+    size_t sizes[2]; // records, strings
+    memcpy(sizes, pointer, sizeof(sizes));
+    assert(HeaderSize + sizes[0] + sizes[1] <= size);
+    const char *records = pointer + HeaderSize;
+    mRecords.init(records, sizes[0], mapping);
+    mStrings = records + sizes[0];
+    mStringsSize = sizes[1];
+    mDetails = mStrings + mStringsSize;
+    mDetailsSize = size - HeaderSize - sizes[0] - sizes[1];
+}
+
+String SymbolMap::string(uint32_t offset) const
+{
+    assert(offset < mStringsSize);
+    return String(mStrings + offset);
+}
+
+Symbol SymbolMap::fromRecord(const Location &location, const SymbolRecord &record) const
+{
+    Symbol symbol;
+    symbol.location = location;
+    symbol.symbolLength = record.symbolLength;
+    symbol.kind = static_cast<CXCursorKind>(record.kind);
+    symbol.type = static_cast<CXTypeKind>(record.type);
+    symbol.linkage = static_cast<CXLinkageKind>(record.linkage);
+    symbol.flags = record.flags;
+    symbol.enumValue = record.enumValue;
+    symbol.startLine = record.startLine;
+    symbol.startColumn = record.startColumn;
+    symbol.endLine = record.endLine;
+    symbol.endColumn = record.endColumn;
+    return symbol;
+}
+
+Symbol SymbolMap::recordAt(size_t index) const
+{
+    return fromRecord(mRecords.keyAt(index), mRecords.valueAt(index));
+}
+
+Symbol SymbolMap::valueAt(size_t index) const
+{
+    const SymbolRecord record = mRecords.valueAt(index);
+    Symbol symbol = fromRecord(mRecords.keyAt(index), record);
+    symbol.symbolName = string(record.symbolName);
+    symbol.usr = string(record.usr);
+    return symbol;
+}
+
+Symbol SymbolMap::value(const Location &location, bool *matched) const
+{
+    bool match;
+    const size_t idx = lowerBound(location, &match);
+    if (matched)
+        *matched = match;
+    if (match)
+        return valueAt(idx);
+    return Symbol();
+}
+
+bool SymbolMap::loadDetails(size_t index, Symbol &symbol) const
+{
+    const uint32_t details = mRecords.valueAt(index).details;
+    if (!details)
+        return false;
+    assert(details - 1 < mDetailsSize);
+    Deserializer deserializer(mDetails + details - 1, mDetailsSize - (details - 1));
+    deserializer >> symbol.baseClasses >> symbol.briefComment >> symbol.xmlComment;
+    return true;
+}
+
+List<String> SymbolMap::baseClasses(size_t index) const
+{
+    List<String> ret;
+    if (const uint32_t details = mRecords.valueAt(index).details) {
+        assert(details - 1 < mDetailsSize);
+        Deserializer deserializer(mDetails + details - 1, mDetailsSize - (details - 1));
+        deserializer >> ret;
+    }
+    return ret;
+}
+
+bool SymbolMap::loadDetails(Symbol &symbol) const
+{
+    bool match;
+    const size_t idx = lowerBound(symbol.location, &match);
+    return match && loadDetails(idx, symbol);
+}
+
+String SymbolMap::encode(const Map<Location, Symbol> &symbols, String *error)
+{
+    List<String> pieces;
+    if (!encode(symbols, pieces, error))
+        return String();
+    String out;
+    for (const String &piece : pieces)
+        out += piece;
+    return out;
+}
+
+bool SymbolMap::encode(const Map<Location, Symbol> &symbols, List<String> &pieces, String *error)
+{
+    // symbols is in order already
+    List<std::pair<Location, SymbolRecord> > records;
+    records.reserve(symbols.size());
+    String strings(1, '\0'); // offset 0 is the empty string
+    String details;
+    Serializer detailsSerializer(details);
+    Hash<String, uint32_t> stringOffsets;
+    auto addString = [&strings, &stringOffsets](const String &string) -> uint32_t {
+        if (string.isEmpty())
+            return 0;
+        uint32_t &offset = stringOffsets[string];
+        if (!offset) {
+            offset = strings.size();
+            strings.append(string.constData(), string.size());
+            strings.append('\0');
+        }
+        return offset;
+    };
+
+    for (const auto &pair : symbols) {
+        const Symbol &symbol = pair.second;
+        records.append(std::make_pair(pair.first, SymbolRecord()));
+        SymbolRecord &record = records.last().second;
+        record.enumValue = symbol.enumValue;
+        record.symbolName = addString(symbol.symbolName);
+        record.usr = addString(symbol.usr);
+        record.startLine = symbol.startLine;
+        record.startColumn = symbol.startColumn;
+        record.endLine = symbol.endLine;
+        record.endColumn = symbol.endColumn;
+        record.symbolLength = symbol.symbolLength;
+        record.kind = static_cast<uint16_t>(symbol.kind);
+        record.type = static_cast<uint16_t>(symbol.type);
+        record.linkage = static_cast<uint8_t>(symbol.linkage);
+        record.flags = symbol.flags;
+        if (!symbol.briefComment.isEmpty() || !symbol.xmlComment.isEmpty() || !symbol.baseClasses.isEmpty()) {
+            record.details = details.size() + 1;
+            detailsSerializer << symbol.baseClasses << symbol.briefComment << symbol.xmlComment;
+        }
+    }
+
+    List<String> encodedRecords;
+    if (!FileMap<Location, SymbolRecord>::encode(records, encodedRecords, error))
+        return false;
+    size_t recordsSize = 0;
+    for (const String &piece : encodedRecords)
+        recordsSize += piece.size();
+    String header;
+    Serializer serializer(header);
+    serializer << recordsSize << static_cast<size_t>(strings.size());
+    pieces.append(std::move(header));
+    for (String &piece : encodedRecords)
+        pieces.append(std::move(piece));
+    pieces.append(std::move(strings));
+    if (!details.isEmpty())
+        pieces.append(std::move(details));
+    return true;
+}
@@ -0,0 +1,100 @@
+#ifndef SymbolMap_h
+#define SymbolMap_h
+
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <rct/List.h>
+#include <rct/Map.h>
+#include <rct/String.h>
+#include <memory>
+#include "FileMap.h"
+#include "Location.h"
+#include "Symbol.h"
+
+/* SymbolMap layout:
+
+   [size_t recordsSize][size_t stringsSize][records][strings][details]
+
+   records is a FileMap<Location, SymbolRecord>. Records are fixed size so
+   they live inline in the entry table and a lookup never has to deserialize
+   anything. symbolName and usr are offsets into the strings heap where each
+   string is nul-terminated and stored once per file. details is an offset + 1
+   into the details heap (0 means none) where the baseClasses, briefComment
+   and xmlComment of the symbol are serialized. Those are only decoded when
+   someone asks for them with loadDetails().
+*/
+
+struct SymbolRecord
+{
+    SymbolRecord()
+    {
+        // the records are written out as is, don't leak uninitialized padding
+        memset(this, 0, sizeof(SymbolRecord));
+    }
+
+    int64_t enumValue;
+    uint32_t symbolName, usr, details;
+    int32_t startLine, startColumn, endLine, endColumn;
+    uint16_t symbolLength, kind, type;
+    uint8_t linkage, flags;
+};
+
+template <> struct FixedSize<SymbolRecord>
+{
+    static constexpr size_t value = sizeof(SymbolRecord);
+};
+
+class SymbolMap
+{
+public:
+    SymbolMap()
+        : mStrings(0), mStringsSize(0), mDetails(0), mDetailsSize(0)
+    {}
+
+    void init(const char *pointer, size_t size, const std::shared_ptr<const void> &mapping);
+
+    int count() const { return mRecords.count(); }
+    Location keyAt(size_t index) const { return mRecords.keyAt(index); }
+    size_t lowerBound(const Location &location, bool *match = 0) const { return mRecords.lowerBound(location, match); }
+
+    // Only the fixed size part, symbolName, usr and the details are left empty
+    Symbol recordAt(size_t index) const;
+    // recordAt() plus symbolName and usr
+    Symbol valueAt(size_t index) const;
+    Symbol value(const Location &location, bool *matched = 0) const;
+
+    bool hasDetails(size_t index) const { return mRecords.valueAt(index).details; }
+    // fills in baseClasses, briefComment and xmlComment
+    bool loadDetails(size_t index, Symbol &symbol) const;
+    bool loadDetails(Symbol &symbol) const;
+    // without decoding the comments
+    List<String> baseClasses(size_t index) const;
+
+    static String encode(const Map<Location, Symbol> &symbols, String *error = 0);
+    // like FileMap::encode(), appends the map in pieces
+    static bool encode(const Map<Location, Symbol> &symbols, List<String> &pieces, String *error = 0);
+private:
+    Symbol fromRecord(const Location &location, const SymbolRecord &record) const;
+    String string(uint32_t offset) const;
+
+    FileMap<Location, SymbolRecord> mRecords;
+    const char *mStrings;
+    size_t mStringsSize;
+    const char *mDetails;
+    size_t mDetailsSize;
+};
+
+#endif
@@ -0,0 +1,138 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "SymbolNameIndex.h"
+#include <algorithm>
+
+// rebuilding the postings is linear in the names so only do it once enough
+// of them are dead for it to pay off
+enum { MinDeadEntries = 1024 };
+
+void SymbolNameIndex::insert(const String &name, uint32_t fileId)
+{
+    auto it = mNames.find(name);
+    if (it == mNames.end()) {
+        it = mNames.insert(std::make_pair(name, Entry())).first;
+        it->second.id = mEntries.size();
+        mEntries.append(&*it);
+        addTrigrams(name, it->second.id);
+    }
+    List<uint32_t> &files = it->second.files;
+    auto pos = std::lower_bound(files.begin(), files.end(), fileId);
+    if (pos == files.end() || *pos != fileId)
+        files.insert(pos, fileId);
+}
+
+void SymbolNameIndex::remove(const String &name, uint32_t fileId)
+{
+    auto it = mNames.find(name);
+    if (it == mNames.end())
+        return;
+    List<uint32_t> &files = it->second.files;
+    auto pos = std::lower_bound(files.begin(), files.end(), fileId);
+    if (pos == files.end() || *pos != fileId)
+        return;
+    files.erase(pos);
+    if (files.isEmpty()) {
+        mEntries[it->second.id] = 0;
+        mNames.erase(it);
+        if (++mDead >= MinDeadEntries && mDead > static_cast<uint32_t>(mEntries.size()) / 2)
+            compact();
+    }
+}
+
+void SymbolNameIndex::clear()
+{
+    mNames.clear();
+    mEntries.clear();
+    mTrigrams.clear();
+    mDead = 0;
+}
+
+void SymbolNameIndex::encode(Serializer &serializer) const
+{
+    serializer << static_cast<uint32_t>(mNames.size());
+    for (const auto &entry : mNames)
+        serializer << entry.first << entry.second.files;
+}
+
+void SymbolNameIndex::decode(Deserializer &deserializer)
+{
+    clear();
+    uint32_t count;
+    deserializer >> count;
+    auto hint = mNames.end();
+    for (uint32_t i=0; i<count; ++i) {
+        String name;
+        Entry entry;
+        deserializer >> name >> entry.files;
+        // they were written in order
+        hint = mNames.insert(hint, std::make_pair(std::move(name), std::move(entry)));
+    }
+    compact();
+}
+
+void SymbolNameIndex::addTrigrams(const String &name, uint32_t id)
+{
+    for (int i=0; i + 3 <= name.size(); ++i) {
+        List<uint32_t> &ids = mTrigrams[trigram(name.constData() + i)];
+        if (ids.isEmpty() || ids.last() != id)
+            ids.append(id);
+    }
+}
+
+void SymbolNameIndex::compact()
+{
+    mEntries.clear();
+    mTrigrams.clear();
+    mEntries.reserve(mNames.size());
+    for (auto &entry : mNames) {
+        entry.second.id = mEntries.size();
+        mEntries.append(&entry);
+        addTrigrams(entry.first, entry.second.id);
+    }
+    mDead = 0;
+}
+
+void SymbolNameIndex::visit(const String &prefix, const List<String> &fragments, const Visitor &visitor) const
+{
+    if (!prefix.isEmpty()) {
+        for (auto it = mNames.lower_bound(prefix); it != mNames.end() && it->first.startsWith(prefix); ++it)
+            visitor(it->first, it->second.files);
+        return;
+    }
+
+    // the rarest trigram narrows it down the most
+    const List<uint32_t> *best = 0;
+    for (const String &fragment : fragments) {
+        for (int i=0; i + 3 <= fragment.size(); ++i) {
+            auto it = mTrigrams.find(trigram(fragment.constData() + i));
+            if (it == mTrigrams.end())
+                return; // no name has it
+            if (!best || it->second.size() < best->size())
+                best = &it->second;
+        }
+    }
+
+    if (best) {
+        for (uint32_t id : *best) {
+            if (const Names::value_type *entry = mEntries.at(id))
+                visitor(entry->first, entry->second.files);
+        }
+    } else {
+        for (const auto &entry : mNames)
+            visitor(entry.first, entry.second.files);
+    }
+}
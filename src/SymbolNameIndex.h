@@ -0,0 +1,96 @@
+#ifndef SymbolNameIndex_h
+#define SymbolNameIndex_h
+
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <rct/Hash.h>
+#include <rct/List.h>
+#include <rct/Map.h>
+#include <rct/Serializer.h>
+#include <rct/String.h>
+#include <functional>
+
+/* Every symbol name in the project, sorted, with the files whose symnames
+   map has it. On top of that a trigram index over the lowercased names so
+   case insensitive and wildcard searches don't have to look at every name.
+
+   A name is removed with its last file. Its slot in the trigram postings is
+   left dead and the postings are rebuilt once there are more dead slots than
+   live ones. The locations still live in the files' symnames maps, this only
+   tells the project which ones to open.
+
+   The project saves it with its project file, only the names and their
+   files are written, the trigrams are built again on load.
+*/
+
+class SymbolNameIndex
+{
+public:
+    SymbolNameIndex() : mDead(0) {}
+
+    void insert(const String &name, uint32_t fileId);
+    void remove(const String &name, uint32_t fileId);
+    void clear();
+    bool isEmpty() const { return mNames.isEmpty(); }
+
+    typedef std::function<void(const String &name, const List<uint32_t> &files)> Visitor;
+
+    /* Calls visitor for every name that could match. If prefix
+       isn't empty that's every name that starts with it, otherwise names that
+       contain all the trigrams of fragments (compared case insensitively) or
+       every name if none of the fragments are long enough. The caller still
+       has to check the candidates against the full pattern. */
+    void visit(const String &prefix, const List<String> &fragments, const Visitor &visitor) const;
+
+    void encode(Serializer &serializer) const;
+    void decode(Deserializer &deserializer);
+private:
+    struct Entry {
+        List<uint32_t> files; // sorted
+        uint32_t id; // in mEntries
+    };
+    typedef Map<String, Entry> Names;
+
+    void addTrigrams(const String &name, uint32_t id);
+    void compact();
+
+    static uint32_t trigram(const char *str)
+    {
+        return ((static_cast<uint32_t>(tolower(static_cast<unsigned char>(str[0]))) << 16)
+                | (static_cast<uint32_t>(tolower(static_cast<unsigned char>(str[1]))) << 8)
+                | static_cast<uint32_t>(tolower(static_cast<unsigned char>(str[2]))));
+    }
+
+    Names mNames;
+    // id -> name, map nodes don't move, 0 for removed names
+    List<const Names::value_type *> mEntries;
+    Hash<uint32_t, List<uint32_t> > mTrigrams; // trigram -> sorted name ids
+    uint32_t mDead; // 0 entries in mEntries
+};
+
+template <> inline Serializer &operator<<(Serializer &s, const SymbolNameIndex &t)
+{
+    t.encode(s);
+    return s;
+}
+
+template <> inline Deserializer &operator>>(Deserializer &s, SymbolNameIndex &t)
+{
+    t.decode(s);
+    return s;
+}
+
+#endif
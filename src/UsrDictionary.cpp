@@ -0,0 +1,220 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "UsrDictionary.h"
+#include "RTags.h"
+#include <rct/Log.h>
+#include <rct/Rct.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <functional>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum { HeaderSize = sizeof(uint64_t) + sizeof(uint32_t) };
+
+static inline void setError(String *error, int line)
+{
+    if (error) {
+        *error = Rct::strerror();
+        *error << " " << line;
+    }
+}
+
+static inline bool readAll(int fd, char *data, uint64_t size, uint64_t offset)
+{
+    while (size) {
+        ssize_t r;
+        eintrwrap(r, pread(fd, data, size, offset));
+        if (r <= 0)
+            return false;
+        data += r;
+        size -= r;
+        offset += r;
+    }
+    return true;
+}
+
+static inline uint32_t checkHash(const String &usr)
+{
+    return static_cast<uint32_t>(std::hash<String>()(usr));
+}
+
+UsrDictionary::UsrDictionary()
+    : mFD(-1), mSize(0)
+{
+}
+
+UsrDictionary::~UsrDictionary()
+{
+    clear();
+}
+
+void UsrDictionary::clear()
+{
+    if (mFD != -1) {
+        int ret;
+        eintrwrap(ret, ::close(mFD));
+        mFD = -1;
+    }
+    mSize = 0;
+    mOffsets.clear();
+    mRemapped.clear();
+}
+
+bool UsrDictionary::open(String *error)
+{
+    assert(mFD == -1);
+    eintrwrap(mFD, ::open(mPath.constData(), O_RDWR|O_CREAT|O_APPEND, 0644));
+    if (mFD == -1 && Path::mkdir(mPath.parentDir(), Path::Recursive))
+        eintrwrap(mFD, ::open(mPath.constData(), O_RDWR|O_CREAT|O_APPEND, 0644));
+    if (mFD == -1) {
+        setError(error, __LINE__);
+        return false;
+    }
+    return true;
+}
+
+bool UsrDictionary::load(const Path &path, String *error)
+{
+    clear();
+    mPath = path;
+    if (!open(error))
+        return false;
+
+    struct stat st;
+    if (fstat(mFD, &st)) {
+        setError(error, __LINE__);
+        clear();
+        return false;
+    }
+
+    String data(st.st_size, '\0');
+    if (st.st_size && !readAll(mFD, data.data(), st.st_size, 0)) {
+        setError(error, __LINE__);
+        clear();
+        return false;
+    }
+
+    const char *ptr = data.constData();
+    while (mSize + HeaderSize <= static_cast<uint64_t>(st.st_size)) {
+        uint64_t id;
+        uint32_t size;
+        memcpy(&id, ptr + mSize, sizeof(id));
+        memcpy(&size, ptr + mSize + sizeof(id), sizeof(size));
+        if (mSize + HeaderSize + size > static_cast<uint64_t>(st.st_size))
+            break;
+        const String usr(ptr + mSize + HeaderSize, size);
+        mOffsets[id] = { mSize, checkHash(usr) };
+        if (RTags::usrId(usr) != id)
+            mRemapped[usr] = id;
+        mSize += HeaderSize + size;
+    }
+
+    if (mSize != static_cast<uint64_t>(st.st_size)) {
+        // we died halfway through a write, drop the partial record
+        warning() << "Truncating" << mPath << "from" << st.st_size << "to" << mSize;
+        int ret;
+        eintrwrap(ret, ftruncate(mFD, mSize));
+    }
+    return true;
+}
+
+String UsrDictionary::usr(uint64_t id) const
+{
+    String ret;
+    const auto it = mOffsets.find(id);
+    if (it == mOffsets.end())
+        return ret;
+    const uint64_t offset = it->second.offset;
+    uint32_t size;
+    if (readAll(mFD, reinterpret_cast<char*>(&size), sizeof(size), offset + sizeof(uint64_t))) {
+        ret.resize(size);
+        if (!readAll(mFD, ret.data(), size, offset + HeaderSize))
+            ret.clear();
+    }
+    return ret;
+}
+
+uint64_t UsrDictionary::id(const String &usr) const
+{
+    return mRemapped.value(usr, RTags::usrId(usr));
+}
+
+bool UsrDictionary::isTaken(uint64_t id, const Hash<uint64_t, String> &usrs) const
+{
+    return mOffsets.contains(id) || usrs.contains(id);
+}
+
+bool UsrDictionary::insert(const Hash<uint64_t, String> &usrs, String *error, Set<String> *collided)
+{
+    if (mFD == -1 && (mPath.isEmpty() || !open(error)))
+        return false;
+
+    String data;
+    Hash<uint64_t, Entry> added;
+    Hash<String, uint64_t> remapped;
+    for (const auto &usr : usrs) {
+        uint64_t id = usr.first;
+        const uint32_t check = checkHash(usr.second);
+        const auto it = mOffsets.find(id);
+        if (it != mOffsets.end()) {
+            // Same id and same check hash, it's the usr we have. Reading the
+            // record back for every known usr would cost a pread each.
+            if (it->second.check == check)
+                continue;
+            if (collided)
+                collided->insert(usr.second);
+            // rp didn't know about the remapping yet
+            if (mRemapped.contains(usr.second) || remapped.contains(usr.second))
+                continue;
+            ::error() << "Usr collision," << usr.second << "and" << UsrDictionary::usr(id)
+                    << "both hash to" << String::format<32>("0x%llx", static_cast<unsigned long long>(id));
+            int salt = 0;
+            do {
+                id = RTags::usrId(usr.second + String::format<16>("\n%d", ++salt));
+            } while (isTaken(id, usrs) || added.contains(id));
+            remapped[usr.second] = id;
+        }
+        added[id] = { mSize + data.size(), check };
+        const uint32_t size = usr.second.size();
+        data.append(reinterpret_cast<const char*>(&id), sizeof(uint64_t));
+        data.append(reinterpret_cast<const char*>(&size), sizeof(size));
+        data.append(usr.second);
+    }
+    if (data.isEmpty())
+        return true;
+
+    const char *ptr = data.constData();
+    uint64_t remaining = data.size();
+    while (remaining) {
+        ssize_t w;
+        eintrwrap(w, ::write(mFD, ptr, remaining));
+        if (w <= 0) {
+            setError(error, __LINE__);
+            int ret;
+            eintrwrap(ret, ftruncate(mFD, mSize));
+            return false;
+        }
+        ptr += w;
+        remaining -= w;
+    }
+    mSize += data.size();
+    for (const auto &entry : added)
+        mOffsets[entry.first] = entry.second;
+    for (const auto &usr : remapped)
+        mRemapped[usr.first] = usr.second;
+    return true;
+}
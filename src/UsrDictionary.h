@@ -0,0 +1,75 @@
+#ifndef UsrDictionary_h
+#define UsrDictionary_h
+
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <rct/Hash.h>
+#include <rct/Path.h>
+#include <rct/Set.h>
+#include <rct/String.h>
+
+/* The index only stores 64 bit usr ids (see RTags::usrId), this is the
+   project's way back to the strings. The file is an append-only list of
+   records:
+
+   [uint64_t id][uint32_t size][char usr[size]]
+
+   Only rdm writes to it so there's no locking. Records for usrs that are no
+   longer in the index are never removed, they're just never asked for.
+
+   Two usrs can hash to the same id. The first one keeps it, the other one is
+   given the next free id of a salted hash and its record is written with
+   that id, so load() finds the remapping again. Whoever computes ids has to
+   go through id() or the remapped() table.
+*/
+
+class UsrDictionary
+{
+public:
+    UsrDictionary();
+    ~UsrDictionary();
+
+    bool load(const Path &path, String *error = 0);
+    void clear();
+
+    bool contains(uint64_t id) const { return mOffsets.contains(id); }
+    String usr(uint64_t id) const;
+    // RTags::usrId() unless the usr collided with another one
+    uint64_t id(const String &usr) const;
+    const Hash<String, uint64_t> &remapped() const { return mRemapped; }
+    // Appends the ones we don't already know about. The usrs that were sent
+    // with an id that belongs to another usr are added to collided, they're
+    // remapped and whatever was indexed with the wrong id has to be indexed
+    // again.
+    bool insert(const Hash<uint64_t, String> &usrs, String *error = 0, Set<String> *collided = 0);
+    int count() const { return mOffsets.size(); }
+private:
+    bool open(String *error);
+    bool isTaken(uint64_t id, const Hash<uint64_t, String> &usrs) const;
+
+    struct Entry {
+        uint64_t offset; // of the record
+        uint32_t check; // a second hash of the usr to tell collisions apart
+    };
+
+    Path mPath;
+    int mFD;
+    uint64_t mSize;
+    Hash<uint64_t, Entry> mOffsets;
+    Hash<String, uint64_t> mRemapped;
+};
+
+#endif
@@ -16,27 +16,32 @@
 #ifndef VisitFileMessage_h
 #define VisitFileMessage_h
 
+#include <rct/List.h>
 #include <rct/Message.h>
 #include <rct/String.h>
 #include "RTagsMessage.h"
 
+/* Asks rdm for the ids of resolved paths and whether this job gets to index
+   them. rp sends every header it finds in the inclusions of the unit in one
+   of these, and one per file for anything that shows up after that. */
 class VisitFileMessage : public RTagsMessage
 {
 public:
     enum { MessageId = VisitFileId };
 
-    VisitFileMessage(const Path &file = Path(), const Path &project = Path(), uint64_t key = 0)
-        : RTagsMessage(MessageId), mFile(file), mProject(project), mKey(key)
+    VisitFileMessage(const List<Path> &files = List<Path>(), const Path &project = Path(), uint64_t key = 0)
+        : RTagsMessage(MessageId), mFiles(files), mProject(project), mKey(key)
     {
     }
 
     Path project() const { return mProject; }
-    Path file() const { return mFile; }
+    const List<Path> &files() const { return mFiles; }
     uint64_t key() const { return mKey; }
-    void encode(Serializer &serializer) const { serializer << mProject << mFile << mKey; }
-    void decode(Deserializer &deserializer) { deserializer >> mProject >> mFile >> mKey; }
+    void encode(Serializer &serializer) const { serializer << mProject << mFiles << mKey; }
+    void decode(Deserializer &deserializer) { deserializer >> mProject >> mFiles >> mKey; }
 private:
-    Path mFile, mProject;
+    List<Path> mFiles;
+    Path mProject;
     uint64_t mKey;
 };
 
@@ -16,28 +16,39 @@
 #ifndef VisitFileResponseMessage_h
 #define VisitFileResponseMessage_h
 
+#include <rct/List.h>
 #include <rct/Message.h>
+#include <rct/Set.h>
 #include <rct/String.h>
 #include "RTagsMessage.h"
 
+// fileIds are in the order of VisitFileMessage::files(), 0 if rdm wouldn't
+// give the file an id. visit has the ones the job gets to index.
 class VisitFileResponseMessage : public RTagsMessage
 {
 public:
     enum { MessageId = VisitFileResponseId };
 
-    VisitFileResponseMessage(uint32_t fileId = 0, bool visit = false)
-        : RTagsMessage(MessageId), mFileId(fileId), mVisit(visit)
+    VisitFileResponseMessage()
+        : RTagsMessage(MessageId)
     {
     }
 
-    uint32_t fileId() const { return mFileId; }
-    bool visit() const { return mVisit; }
+    void add(uint32_t fileId, bool visit)
+    {
+        mFileIds.append(fileId);
+        if (visit)
+            mVisit.insert(fileId);
+    }
+
+    const List<uint32_t> &fileIds() const { return mFileIds; }
+    bool visit(uint32_t fileId) const { return fileId && mVisit.contains(fileId); }
 
-    void encode(Serializer &serializer) const { serializer << mFileId << mVisit; }
-    void decode(Deserializer &deserializer) { deserializer >> mFileId >> mVisit; }
+    void encode(Serializer &serializer) const { serializer << mFileIds << mVisit; }
+    void decode(Deserializer &deserializer) { deserializer >> mFileIds >> mVisit; }
 private:
-    uint32_t mFileId;
-    bool mVisit;
+    List<uint32_t> mFileIds;
+    Set<uint32_t> mVisit;
 };
 
 #endif
@@ -42,9 +42,11 @@ static void sigSegvHandler(int signal)
 #define EXCLUDEFILTER_DEFAULT "*/CMakeFiles/*;*/cmake*/Modules/*;*/conftest.c*;/tmp/*"
 #define DEFAULT_RP_VISITFILE_TIMEOUT 60000
 #define DEFAULT_RDM_MAX_FILE_MAP_CACHE_SIZE 500
+#define DEFAULT_RDM_MAX_SOURCE_CACHE_MEMORY 64
 #define DEFAULT_RP_INDEXER_MESSAGE_TIMEOUT 60000
 #define DEFAULT_RP_CONNECT_TIMEOUT 0 // won't time out
 #define DEFAULT_RP_CONNECT_ATTEMPTS 3
+#define DEFAULT_RP_WORKER_MAX_MEMORY 1024
 #define DEFAULT_COMPLETION_CACHE_SIZE 10
 #define DEFAULT_MAX_CRASH_COUNT 5
 #define XSTR(s) #s
@@ -96,6 +98,8 @@ static void usage(FILE *f)
             "  --rp-indexer-message-timeout|-T [arg]      Timeout for rp indexer-message in ms (0 means no timeout) (default " STR(DEFAULT_RP_INDEXER_MESSAGE_TIMEOUT) ").\n"
             "  --rp-nice-value|-a [arg]                   Nice value to use for rp (nice(2)) (default -1, e.g. not nicing).\n"
             "  --rp-visit-file-timeout|-Z [arg]           Timeout for rp visitfile commands in ms (0 means no timeout) (default " STR(DEFAULT_RP_VISITFILE_TIMEOUT) ").\n"
+            "  --rp-worker-jobs [arg]                     Keep rp processes around and give each up to [arg] jobs before starting a new one (default 0, e.g. one rp per job).\n"
+            "  --rp-worker-max-memory [arg]               Replace an rp worker once it has used more than [arg] megabytes (default " STR(DEFAULT_RP_WORKER_MAX_MEMORY) ").\n"
             "  --separate-debug-and-release|-E            Normally rdm doesn't consider release and debug as different builds. Pass this if you want it to.\n"
             "  --setenv|-e [arg]                          Set this environment variable (--setenv \"foobar=1\").\n"
             "  --silent|-S                                No logging to stdout.\n"
@@ -125,8 +129,11 @@ static void usage(FILE *f)
             "  --no-spell-checking|-l                     Don't pass -fspell-checking.\n"
             "  --no-unlimited-error|-f                    Don't pass -ferror-limit=0 to clang.\n"
             "  --Wlarge-by-value-copy|-r [arg]            Use -Wlarge-by-value-copy=[arg] when invoking clang.\n"
-            "  --max-file-map-cache-size|-y [arg]         Max files to cache per query (Should not exceed maximum number of open file descriptors allowed per process) (default " STR(DEFAULT_RDM_MAX_FILE_MAP_CACHE_SIZE) ").\n"
+            "  --max-file-map-cache-size|-y [arg]         Max file maps to keep open per project between queries (default " STR(DEFAULT_RDM_MAX_FILE_MAP_CACHE_SIZE) ").\n"
+            "  --max-source-cache-memory [arg]            Max megabytes of source files to keep in memory for context lines (default " STR(DEFAULT_RDM_MAX_SOURCE_CACHE_MEMORY) ").\n"
             "  --no-comments                              Don't parse/store doxygen comments.\n"
+            "  --tiered-indexing                          Index new sources declarations only first and do the full pass (references, targets) at a lower priority.\n"
+            "  --shared-pch [arg]                         Build a pch for the #includes at least [arg] sources with the same arguments start with and index them with it (default 0, off).\n"
             "  --arg-transform|-V [arg]                   Use arg to transform arguments. [arg] should be a executable with (execv(3)).\n"
             , std::max(2, ThreadPool::idealThreadCount()), defaultStackSize);
 }
@@ -218,6 +225,11 @@ int main(int argc, char** argv)
         { "launchd", no_argument, 0, '\4' },
 #endif
         { "inactivity-timeout", required_argument, 0, '\5' },
+        { "max-source-cache-memory", required_argument, 0, '\7' },
+        { "rp-worker-jobs", required_argument, 0, '\10' },
+        { "rp-worker-max-memory", required_argument, 0, '\11' },
+        { "tiered-indexing", no_argument, 0, '\12' },
+        { "shared-pch", required_argument, 0, '\13' },
         { 0, 0, 0, 0 }
     };
     const String shortOptions = Rct::shortOptions(opts);
@@ -326,7 +338,9 @@ int main(int argc, char** argv)
     serverOpts.rpIndexDataMessageTimeout = DEFAULT_RP_INDEXER_MESSAGE_TIMEOUT;
     serverOpts.rpConnectTimeout = DEFAULT_RP_CONNECT_TIMEOUT;
     serverOpts.rpConnectAttempts = DEFAULT_RP_CONNECT_ATTEMPTS;
-    serverOpts.maxFileMapScopeCacheSize = DEFAULT_RDM_MAX_FILE_MAP_CACHE_SIZE;
+    serverOpts.rpWorkerMaxMemory = DEFAULT_RP_WORKER_MAX_MEMORY;
+    serverOpts.maxFileMapCacheSize = DEFAULT_RDM_MAX_FILE_MAP_CACHE_SIZE;
+    serverOpts.maxSourceCacheMemory = DEFAULT_RDM_MAX_SOURCE_CACHE_MEMORY;
     serverOpts.rpNiceValue = INT_MIN;
     serverOpts.options = Server::Wall|Server::SpellChecking;
     serverOpts.maxCrashCount = DEFAULT_MAX_CRASH_COUNT;
@@ -418,8 +432,8 @@ int main(int argc, char** argv)
                 serverOpts.rpVisitFileTimeout = -1;
             break;
         case 'y':
-            serverOpts.maxFileMapScopeCacheSize = atoi(optarg);
-            if (serverOpts.maxFileMapScopeCacheSize <= 0) {
+            serverOpts.maxFileMapCacheSize = atoi(optarg);
+            if (serverOpts.maxFileMapCacheSize <= 0) {
                 fprintf(stderr, "Invalid argument to -y %s\n", optarg);
                 return 1;
             }
@@ -634,6 +648,37 @@ int main(int argc, char** argv)
             }
                                        // seconds.
             break;
+        case '\7':
+            serverOpts.maxSourceCacheMemory = atoi(optarg);
+            if (serverOpts.maxSourceCacheMemory <= 0) {
+                fprintf(stderr, "Invalid argument to --max-source-cache-memory %s\n", optarg);
+                return 1;
+            }
+            break;
+        case '\10':
+            serverOpts.rpWorkerJobs = atoi(optarg);
+            if (serverOpts.rpWorkerJobs < 0) {
+                fprintf(stderr, "Invalid argument to --rp-worker-jobs %s\n", optarg);
+                return 1;
+            }
+            break;
+        case '\11':
+            serverOpts.rpWorkerMaxMemory = atoi(optarg);
+            if (serverOpts.rpWorkerMaxMemory < 0) {
+                fprintf(stderr, "Invalid argument to --rp-worker-max-memory %s\n", optarg);
+                return 1;
+            }
+            break;
+        case '\12':
+            serverOpts.options |= Server::TieredIndexing;
+            break;
+        case '\13':
+            serverOpts.sharedPchSources = atoi(optarg);
+            if (serverOpts.sharedPchSources < 0) {
+                fprintf(stderr, "Invalid argument to --shared-pch %s\n", optarg);
+                return 1;
+            }
+            break;
         case '?': {
             fprintf(stderr, "Run rdm --help for help\n");
             return 1; }
@@ -15,6 +15,7 @@
 
 #define RTAGS_SINGLE_THREAD
 #include "ClangIndexer.h"
+#include "RClient.h"
 #include "RTagsClang.h"
 #include "Source.h"
 #include "Project.h"
@@ -23,6 +24,7 @@
 #include <rct/String.h>
 #include <signal.h>
 #include <syslog.h>
+#include <sys/resource.h>
 #include "Server.h"
 
 static void sigHandler(int signal)
@@ -53,6 +55,7 @@ void saveFileIds()
 Set<Symbol> findTargets(const std::shared_ptr<Project> &, const Symbol &) { return Set<Symbol>(); }
 Set<Symbol> findCallers(const std::shared_ptr<Project> &, const Symbol &) { return Set<Symbol>(); }
 String findSymbolNameByUsr(const std::shared_ptr<Project> &, uint32_t, const String &) { return String(); }
+bool loadSymbolDetails(const std::shared_ptr<Project> &, Symbol &) { return false; }
 
 struct SyslogCloser
 {
@@ -60,13 +63,86 @@ public:
     ~SyslogCloser() { ::closelog(); }
 };
 
+static bool readJob(String &data, bool *eof = 0)
+{
+    uint32_t size;
+    if (!fread(&size, sizeof(size), 1, stdin)) {
+        if (eof)
+            *eof = feof(stdin);
+        return false;
+    }
+    data.resize(size);
+    if (!fread(&data[0], size, 1, stdin))
+        return false;
+    return true;
+}
+
+// ru_maxrss is in kilobytes on Linux and bytes on OS X
+static inline uint64_t peakMemory()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+#ifdef OS_Darwin
+    return usage.ru_maxrss;
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
+/* rp --worker runs the jobs rdm writes to stdin one after the other with the
+   same connection and CXIndex until stdin is closed. It quits on its own
+   after a job that takes it over --max-memory megabytes and says so in that
+   job's IndexDataMessage. If anything goes
+   wrong it exits like a normal rp would so rdm only has to retry the job it
+   was running. */
+static int runWorker(uint64_t maxMemory)
+{
+    std::shared_ptr<Connection> connection = Connection::create(RClient::NumOptions);
+    CXIndex index = clang_createIndex(0, 1);
+    int ret = 0;
+    String data;
+    while (true) {
+        bool eof = false;
+        if (!readJob(data, &eof)) {
+            if (!eof) {
+                error() << "Failed to read from stdin";
+                ret = 1;
+            }
+            break;
+        }
+        // rdm is told in the IndexDataMessage so it doesn't hand us a job we
+        // won't read
+        ClangIndexer indexer(connection, index, [maxMemory]() {
+                return maxMemory && peakMemory() > maxMemory;
+            });
+        if (!indexer.exec(data)) {
+            error() << "ClangIndexer error";
+            ret = 3;
+            break;
+        }
+        if (indexer.isLastJob()) {
+            warning() << "rp worker is using" << (peakMemory() / (1024 * 1024)) << "MB, exiting";
+            break;
+        }
+    }
+    clang_disposeIndex(index);
+    return ret;
+}
+
 int main(int argc, char **argv)
 {
     int logLevel = Error;
     Path file;
+    bool worker = false;
+    uint64_t maxMemory = 0;
     for (int i=1; i<argc; ++i) {
         if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose")) {
             ++logLevel;
+        } else if (!strcmp(argv[i], "--worker")) {
+            worker = true;
+        } else if (!strcmp(argv[i], "--max-memory") && i + 1 < argc) {
+            maxMemory = static_cast<uint64_t>(atoi(argv[++i])) * 1024 * 1024;
         } else {
             file = argv[i];
         }
@@ -84,25 +160,19 @@ int main(int argc, char **argv)
     RTags::initMessages();
     std::shared_ptr<EventLoop> eventLoop(new EventLoop);
     eventLoop->init(EventLoop::MainEventLoop);
-    String data;
+    if (worker)
+        return runWorker(maxMemory);
 
+    String data;
     if (!file.isEmpty()) {
         data = file.readAll();
-    } else {
-        uint32_t size;
-        if (!fread(&size, sizeof(size), 1, stdin)) {
-            error() << "Failed to read from stdin";
-            return 1;
-        }
-        data.resize(size);
-        if (!fread(&data[0], size, 1, stdin)) {
-            error() << "Failed to read from stdin";
-            return 2;
-        }
-        // FILE *f = fopen("/tmp/data", "w");
-        // fwrite(data.constData(), data.size(), 1, f);
-        // fclose(f);
+    } else if (!readJob(data)) {
+        error() << "Failed to read from stdin";
+        return 1;
     }
+    // FILE *f = fopen("/tmp/data", "w");
+    // fwrite(data.constData(), data.size(), 1, f);
+    // fclose(f);
     ClangIndexer indexer;
     if (!indexer.exec(data)) {
         error() << "ClangIndexer error";
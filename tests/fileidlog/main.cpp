@@ -0,0 +1,147 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Loads the file id log the way rdm restores it after an append was torn
+// halfway and after a record was damaged, and checks that the ids before the
+// damage come back and the ids handed out next follow on from them.
+
+#include "FileIdLog.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            ++failures;                                                 \
+        }                                                               \
+    } while (0)
+
+static off_t fileSize(const Path &path)
+{
+    struct stat st;
+    return stat(path.constData(), &st) ? -1 : st.st_size;
+}
+
+static Path filePath(uint32_t id)
+{
+    return String::format<64>("/src/project/file%u.cpp", id);
+}
+
+static List<Path> filePaths(uint32_t first, uint32_t last)
+{
+    List<Path> paths;
+    for (uint32_t id = first; id <= last; ++id)
+        paths.append(filePath(id));
+    return paths;
+}
+
+// ids 1 to count come back and nothing else
+static void check(const Path &path, uint32_t count, bool damaged)
+{
+    FileIdLog log;
+    Hash<uint32_t, Path> idsToPaths;
+    String err;
+    CHECK(log.load(path, idsToPaths, &err));
+    CHECK(log.isOpen() && log.lastId() == count && log.isDamaged() == damaged);
+    CHECK(idsToPaths.size() == static_cast<int>(count));
+    for (uint32_t id=1; id<=count; ++id)
+        CHECK(idsToPaths.value(id) == filePath(id));
+}
+
+int main()
+{
+    const Path path = String::format<64>("/tmp/rtags-fileidlog-%d", getpid());
+    unlink(path.constData());
+
+    String err;
+    Hash<uint32_t, Path> idsToPaths;
+    {
+        // rdm starts over without complaining
+        FileIdLog log;
+        CHECK(!log.load(path, idsToPaths, &err) && err.isEmpty());
+        CHECK(!log.isOpen());
+    }
+
+    off_t sizes[3];
+    {
+        FileIdLog log;
+        CHECK(log.write(path, filePaths(1, 3), &err));
+        sizes[0] = fileSize(path);
+        CHECK(log.append(filePaths(4, 5), &err));
+        sizes[1] = fileSize(path);
+        CHECK(log.append(filePaths(6, 6), &err));
+        sizes[2] = fileSize(path);
+        CHECK(log.lastId() == 6);
+    }
+    check(path, 6, false);
+    CHECK(access((path + ".tmp").constData(), F_OK));
+
+    // the last append only got halfway
+    CHECK(!truncate(path.constData(), sizes[2] - 3));
+    check(path, 5, true);
+    CHECK(fileSize(path) == sizes[1]);
+
+    // so did the one before, only part of the header of id 5 is left
+    const off_t recordSize = (sizes[1] - sizes[0]) / 2; // ids 4 and 5
+    CHECK(!truncate(path.constData(), sizes[0] + recordSize + 5));
+    check(path, 4, true);
+
+    // the next id rdm hands out goes where the torn record was
+    {
+        FileIdLog log;
+        CHECK(log.load(path, idsToPaths, &err));
+        CHECK(log.append(filePaths(5, 7), &err));
+    }
+    check(path, 7, false);
+
+    // a damaged path takes every id after it along
+    {
+        const int fd = open(path.constData(), O_WRONLY);
+        CHECK(fd != -1);
+        CHECK(pwrite(fd, "X", 1, sizes[0] - 1) == 1);
+        close(fd);
+    }
+    check(path, 2, true);
+
+    // rewriting the log starts it over
+    {
+        FileIdLog log;
+        CHECK(log.write(path, filePaths(1, 4), &err));
+    }
+    check(path, 4, false);
+
+    // a log from another version isn't used at all
+    {
+        const int fd = open(path.constData(), O_WRONLY);
+        CHECK(fd != -1);
+        const uint16_t version = 0;
+        CHECK(pwrite(fd, &version, sizeof(version), sizeof(uint32_t)) == sizeof(version));
+        close(fd);
+
+        FileIdLog log;
+        CHECK(!log.load(path, idsToPaths, &err) && !err.isEmpty());
+        CHECK(!log.isOpen());
+    }
+
+    unlink(path.constData());
+    if (failures)
+        fprintf(stderr, "%d failures\n", failures);
+    return failures ? 1 : 0;
+}
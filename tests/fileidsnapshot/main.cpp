@@ -0,0 +1,118 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Publishes a few generations of visited files, maps them the way rp does
+// and looks every file up by id and by path, along with ones that aren't
+// there. A damaged snapshot must not load.
+
+#include "FileIdSnapshot.h"
+#include <stdio.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            ++failures;                                                 \
+        }                                                               \
+    } while (0)
+
+static Path filePath(uint32_t id)
+{
+    return String::format<64>("/src/project/dir%u/file%u.h", id % 7, id);
+}
+
+static void check(const FileIdSnapshot &snapshot, const Hash<uint32_t, Path> &files, uint32_t lastId)
+{
+    CHECK(!snapshot.isNull());
+    CHECK(snapshot.count() == static_cast<uint32_t>(files.size()));
+    for (uint32_t id=1; id<=lastId + 1; ++id) {
+        const bool visited = files.contains(id);
+        CHECK(snapshot.contains(id) == visited);
+        CHECK(snapshot.fileId(filePath(id)) == (visited ? id : 0));
+    }
+    CHECK(!snapshot.contains(0));
+    CHECK(!snapshot.fileId(Path()));
+    CHECK(!snapshot.fileId("/src/project/dir1/file1.hh"));
+}
+
+int main()
+{
+    const Path base = String::format<64>("/tmp/rtags-fileidsnapshot-%d", getpid());
+    for (uint32_t generation=1; generation<=4; ++generation)
+        FileIdSnapshot::remove(base, generation);
+
+    String err;
+    Hash<uint32_t, Path> files;
+    {
+        CHECK(FileIdSnapshot::write(base, 1, files, &err));
+        FileIdSnapshot snapshot;
+        CHECK(snapshot.isNull());
+        CHECK(!snapshot.fileId(filePath(1)));
+        CHECK(snapshot.load(base, 1, &err));
+        check(snapshot, files, 1);
+    }
+
+    // every third id visited, enough of them for paths to share buckets
+    enum { Count = 5000 };
+    for (uint32_t id=1; id<=Count; id+=3)
+        files[id] = filePath(id);
+    CHECK(FileIdSnapshot::write(base, 2, files, &err));
+    CHECK(access((FileIdSnapshot::path(base, 2) + ".tmp").constData(), F_OK));
+    FileIdSnapshot second;
+    CHECK(second.load(base, 2, &err));
+    check(second, files, Count);
+
+    // the next generation doesn't disturb a job that still has this one
+    const Hash<uint32_t, Path> old = files;
+    for (uint32_t id=2; id<=Count; id+=3)
+        files[id] = filePath(id);
+    files.remove(1);
+    CHECK(FileIdSnapshot::write(base, 3, files, &err));
+    CHECK(FileIdSnapshot::remove(base, 2));
+    FileIdSnapshot third;
+    CHECK(third.load(base, 3, &err));
+    check(third, files, Count);
+    check(second, old, Count);
+
+    // a generation that's gone or damaged
+    {
+        FileIdSnapshot snapshot;
+        CHECK(!snapshot.load(base, 2, &err));
+        CHECK(snapshot.isNull());
+    }
+    {
+        // cut short
+        CHECK(FileIdSnapshot::write(base, 4, files, &err));
+        const Path path = FileIdSnapshot::path(base, 4);
+        CHECK(!truncate(path.constData(), 100));
+        FileIdSnapshot snapshot;
+        CHECK(!snapshot.load(base, 4, &err));
+        CHECK(snapshot.isNull());
+
+        // not even a header
+        CHECK(!truncate(path.constData(), 4));
+        CHECK(!snapshot.load(base, 4, &err));
+        CHECK(snapshot.isNull());
+    }
+
+    for (uint32_t generation=1; generation<=4; ++generation)
+        CHECK(FileIdSnapshot::remove(base, generation));
+    if (failures)
+        fprintf(stderr, "%d failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,106 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Encodes String and fixed size keyed maps, small ones that are searched
+// directly and large ones that get an Eytzinger index, and looks every key,
+// a miss between each pair of keys and a miss past the end up again.
+
+#include "FileMap.h"
+#include <rct/Map.h>
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            ++failures;                                                 \
+        }                                                               \
+    } while (0)
+
+// keys are the even numbers from 2 so there's a miss before, between and
+// after all of them
+static void checkFixed(int count)
+{
+    Map<uint64_t, uint32_t> map;
+    for (int i=1; i<=count; ++i)
+        map[i * 2] = i;
+    const String encoded = FileMap<uint64_t, uint32_t>::encode(map);
+    CHECK(!encoded.isEmpty());
+
+    FileMap<uint64_t, uint32_t> fileMap;
+    fileMap.init(encoded.constData(), encoded.size());
+    CHECK(fileMap.count() == count);
+
+    bool match;
+    for (int i=1; i<=count; ++i) {
+        const size_t idx = fileMap.lowerBound(i * 2, &match);
+        CHECK(match && idx == static_cast<size_t>(i - 1));
+        CHECK(fileMap.keyAt(i - 1) == static_cast<uint64_t>(i * 2));
+        CHECK(fileMap.value(i * 2) == static_cast<uint32_t>(i));
+
+        // the first key above the miss
+        CHECK(fileMap.lowerBound((i * 2) - 1, &match) == static_cast<size_t>(i - 1) && !match);
+    }
+    CHECK(fileMap.lowerBound((count * 2) + 1, &match) == static_cast<size_t>(-1) && !match);
+    CHECK(!fileMap.value((count * 2) + 1, &match) && !match);
+}
+
+static String name(int i)
+{
+    return String::format<32>("symbol%05d", i * 2);
+}
+
+static void checkString(int count)
+{
+    Map<String, String> map;
+    for (int i=1; i<=count; ++i)
+        map[name(i)] = String::format<32>("value%d", i);
+    const String encoded = FileMap<String, String>::encode(map);
+    CHECK(!encoded.isEmpty());
+
+    FileMap<String, String> fileMap;
+    fileMap.init(encoded.constData(), encoded.size());
+    CHECK(fileMap.count() == count);
+
+    bool match;
+    for (int i=1; i<=count; ++i) {
+        const String key = name(i);
+        CHECK(fileMap.lowerBound(key, &match) == static_cast<size_t>(i - 1) && match);
+        CHECK(fileMap.keyAt(i - 1) == key);
+        const KeyView view = fileMap.keyViewAt(i - 1);
+        CHECK(!view.compare(key) && !view.data[view.size]);
+        CHECK(fileMap.value(key) == String::format<32>("value%d", i));
+
+        // symbol00001 sorts before symbol00002 and so on
+        const String miss = String::format<32>("symbol%05d", (i * 2) - 1);
+        CHECK(fileMap.lowerBound(miss, &match) == static_cast<size_t>(i - 1) && !match);
+    }
+    CHECK(fileMap.lowerBound("symbolz", &match) == static_cast<size_t>(-1) && !match);
+    CHECK(fileMap.value("symbolz", &match).isEmpty() && !match);
+}
+
+int main()
+{
+    for (int count : { 1, 2, 100, 127, 128, 129, 1000 }) {
+        checkFixed(count);
+        checkString(count);
+    }
+
+    if (failures)
+        fprintf(stderr, "%d failures\n", failures);
+    return failures ? 1 : 0;
+}
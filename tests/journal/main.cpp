@@ -0,0 +1,140 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Replays a journal after cutting its last record short and after damaging a
+// record in the middle, and checks that the good records before the damage
+// come back, the rest is cut off and appending carries on from there.
+
+#include "Journal.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            ++failures;                                                 \
+        }                                                               \
+    } while (0)
+
+enum { Checkpoint = 12 };
+
+static off_t fileSize(const Path &path)
+{
+    struct stat st;
+    return stat(path.constData(), &st) ? -1 : st.st_size;
+}
+
+// returns the journal size after each record
+static List<uint64_t> writeJournal(const Path &path, const List<String> &records)
+{
+    List<uint64_t> sizes;
+    Journal journal;
+    String err;
+    CHECK(journal.reset(path, Checkpoint, &err));
+    for (const String &record : records) {
+        CHECK(journal.append(record, &err));
+        sizes.append(journal.size());
+    }
+    return sizes;
+}
+
+static List<String> loadJournal(const Path &path, uint64_t *size = 0)
+{
+    List<String> records;
+    Journal journal;
+    String err;
+    CHECK(journal.load(path, Checkpoint, records, &err));
+    CHECK(journal.isOpen());
+    CHECK(fileSize(path) == static_cast<off_t>(journal.size()));
+    if (size)
+        *size = journal.size();
+    return records;
+}
+
+int main()
+{
+    const Path path = String::format<64>("/tmp/rtags-journal-%d", getpid());
+    unlink(path.constData());
+
+    List<String> records;
+    records << "first" << String(1000, 'x') << "third";
+    List<uint64_t> sizes = writeJournal(path, records);
+    CHECK(loadJournal(path) == records);
+
+    // a journal for another project file isn't replayed
+    {
+        List<String> other;
+        Journal journal;
+        CHECK(!journal.load(path, Checkpoint + 1, other));
+        CHECK(other.isEmpty() && !journal.isOpen());
+    }
+
+    // the last append only got halfway
+    CHECK(!truncate(path.constData(), sizes.at(2) - 2));
+    uint64_t size;
+    List<String> loaded = loadJournal(path, &size);
+    CHECK(loaded.size() == 2 && loaded.at(0) == records.at(0) && loaded.at(1) == records.at(1));
+    CHECK(size == sizes.at(1));
+
+    // nothing left of the last one but part of its header
+    CHECK(!truncate(path.constData(), sizes.at(1) + 3));
+    loaded = loadJournal(path, &size);
+    CHECK(loaded.size() == 2 && size == sizes.at(1));
+
+    // appending after the replay goes where the bad record was
+    {
+        List<String> ignored;
+        Journal journal;
+        String err;
+        CHECK(journal.load(path, Checkpoint, ignored, &err));
+        CHECK(journal.append("fourth", &err));
+    }
+    loaded = loadJournal(path);
+    CHECK(loaded.size() == 3 && loaded.at(2) == "fourth");
+
+    // a damaged record in the middle takes everything after it along
+    sizes = writeJournal(path, records);
+    {
+        const int fd = open(path.constData(), O_WRONLY);
+        CHECK(fd != -1);
+        CHECK(pwrite(fd, "y", 1, sizes.at(1) - 10) == 1);
+        close(fd);
+    }
+    loaded = loadJournal(path, &size);
+    CHECK(loaded.size() == 1 && loaded.at(0) == records.at(0));
+    CHECK(size == sizes.at(0));
+
+    // and so does a header claiming more than there is
+    sizes = writeJournal(path, records);
+    {
+        const int fd = open(path.constData(), O_WRONLY);
+        CHECK(fd != -1);
+        const uint32_t huge = 1 << 30;
+        CHECK(pwrite(fd, &huge, sizeof(huge), sizes.at(0)) == sizeof(huge));
+        close(fd);
+    }
+    loaded = loadJournal(path, &size);
+    CHECK(loaded.size() == 1 && size == sizes.at(0));
+
+    unlink(path.constData());
+    if (failures)
+        fprintf(stderr, "%d failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,135 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Appends segments for a few files to a pack, twice for one of them, and
+// opens the maps of the current segment of each file again. Then compacts the
+// live segments into the next generation and opens them from there, while the
+// old generation stays readable through the mapping that's still around.
+
+#include "Pack.h"
+#include <rct/Map.h>
+#include <stdio.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            ++failures;                                                 \
+        }                                                               \
+    } while (0)
+
+typedef FileMap<uint64_t, uint32_t> Numbers;
+typedef FileMap<String, String> Names;
+
+// map 0 has count numbers for fileId, map 1 the name of the file
+static Pack::SegmentMaps segmentMaps(uint32_t fileId, int count)
+{
+    Pack::SegmentMaps maps(2);
+    Map<uint64_t, uint32_t> numbers;
+    for (int i=0; i<count; ++i)
+        numbers[i] = fileId + i;
+    CHECK(Numbers::encode(numbers, maps[0]));
+    Map<String, String> names;
+    names["name"] = String::format<32>("file%u", fileId);
+    CHECK(Names::encode(names, maps[1]));
+    return maps;
+}
+
+static void check(const std::shared_ptr<Pack> &pack, const Pack::Segment &segment, uint32_t fileId, int count)
+{
+    CHECK(pack && pack->contains(segment, fileId));
+    if (!pack)
+        return;
+    String err;
+    const std::shared_ptr<Numbers> numbers = pack->openFileMap<Numbers>(segment, fileId, 0, &err);
+    CHECK(numbers);
+    if (numbers) {
+        CHECK(numbers->count() == count);
+        for (int i=0; i<count; ++i)
+            CHECK(numbers->value(i) == fileId + i);
+    }
+    const std::shared_ptr<Names> names = pack->openFileMap<Names>(segment, fileId, 1, &err);
+    CHECK(names && names->value("name") == String::format<32>("file%u", fileId));
+
+    CHECK(!pack->openFileMap<Numbers>(segment, fileId, 2, &err));
+    CHECK(!pack->contains(segment, fileId + 1));
+}
+
+int main()
+{
+    const Path base = String::format<64>("/tmp/rtags-pack-%d", getpid());
+    unlink(Pack::path(base, 1).constData());
+    unlink(Pack::path(base, 2).constData());
+
+    String err;
+    Hash<uint32_t, Pack::Segment> segments, written;
+    Hash<uint32_t, Pack::SegmentMaps> maps;
+    maps[1] = segmentMaps(1, 10);
+    maps[2] = segmentMaps(2, 200);
+    CHECK(Pack::append(base, 1, maps, segments, &err));
+    CHECK(segments.size() == 2);
+
+    // file 1 again with other numbers, its first segment is stale now
+    const Pack::Segment stale = segments[1];
+    maps.clear();
+    maps[1] = segmentMaps(1, 20);
+    CHECK(Pack::append(base, 1, maps, written, &err));
+    CHECK(written.size() == 1 && written[1].offset >= stale.end());
+    segments[1] = written[1];
+
+    std::shared_ptr<Pack> pack = Pack::load(Pack::path(base, 1), &err);
+    check(pack, segments[1], 1, 20);
+    check(pack, segments[2], 2, 200);
+    check(pack, stale, 1, 10);
+
+    Hash<uint32_t, std::shared_ptr<Pack> > packs;
+    packs[1] = pack;
+    Hash<uint32_t, Pack::Segment> compacted;
+    CHECK(Pack::compact(base, 2, segments, packs, compacted, &err));
+    CHECK(compacted.size() == 2);
+    CHECK(compacted[1].generation == 2 && compacted[2].generation == 2);
+    CHECK(compacted[1].size == segments[1].size && compacted[2].size == segments[2].size);
+    CHECK(access((Pack::path(base, 2) + ".tmp").constData(), F_OK));
+
+    // only the live segments made it
+    const std::shared_ptr<Pack> next = Pack::load(Pack::path(base, 2), &err);
+    CHECK(next && next->size() == compacted[1].size + compacted[2].size);
+    check(next, compacted[1], 1, 20);
+    check(next, compacted[2], 2, 200);
+
+    // the old generation goes away under the mapping
+    CHECK(Pack::remove(base, 1));
+    CHECK(!Pack::load(Pack::path(base, 1)));
+    check(pack, segments[1], 1, 20);
+    pack.reset();
+    packs.clear();
+
+    // and appending goes on in the new one
+    maps.clear();
+    maps[3] = segmentMaps(3, 5);
+    written.clear();
+    CHECK(Pack::append(base, 2, maps, written, &err));
+    CHECK(written[3].generation == 2 && written[3].offset == next->size());
+    check(Pack::load(Pack::path(base, 2), &err), written[3], 3, 5);
+    check(next, compacted[1], 1, 20);
+
+    CHECK(Pack::remove(base, 2));
+    if (failures)
+        fprintf(stderr, "%d failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,169 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Adds and removes names in a few files until the trigram postings have been
+// compacted, and after each step checks prefix and trigram searches against
+// the names that should be there. Then does the same for an index that's been
+// saved and loaded again.
+
+#include "SymbolNameIndex.h"
+#include <rct/Set.h>
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            ++failures;                                                 \
+        }                                                               \
+    } while (0)
+
+// what the index should have
+typedef Map<String, Set<uint32_t> > Expected;
+
+static bool containsNoCase(const String &name, const String &fragment)
+{
+    return name.contains(fragment, String::CaseInsensitive);
+}
+
+static void check(const SymbolNameIndex &index, const Expected &expected,
+                  const String &prefix, const List<String> &fragments)
+{
+    Set<String> visited;
+    index.visit(prefix, fragments, [&](const String &name, const List<uint32_t> &files) {
+            CHECK(!visited.contains(name));
+            visited.insert(name);
+            const Set<uint32_t> want = expected.value(name);
+            CHECK(files.size() == want.size());
+            for (uint32_t file : files)
+                CHECK(want.contains(file));
+            if (!prefix.isEmpty())
+                CHECK(name.startsWith(prefix));
+        });
+
+    // every name that matches must be a candidate
+    for (const auto &entry : expected) {
+        bool match = true;
+        if (!prefix.isEmpty()) {
+            match = entry.first.startsWith(prefix);
+        } else {
+            for (const String &fragment : fragments)
+                match = match && containsNoCase(entry.first, fragment);
+        }
+        if (match && !visited.contains(entry.first)) {
+            fprintf(stderr, "%s not found for %s/%s\n", entry.first.constData(),
+                    prefix.constData(), String::join(fragments, ',').constData());
+            ++failures;
+        }
+    }
+}
+
+static void checkAll(const SymbolNameIndex &index, const Expected &expected)
+{
+    CHECK(index.isEmpty() == expected.isEmpty());
+    check(index, expected, "Foo::", List<String>());
+    check(index, expected, "Bar::method1", List<String>());
+    check(index, expected, "Nothing", List<String>());
+    check(index, expected, String(), List<String>() << "METHOD");
+    check(index, expected, String(), List<String>() << "foo::" << "d42");
+    check(index, expected, String(), List<String>() << "od7");
+    check(index, expected, String(), List<String>() << "zzz");
+    // too short for a trigram, that's every name
+    check(index, expected, String(), List<String>() << "x");
+}
+
+static String name(int i)
+{
+    return String::format<64>("%s::method%d", (i % 2) ? "Foo" : "Bar", i);
+}
+
+static void insert(SymbolNameIndex &index, Expected &expected, const String &name, uint32_t file)
+{
+    index.insert(name, file);
+    expected[name].insert(file);
+}
+
+static void remove(SymbolNameIndex &index, Expected &expected, const String &name, uint32_t file)
+{
+    index.remove(name, file);
+    auto it = expected.find(name);
+    if (it != expected.end() && it->second.remove(file) && it->second.isEmpty())
+        expected.erase(it);
+}
+
+int main()
+{
+    SymbolNameIndex index;
+    Expected expected;
+    checkAll(index, expected);
+
+    // name i is in files 1 to (i % 3) + 1
+    enum { Count = 3000 };
+    for (int i=0; i<Count; ++i) {
+        for (uint32_t file=1; file<=static_cast<uint32_t>(i % 3) + 1; ++file)
+            insert(index, expected, name(i), file);
+    }
+    insert(index, expected, name(0), 1); // again
+    checkAll(index, expected);
+
+    // names only go with their last file
+    for (int i=0; i<Count; ++i)
+        remove(index, expected, name(i), 1);
+    remove(index, expected, name(1), 1); // not in there anymore
+    remove(index, expected, "Baz::nothing", 1);
+    checkAll(index, expected);
+
+    // enough dead names for the postings to be rebuilt, twice
+    for (int round=0; round<2; ++round) {
+        for (int i=0; i<Count; ++i) {
+            if (i % 5) {
+                for (uint32_t file=2; file<=4; ++file)
+                    remove(index, expected, name(i), file);
+            }
+        }
+        checkAll(index, expected);
+        for (int i=0; i<Count; i+=2)
+            insert(index, expected, name(i), 4);
+        checkAll(index, expected);
+    }
+
+    // saved with the project
+    String data;
+    {
+        Serializer serializer(data);
+        serializer << index;
+    }
+    SymbolNameIndex loaded;
+    {
+        Deserializer deserializer(data.constData(), data.size());
+        deserializer >> loaded;
+    }
+    checkAll(loaded, expected);
+    for (const auto &entry : Expected(expected)) {
+        for (uint32_t file : entry.second)
+            remove(loaded, expected, entry.first, file);
+    }
+    CHECK(expected.isEmpty());
+    checkAll(loaded, expected);
+
+    index.clear();
+    checkAll(index, expected);
+
+    if (failures)
+        fprintf(stderr, "%d failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,93 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Forces two usrs onto the same id and checks that the second one is given
+// an id of its own, now and after the dictionary is loaded again.
+
+#include "RTags.h"
+#include "UsrDictionary.h"
+#include <stdio.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            ++failures;                                                 \
+        }                                                               \
+    } while (0)
+
+static void check(const UsrDictionary &dictionary, const String &first, const String &second)
+{
+    const uint64_t id = RTags::usrId(first);
+    CHECK(dictionary.id(first) == id);
+    CHECK(dictionary.usr(id) == first);
+    const uint64_t remapped = dictionary.id(second);
+    CHECK(remapped != id);
+    CHECK(remapped != 0);
+    CHECK(dictionary.usr(remapped) == second);
+    CHECK(dictionary.remapped().size() == 1);
+    CHECK(dictionary.count() == 2);
+}
+
+int main()
+{
+    const Path path = String::format<64>("/tmp/rtags-usrdictionary-%d", getpid());
+    unlink(path.constData());
+
+    const String first = "c:@F@first", second = "c:@F@second";
+    String err;
+    {
+        UsrDictionary dictionary;
+        CHECK(dictionary.load(path, &err));
+
+        Hash<uint64_t, String> usrs;
+        usrs[RTags::usrId(first)] = first;
+        Set<String> collided;
+        CHECK(dictionary.insert(usrs, &err, &collided));
+        CHECK(collided.isEmpty());
+
+        // what rp sends for second if it hashed to the same id
+        usrs[RTags::usrId(first)] = second;
+        CHECK(dictionary.insert(usrs, &err, &collided));
+        CHECK(collided.size() == 1 && collided.contains(second));
+        check(dictionary, first, second);
+
+        // from a job that doesn't know about the remapping yet
+        collided.clear();
+        CHECK(dictionary.insert(usrs, &err, &collided));
+        CHECK(collided.contains(second));
+        CHECK(dictionary.count() == 2);
+
+        // and from one that does
+        usrs.clear();
+        usrs[dictionary.id(second)] = second;
+        collided.clear();
+        CHECK(dictionary.insert(usrs, &err, &collided));
+        CHECK(collided.isEmpty());
+        CHECK(dictionary.count() == 2);
+    }
+
+    UsrDictionary dictionary;
+    CHECK(dictionary.load(path, &err));
+    check(dictionary, first, second);
+
+    unlink(path.constData());
+    if (failures)
+        fprintf(stderr, "%d failures\n", failures);
+    return failures ? 1 : 0;
+}